@@ -0,0 +1,308 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define SYS_CPU "/sys/devices/system/cpu/"
+#define SYS_NODE "/sys/devices/system/node/"
+
+// Upper bound of a cpu list, 4096 cpus in single ranges stay well below it.
+#define CPULIST_SIZE 65536
+
+static int possible_cpus;
+
+// Highest id of a "0-63" or "0,2-5" list, or -1.
+static int last_in_list(const char *path)
+{
+    char buf[256];
+
+    if (read_procfs_at(AT_FDCWD, path, buf, sizeof buf) <= 0)
+        return -1;
+
+    char *last = buf;
+    for (char *c=buf; *c; c++) {
+        if ((*c == '-' || *c == ',') && c[1] >= '0' && c[1] <= '9')
+            last = c + 1;
+    }
+
+    return *last >= '0' && *last <= '9' ? atoi(last) : -1;
+}
+
+// Number of cpu ids the kernel may ever use, sched_getaffinity fails with
+// EINVAL on a mask with less room.
+static int count_possible_cpus(void)
+{
+    int ncpus = __atomic_load_n(&possible_cpus, __ATOMIC_RELAXED);
+    if (ncpus)
+        return ncpus;
+
+    ncpus = last_in_list(SYS_CPU "possible") + 1;
+    if (ncpus <= 0)
+        ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpus <= 0)
+        ncpus = CPU_SETSIZE;
+
+    __atomic_store_n(&possible_cpus, ncpus, __ATOMIC_RELAXED);
+
+    return ncpus;
+}
+
+int cpu_mask_alloc(struct cpu_mask *mask)
+{
+    int ncpus = count_possible_cpus();
+
+    STATS_ADD(allocs, 1);
+    mask->set = CPU_ALLOC(ncpus);
+    if (!mask->set)
+        return -1;
+
+    mask->size = CPU_ALLOC_SIZE(ncpus);
+    CPU_ZERO_S(mask->size, mask->set);
+
+    return 0;
+}
+
+void cpu_mask_free(struct cpu_mask *mask)
+{
+    if (mask->set)
+        CPU_FREE(mask->set);
+
+    mask->set = NULL;
+    mask->size = 0;
+}
+
+// Allocates a mask that is still unallocated, or clears it.
+static int reset_mask(struct cpu_mask *mask)
+{
+    if (!mask->set)
+        return cpu_mask_alloc(mask);
+
+    CPU_ZERO_S(mask->size, mask->set);
+
+    return 0;
+}
+
+int cpu_mask_parse(struct cpu_mask *mask, const char *list)
+{
+    if (reset_mask(mask) < 0)
+        return -1;
+
+    size_t max_cpu = mask->size * 8;
+    char *next;
+
+    for (const char *c=list; *c && *c != '\n'; c = next) {
+        if (*c == ',') {
+            next = (char *) c + 1;
+            continue;
+        }
+
+        unsigned long first = strtoul(c, &next, 10);
+        unsigned long last = first;
+        if (next == c)
+            goto invalid_list;
+        if (*next == '-') {
+            c = next + 1;
+            last = strtoul(c, &next, 10);
+            if (next == c || last < first)
+                goto invalid_list;
+        }
+
+        for (unsigned long cpu=first; cpu <= last && cpu < max_cpu; cpu++)
+            CPU_SET_S(cpu, mask->size, mask->set);
+    }
+
+    return CPU_COUNT_S(mask->size, mask->set);
+
+invalid_list:
+    errno = EINVAL;
+
+    return -1;
+}
+
+static int read_cpulist(const char *path, struct cpu_mask *mask)
+{
+    char *buf = prax_malloc(CPULIST_SIZE);
+    if (!buf)
+        return -1;
+
+    int ret = -1;
+    if (read_procfs_at(AT_FDCWD, path, buf, CPULIST_SIZE) >= 0)
+        ret = cpu_mask_parse(mask, buf);
+
+    free(buf);
+
+    return ret;
+}
+
+int node_cpu_mask(int node, struct cpu_mask *mask)
+{
+    char path[64];
+
+    snprintf(path, sizeof path, SYS_NODE "node%d/cpulist", node);
+
+    return read_cpulist(path, mask);
+}
+
+/*
+ * The last level cache of cpu is its highest level data or unified cache,
+ * whose shared_cpu_list is every cpu it is shared with.
+ */
+int llc_cpu_mask(int cpu, struct cpu_mask *mask)
+{
+    char path[96];
+    char buf[32];
+    int llc = -1;
+    int llc_level = 0;
+
+    for (int index=0; ; index++) {
+        snprintf(path, sizeof path, SYS_CPU "cpu%d/cache/index%d/level",
+                 cpu, index);
+        if (read_procfs_at(AT_FDCWD, path, buf, sizeof buf) < 0)
+            break;
+        int level = atoi(buf);
+
+        snprintf(path, sizeof path, SYS_CPU "cpu%d/cache/index%d/type",
+                 cpu, index);
+        if (read_procfs_at(AT_FDCWD, path, buf, sizeof buf) < 0 ||
+            !strncmp(buf, "Instruction", 11))
+            continue;
+
+        if (level > llc_level) {
+            llc_level = level;
+            llc = index;
+        }
+    }
+
+    if (llc < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    snprintf(path, sizeof path, SYS_CPU "cpu%d/cache/index%d/shared_cpu_list",
+             cpu, llc);
+
+    return read_cpulist(path, mask);
+}
+
+int max_numa_node(void)
+{
+    int max_node = last_in_list(SYS_NODE "online");
+
+    // Kernels without CONFIG_NUMA have no node directory.
+    if (max_node < 0 && errno == ENOENT)
+        return 0;
+
+    return max_node;
+}
+
+int get_cpu_mask(profile_t *process, pid_t tid, struct cpu_mask *mask)
+{
+    if (!process || reset_mask(mask) < 0)
+        return -1;
+
+    if (sched_getaffinity(tid ? tid : process->pid, mask->size,
+                          mask->set) < 0)
+        return -1;
+
+    return CPU_COUNT_S(mask->size, mask->set);
+}
+
+int profile_refresh_affinity(profile_t *process)
+{
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    int ncpus = get_cpu_mask(process, 0, &(process->affinity));
+    process->cpu_affinity = ncpus;
+
+    return ncpus < 0 ? -1 : 0;
+}
+
+// Pins every thread listed in the task directory, one exiting meanwhile is
+// not an error.
+static int set_threads_mask(profile_t *process, const struct cpu_mask *mask)
+{
+    struct thread_table *table = &(process->tasks);
+    int ret = 0;
+
+    int task_fd = prax_openat(process->proc_fd, TASK,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+        return -1;
+
+    int ntasks = list_numeric_dir(task_fd, &(table->listing),
+                                  &(table->listing_cap));
+    if (ntasks < 0)
+        ret = -1;
+
+    for (int i=0; i < ntasks; i++) {
+        if (sched_setaffinity(table->listing[i], mask->size, mask->set) < 0 &&
+            errno != ESRCH)
+            ret = -1;
+    }
+
+    close(task_fd);
+
+    return ret;
+}
+
+int set_cpu_mask(profile_t *process, const struct cpu_mask *mask, int flags)
+{
+    if (!process || !mask || !mask->set)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    if (!is_alive(process)) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    int ret = flags & AFFINITY_THREADS ?
+              set_threads_mask(process, mask) :
+              sched_setaffinity(process->pid, mask->size, mask->set);
+    int err = errno;
+
+    // The kernel drops the cpus that are offline, so what is kept is read
+    // back rather than copied from mask.
+    profile_refresh_affinity(process);
+    errno = err;
+
+    return ret;
+}
+
+// Pins process to the cpus of mask, EINVAL when it has none.
+static int bind_mask(profile_t *process, struct cpu_mask *mask, int ncpus,
+                     int flags)
+{
+    int ret = -1;
+
+    if (ncpus == 0)
+        errno = EINVAL;
+    else if (ncpus > 0)
+        ret = set_cpu_mask(process, mask, flags);
+
+    cpu_mask_free(mask);
+
+    return ret;
+}
+
+int bind_numa_node(profile_t *process, int node, int flags)
+{
+    struct cpu_mask mask = { 0 };
+
+    return bind_mask(process, &mask, node_cpu_mask(node, &mask), flags);
+}
+
+int bind_llc(profile_t *process, int cpu, int flags)
+{
+    struct cpu_mask mask = { 0 };
+
+    return bind_mask(process, &mask, llc_cpu_mask(cpu, &mask), flags);
+}
@@ -0,0 +1,579 @@
+/*
+ * Measures ns, allocations and syscalls per call of the public accessors
+ * against a synthetic target process.
+ *
+ *   bench_accessors [-f fds] [-t threads] [-i iterations] [-o name]
+ *
+ * The target is a forked child holding the requested number of extra open
+ * descriptors and threads.  Allocations are counted by interposing malloc,
+ * syscalls with the raw_syscalls:sys_enter perf tracepoint, which needs
+ * tracefs mounted and a permissive perf_event_paranoid; without it the
+ * syscall counts are reported as null.  -o runs only the named case.
+ */
+
+#include "prax.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting;
+static uint64_t allocs;
+
+static inline void count_alloc(void)
+{
+    if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    count_alloc();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_alloc();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static const char *tracepoint_ids[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+};
+
+// Counts the syscalls entered by this process and the threads it starts.
+static int open_syscall_counter(void)
+{
+    long id = -1;
+
+    for (size_t i=0; i < sizeof tracepoint_ids / sizeof *tracepoint_ids; i++) {
+        FILE *fh = fopen(tracepoint_ids[i], "r");
+        if (!fh)
+            continue;
+        if (fscanf(fh, "%ld", &id) != 1)
+            id = -1;
+        fclose(fh);
+        if (id >= 0)
+            break;
+    }
+
+    if (id < 0)
+        return -1;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof attr;
+    attr.config = id;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *idle_thread(void *arg)
+{
+    for (;;)
+        pause();
+
+    return arg;
+}
+
+/*
+ * Forks the target, it reports on ready_fd once every descriptor and thread
+ * is in place.
+ */
+static pid_t start_target(int nfds, int nthreads)
+{
+    int ready[2];
+    if (pipe(ready) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0) {
+        close(ready[0]);
+
+        struct rlimit nofile;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+            nofile.rlim_cur < (rlim_t) nfds + 64) {
+            nofile.rlim_cur = nfds + 64;
+            if (nofile.rlim_max < nofile.rlim_cur)
+                nofile.rlim_max = nofile.rlim_cur;
+            setrlimit(RLIMIT_NOFILE, &nofile);
+        }
+
+        for (int i=0; i < nfds; i++)
+            open("/dev/null", O_RDONLY);
+
+        for (int i=0; i < nthreads; i++) {
+            pthread_t thread;
+            pthread_create(&thread, NULL, idle_thread, NULL);
+        }
+
+        char byte = 0;
+        if (write(ready[1], &byte, 1) < 0)
+            _exit(1);
+
+        for (;;)
+            pause();
+    }
+
+    close(ready[1]);
+
+    char byte;
+    ssize_t len = read(ready[0], &byte, 1);
+    close(ready[0]);
+
+    if (len != 1) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    return pid;
+}
+
+static profile_t *process;
+static pid_t target;
+static scanner_t *scanner;
+static scanner_t *uring_scanner;
+static control_t *control;
+static taskstats_batch_t *batch;
+static struct taskstats batch_stats[1];
+
+static int run_init_profile(void)
+{
+    profile_t *profile = init_profile(target);
+    if (!profile)
+        return -1;
+
+    free_profile(profile);
+
+    return 0;
+}
+
+static int run_refresh_stat(void)
+{
+    return profile_refresh_stat(process);
+}
+
+static int run_refresh_status(void)
+{
+    return profile_refresh_status(process);
+}
+
+static int run_refresh_io(void)
+{
+    return profile_refresh_io(process);
+}
+
+static int run_refresh_schedstat(void)
+{
+    return profile_refresh_schedstat(process);
+}
+
+static int run_refresh_statm(void)
+{
+    return profile_refresh_statm(process);
+}
+
+static int run_refresh_memory(void)
+{
+    return profile_refresh_memory(process);
+}
+
+static int run_smaps(void)
+{
+    return process_smaps(process, 0) < 0 ? -1 : 0;
+}
+
+static int run_smaps_by_file(void)
+{
+    return process_smaps(process, SMAPS_BY_FILE) < 0 ? -1 : 0;
+}
+
+static int run_refresh_numa(void)
+{
+    return profile_refresh_numa(process);
+}
+
+static int run_refresh_taskstats(void)
+{
+    return profile_refresh_taskstats(process);
+}
+
+static int run_taskstats_batch(void)
+{
+    return taskstats_batch_get(batch, &target, 1, batch_stats, NULL) == 1 ?
+           0 : -1;
+}
+
+static int run_get_signals(void)
+{
+    return get_signals(process);
+}
+
+static int run_pid_name(void)
+{
+    return pid_name(process);
+}
+
+static int run_get_rlimits(void)
+{
+    return get_rlimits(process, (1 << NLIMITS) - 1);
+}
+
+static int run_get_rlimits_audit(void)
+{
+    return get_rlimits(process, LIMIT_NOFILE | LIMIT_MEMLOCK);
+}
+
+static int run_refresh_limits(void)
+{
+    return profile_refresh_limits(process);
+}
+
+static int run_get_process_nice(void)
+{
+    return get_process_nice(process);
+}
+
+static int run_get_ioprio(void)
+{
+    return get_ioprio(process);
+}
+
+static int run_running_threads(void)
+{
+    return running_threads(process);
+}
+
+static int run_thread_stats(void)
+{
+    return process_thread_stats(process, 0);
+}
+
+static int run_fd_stats(void)
+{
+    return process_fd_stats(process);
+}
+
+static int run_fd_refresh(void)
+{
+    return process_fd_refresh(process, 0);
+}
+
+static int run_fd_refresh_trust(void)
+{
+    return process_fd_refresh(process, FD_REFRESH_TRUST);
+}
+
+static int run_is_traced(void)
+{
+    is_traced(process);
+    return 0;
+}
+
+static int run_get_start_time(void)
+{
+    get_start_time(process);
+    return 0;
+}
+
+static int run_virtual_mem(void)
+{
+    virtual_mem(process);
+    return 0;
+}
+
+static int run_context_switches(void)
+{
+    voluntary_context_switches(process);
+    return 0;
+}
+
+static int run_cpu_affinity(void)
+{
+    cpu_affinity(process);
+    return 0;
+}
+
+static int run_process_sid(void)
+{
+    process_sid(process);
+    return 0;
+}
+
+static int run_getusernam(void)
+{
+    getusernam(process);
+    return 0;
+}
+
+static int run_scan_processes(void)
+{
+    struct proc_record *records;
+
+    return scan_processes(scanner, SCAN_STAT | SCAN_STATUS, &records) < 0 ?
+           -1 : 0;
+}
+
+static int run_scan_processes_uring(void)
+{
+    struct proc_record *records;
+
+    return scan_processes(uring_scanner, SCAN_STAT | SCAN_STATUS,
+                          &records) < 0 ? -1 : 0;
+}
+
+static int run_set_ioprio(void)
+{
+    return set_ioprio(process, IOPRIO_CLASS_BE, 4) < 0 ? -1 : 0;
+}
+
+static int run_control_ioprio(void)
+{
+    struct proc_set set = { PROC_SET_PIDS, &target, 1 };
+    struct control_result *results;
+
+    if (control_ioprio(control, &set, IOPRIO_CLASS_BE, 4, 0, &results) < 1)
+        return -1;
+
+    return results[0].err ? -1 : 0;
+}
+
+static int run_control_nice_threads(void)
+{
+    struct proc_set set = { PROC_SET_PIDS, &target, 1 };
+    struct control_result *results;
+
+    if (control_nice(control, &set, 10, CONTROL_THREADS, &results) < 1)
+        return -1;
+
+    return results[0].err ? -1 : 0;
+}
+
+struct bench_case {
+    const char *name;
+    int (*run)(void);
+    bool needs_root;
+    bool needs_uring;
+};
+
+static const struct bench_case cases[] = {
+    { "init_profile", run_init_profile, false },
+    { "profile_refresh_stat", run_refresh_stat, false },
+    { "profile_refresh_status", run_refresh_status, false },
+    { "profile_refresh_io", run_refresh_io, false },
+    { "profile_refresh_schedstat", run_refresh_schedstat, false },
+    { "profile_refresh_statm", run_refresh_statm, false },
+    { "profile_refresh_memory", run_refresh_memory, false },
+    { "process_smaps", run_smaps, false },
+    { "process_smaps_by_file", run_smaps_by_file, false },
+    { "profile_refresh_numa", run_refresh_numa, false },
+    { "profile_refresh_taskstats", run_refresh_taskstats, true },
+    { "taskstats_batch_get", run_taskstats_batch, true },
+    { "get_signals", run_get_signals, false },
+    { "pid_name", run_pid_name, false },
+    { "get_rlimits", run_get_rlimits, false },
+    { "get_rlimits_audit", run_get_rlimits_audit, false },
+    { "profile_refresh_limits", run_refresh_limits, false },
+    { "get_process_nice", run_get_process_nice, false },
+    { "get_ioprio", run_get_ioprio, false },
+    { "set_ioprio", run_set_ioprio, false },
+    { "control_ioprio", run_control_ioprio, false },
+    { "control_nice_threads", run_control_nice_threads, false },
+    { "running_threads", run_running_threads, false },
+    { "process_thread_stats", run_thread_stats, false },
+    { "process_fd_stats", run_fd_stats, false },
+    { "process_fd_refresh", run_fd_refresh, false },
+    { "process_fd_refresh_trust", run_fd_refresh_trust, false },
+    { "is_traced", run_is_traced, false },
+    { "get_start_time", run_get_start_time, false },
+    { "virtual_mem", run_virtual_mem, false },
+    { "voluntary_context_switches", run_context_switches, false },
+    { "cpu_affinity", run_cpu_affinity, false },
+    { "process_sid", run_process_sid, false },
+    { "getusernam", run_getusernam, false },
+    { "scan_processes", run_scan_processes, false },
+    { "scan_processes_uring", run_scan_processes_uring, false, true }
+};
+
+#define NCASES (sizeof cases / sizeof cases[0])
+
+static void run_case(const struct bench_case *bench, int iterations,
+                     int counter_fd, bool last)
+{
+    // The first call opens the cached descriptors and grows the tables.
+    bench->run();
+
+    uint64_t syscalls = 0;
+    int ok = 0;
+
+    allocs = 0;
+    if (counter_fd > -1) {
+        ioctl(counter_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    __atomic_store_n(&counting, 1, __ATOMIC_RELAXED);
+
+    uint64_t start = now_ns();
+    for (int i=0; i < iterations; i++) {
+        if (bench->run() == 0)
+            ok++;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    __atomic_store_n(&counting, 0, __ATOMIC_RELAXED);
+    if (counter_fd > -1) {
+        ioctl(counter_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter_fd, &syscalls, sizeof syscalls) != sizeof syscalls)
+            syscalls = 0;
+    }
+
+    printf("    {\"name\": \"%s\", \"iterations\": %d, "
+           "\"ns_per_call\": %.1f, \"allocs_per_call\": %.2f, ",
+           bench->name, iterations, (double) elapsed / iterations,
+           (double) allocs / iterations);
+
+    if (counter_fd > -1)
+        printf("\"syscalls_per_call\": %.2f, ",
+               (double) syscalls / iterations);
+    else
+        printf("\"syscalls_per_call\": null, ");
+
+    printf("\"ok\": %d}%s\n", ok, last ? "" : ",");
+}
+
+int main(int argc, char *argv[])
+{
+    int nfds = 64;
+    int nthreads = 8;
+    int iterations = 1000;
+    const char *only = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:i:o:")) != -1) {
+        switch (opt) {
+            case ('f'):
+                nfds = atoi(optarg);
+                break;
+            case ('t'):
+                nthreads = atoi(optarg);
+                break;
+            case ('i'):
+                iterations = atoi(optarg);
+                break;
+            case ('o'):
+                only = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f fds] [-t threads] "
+                                "[-i iterations] [-o name]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (iterations <= 0)
+        iterations = 1;
+
+    target = start_target(nfds, nthreads);
+    if (target < 0) {
+        fprintf(stderr, "could not start the target process\n");
+        return 1;
+    }
+
+    process = init_profile(target);
+    scanner = init_scanner(0);
+    batch = init_taskstats_batch(0);
+    control = init_control(0);
+    uring_scanner = init_scanner(0);
+    if (scanner_enable_uring(uring_scanner) < 0) {
+        free_scanner(uring_scanner);
+        uring_scanner = NULL;
+    }
+    if (!process || !scanner || !control) {
+        fprintf(stderr, "could not profile the target process\n");
+        kill(target, SIGKILL);
+        return 1;
+    }
+
+    bool root = geteuid() == 0;
+    int counter_fd = open_syscall_counter();
+
+    const struct bench_case *selected[NCASES];
+    size_t nselected = 0;
+    for (size_t i=0; i < NCASES; i++) {
+        if (cases[i].needs_root && (!root || !batch))
+            continue;
+        if (cases[i].needs_uring && !uring_scanner)
+            continue;
+        if (only && strcmp(only, cases[i].name))
+            continue;
+        selected[nselected++] = &cases[i];
+    }
+
+    printf("{\n  \"benchmark\": \"accessors\",\n"
+           "  \"target\": {\"pid\": %d, \"fds\": %d, \"threads\": %d},\n"
+           "  \"syscall_counter\": \"%s\",\n  \"results\": [\n",
+           target, nfds, nthreads,
+           counter_fd > -1 ? "perf_tracepoint" : "unavailable");
+
+    for (size_t i=0; i < nselected; i++)
+        run_case(selected[i], iterations, counter_fd, i + 1 == nselected);
+
+    printf("  ]\n}\n");
+
+    if (counter_fd > -1)
+        close(counter_fd);
+
+    free_taskstats_batch(batch);
+    free_scanner(scanner);
+    free_scanner(uring_scanner);
+    free_control(control);
+    free_profile(process);
+
+    kill(target, SIGKILL);
+    waitpid(target, NULL, 0);
+
+    return 0;
+}
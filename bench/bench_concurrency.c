@@ -0,0 +1,229 @@
+/*
+ * Measures how profiling throughput scales with the number of collector
+ * threads.
+ *
+ *   bench_concurrency [-p pids] [-m max_threads] [-d milliseconds]
+ *
+ * pids idle children are forked and split across 1, 2, 4, ... max_threads
+ * collectors (every online cpu by default), each with its own profiles.
+ * Every round refreshes the stat, status, statm and schedstat of each of
+ * its pids.  A second run has every collector refresh one shared profile,
+ * which serializes on the profile's lock.
+ */
+
+#include "prax.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+
+struct collector {
+    pthread_t thread;
+    pid_t *pids;
+    int npids;
+    profile_t *shared;
+    uint64_t calls;
+    int errors;
+};
+
+static pthread_barrier_t start;
+static int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int refresh(profile_t *process)
+{
+    int errors = 0;
+
+    errors += profile_refresh_stat(process) < 0;
+    errors += profile_refresh_status(process) < 0;
+    errors += profile_refresh_statm(process) < 0;
+    errors += profile_refresh_schedstat(process) < 0;
+
+    return errors;
+}
+
+static void *collect(void *arg)
+{
+    struct collector *collector = arg;
+    int nprofiles = collector->shared ? 1 : collector->npids;
+    profile_t *profiles[nprofiles];
+
+    for (int i=0; i < nprofiles; i++) {
+        profiles[i] = collector->shared ? collector->shared :
+                      init_profile(collector->pids[i]);
+        if (!profiles[i])
+            collector->errors++;
+    }
+
+    pthread_barrier_wait(&start);
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        for (int i=0; i < nprofiles; i++) {
+            if (!profiles[i])
+                continue;
+            collector->errors += refresh(profiles[i]);
+            collector->calls += 4;
+        }
+    }
+
+    if (!collector->shared) {
+        for (int i=0; i < nprofiles; i++)
+            free_profile(profiles[i]);
+    }
+
+    return NULL;
+}
+
+// Returns the calls per second of nthreads collectors over duration_ms.
+static double run(pid_t *pids, int npids, int nthreads, profile_t *shared,
+                  int duration_ms, int *errors)
+{
+    struct collector collectors[nthreads];
+    int per_thread = npids / nthreads;
+
+    memset(collectors, 0, sizeof collectors);
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+
+    for (int i=0; i < nthreads; i++) {
+        collectors[i].pids = pids + i * per_thread;
+        collectors[i].npids = per_thread;
+        collectors[i].shared = shared;
+        pthread_create(&(collectors[i].thread), NULL, collect,
+                       &collectors[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+
+    struct timespec duration = {
+        duration_ms / 1000, (duration_ms % 1000) * 1000000L
+    };
+    nanosleep(&duration, NULL);
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t calls = 0;
+    for (int i=0; i < nthreads; i++) {
+        pthread_join(collectors[i].thread, NULL);
+        calls += collectors[i].calls;
+        *errors += collectors[i].errors;
+    }
+
+    uint64_t elapsed = now_ns() - begin;
+
+    pthread_barrier_destroy(&start);
+
+    return calls * 1e9 / elapsed;
+}
+
+static void print_runs(const char *name, pid_t *pids, int npids,
+                       int max_threads, profile_t *shared, int duration_ms,
+                       bool last)
+{
+    double base = 0;
+
+    printf("  \"%s\": [\n", name);
+
+    for (int nthreads=1; nthreads <= max_threads; nthreads *= 2) {
+        int errors = 0;
+        double rate = run(pids, npids, nthreads, shared, duration_ms,
+                          &errors);
+        if (nthreads == 1)
+            base = rate;
+
+        printf("    {\"threads\": %d, \"calls_per_sec\": %.0f, "
+               "\"speedup\": %.2f, \"efficiency\": %.2f, \"errors\": %d}%s\n",
+               nthreads, rate, rate / base, rate / base / nthreads, errors,
+               nthreads * 2 <= max_threads ? "," : "");
+    }
+
+    printf("  ]%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[])
+{
+    int npids = 256;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int duration_ms = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:d:")) != -1) {
+        switch (opt) {
+            case ('p'):
+                npids = atoi(optarg);
+                break;
+            case ('m'):
+                max_threads = atoi(optarg);
+                break;
+            case ('d'):
+                duration_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p pids] [-m max_threads] "
+                                "[-d milliseconds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (max_threads < 1)
+        max_threads = 1;
+    if (npids < max_threads)
+        npids = max_threads;
+
+    pid_t *pids = calloc(npids, sizeof *pids);
+    if (!pids)
+        return 1;
+
+    for (int i=0; i < npids; i++) {
+        if ((pids[i] = fork()) == 0) {
+            for (;;)
+                pause();
+        }
+        if (pids[i] < 0) {
+            fprintf(stderr, "could not start the target processes\n");
+            npids = i;
+            goto kill_targets;
+        }
+    }
+
+    profile_t *shared = init_profile(pids[0]);
+    if (!shared) {
+        fprintf(stderr, "could not profile the target process\n");
+        goto kill_targets;
+    }
+
+    printf("{\n  \"benchmark\": \"concurrency\",\n"
+           "  \"pids\": %d, \"duration_ms\": %d, \"online_cpus\": %ld,\n",
+           npids, duration_ms, sysconf(_SC_NPROCESSORS_ONLN));
+
+    print_runs("per_thread_profiles", pids, npids, max_threads, NULL,
+               duration_ms, false);
+    print_runs("shared_profile", pids, npids, max_threads, shared,
+               duration_ms, true);
+
+    printf("}\n");
+
+    free_profile(shared);
+
+kill_targets:
+    for (int i=0; i < npids; i++) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], NULL, 0);
+    }
+
+    free(pids);
+
+    return 0;
+}
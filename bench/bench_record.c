@@ -0,0 +1,344 @@
+/*
+ * Records busy children through recorder_append_profile, replays the
+ * recording and checks the points come back whole.
+ *
+ *   bench_record [-n rounds] [-p targets] [-b block_points] [-f path]
+ *
+ * Every round appends a point of each target plus one of a made up pid
+ * whose gauges move both ways, so the blocks hold interleaved runs of
+ * several pids.  The children burn cpu before every sample so their cpu
+ * times keep moving, they are read by profile_refresh_stat and need no
+ * privileges.
+ *
+ * The recording is replayed twice: once flushed but not closed, which
+ * rebuilds the index from the blocks, and once closed.  Each replay is
+ * checked field by field, in full and over a sub-range of time.  The run
+ * fails on any difference or when the cpu times replay as zero.
+ */
+
+#include "prax.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+
+// Pid of the made up target, far from the real ones.
+#define SYNTHETIC_PID 0x7fffffff
+
+struct check {
+    ssize_t replayed;
+    int mismatches;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static pid_t start_target(void)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        for (volatile uint64_t i=0; ; i++)
+            ;
+    }
+
+    return pid;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    const struct record_point *left = a, *right = b;
+
+    if (left->pid != right->pid)
+        return left->pid < right->pid ? -1 : 1;
+    if (left->timestamp != right->timestamp)
+        return left->timestamp < right->timestamp ? -1 : 1;
+
+    return 0;
+}
+
+static bool same_point(const struct record_point *left,
+                       const struct record_point *right)
+{
+    return left->pid == right->pid &&
+           left->timestamp == right->timestamp &&
+           left->vol_ctxt_swt == right->vol_ctxt_swt &&
+           left->invol_ctxt_swt == right->invol_ctxt_swt &&
+           left->utime == right->utime &&
+           left->stime == right->stime &&
+           left->vmem == right->vmem &&
+           left->vm_rss == right->vm_rss &&
+           left->fd_count == right->fd_count &&
+           left->thread_count == right->thread_count;
+}
+
+// Replays [from, to] of path against the expected points, which are in
+// replay order.
+static struct check check_range(const char *path,
+                                const struct record_point *expected,
+                                size_t nexpected, uint64_t from, uint64_t to)
+{
+    struct check check = { -1, 0 };
+
+    replay_t *replay = init_replay(path);
+    if (!replay)
+        return check;
+
+    struct record_point *points;
+    check.replayed = replay_range(replay, from, to, &points);
+
+    size_t matched = 0;
+    for (size_t i=0; i < nexpected; i++) {
+        if (expected[i].timestamp < from || expected[i].timestamp > to)
+            continue;
+        if (matched < (size_t) check.replayed)
+            check.mismatches += !same_point(&points[matched], &expected[i]);
+        matched++;
+    }
+
+    if (check.replayed >= 0 && matched != (size_t) check.replayed)
+        check.mismatches += 1;
+
+    free_replay(replay);
+
+    return check;
+}
+
+static struct check check_all(const char *path,
+                              const struct record_point *expected,
+                              size_t nexpected)
+{
+    return check_range(path, expected, nexpected, 0, UINT64_MAX);
+}
+
+static bool check_ok(struct check check, size_t nexpected)
+{
+    return check.replayed == (ssize_t) nexpected && !check.mismatches;
+}
+
+int main(int argc, char *argv[])
+{
+    int nrounds = 64;
+    int ntargets = 3;
+    size_t block_points = 16;
+    const char *path = "/tmp/bench_record.prax";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:b:f:")) != -1) {
+        switch (opt) {
+            case ('n'):
+                nrounds = atoi(optarg);
+                break;
+            case ('p'):
+                ntargets = atoi(optarg);
+                break;
+            case ('b'):
+                block_points = strtoul(optarg, NULL, 10);
+                break;
+            case ('f'):
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n rounds] [-p targets] "
+                        "[-b block_points] [-f path]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (nrounds < 1)
+        nrounds = 1;
+    if (ntargets < 1)
+        ntargets = 1;
+    if (!block_points)
+        block_points = 1;
+
+    size_t npoints = (size_t) nrounds * (ntargets + 1);
+    struct record_point *appended = calloc(npoints, sizeof *appended);
+    pid_t *targets = calloc(ntargets, sizeof *targets);
+    profile_t **profiles = calloc(ntargets, sizeof *profiles);
+    recorder_t *recorder = NULL;
+    int started = 0;
+    int failed = 1;
+
+    if (!appended || !targets || !profiles) {
+        fprintf(stderr, "could not allocate the points\n");
+        goto release;
+    }
+
+    for (; started < ntargets; started++) {
+        targets[started] = start_target();
+        if (targets[started] < 0) {
+            fprintf(stderr, "could not start the target processes\n");
+            goto release;
+        }
+
+        profiles[started] = init_profile(targets[started]);
+        if (!profiles[started] || process_fd_stats(profiles[started]) < 0) {
+            fprintf(stderr, "could not profile the target processes\n");
+            started++;
+            goto release;
+        }
+    }
+
+    unlink(path);
+
+    recorder = init_recorder(path, block_points);
+    if (!recorder) {
+        fprintf(stderr, "could not create the recording\n");
+        goto release;
+    }
+
+    struct timespec interval = { 0, 10000000L };
+    struct record_point synthetic = { .pid = SYNTHETIC_PID, .vmem = 1 << 30,
+                                      .vm_rss = 1 << 20, .fd_count = 64,
+                                      .thread_count = 8 };
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    size_t nappended = 0;
+    uint64_t begin = now_ns();
+
+    for (int round=0; round < nrounds; round++) {
+        nanosleep(&interval, NULL);
+
+        for (int i=0; i < ntargets; i++) {
+            profile_t *process = profiles[i];
+            profile_refresh_stat(process);
+            profile_refresh_status(process);
+
+            uint64_t timestamp = now_ns();
+            if (recorder_append_profile(recorder, process, timestamp) < 0) {
+                fprintf(stderr, "could not append round %d\n", round);
+                goto release;
+            }
+
+            appended[nappended++] = (struct record_point) {
+                .timestamp = timestamp,
+                .pid = process->pid,
+                .vol_ctxt_swt = process->vol_ctxt_swt,
+                .invol_ctxt_swt = process->invol_ctxt_swt,
+                .utime = process->stat.utime,
+                .stime = process->stat.stime,
+                .vmem = process->vmem,
+                .vm_rss = process->vm_rss,
+                .fd_count = process->fds.count,
+                .thread_count = process->thread_count
+            };
+        }
+
+        // Gauges step up and down, counters only up, at an uneven rate.
+        uint64_t step = xorshift(&seed);
+        synthetic.timestamp = now_ns() + (step & 0xfff);
+        synthetic.vol_ctxt_swt += step & 0xff;
+        synthetic.invol_ctxt_swt += (step >> 8) & 0x3;
+        synthetic.utime += (step >> 10) & 0x7;
+        synthetic.stime += (step >> 13) & 0x1;
+        synthetic.vmem += (int64_t) ((step >> 16) & 0xffff) - 0x8000;
+        synthetic.vm_rss += (int64_t) ((step >> 32) & 0xfff) - 0x800;
+        synthetic.fd_count += (int64_t) ((step >> 44) & 0x3) - 1;
+        synthetic.thread_count += (int64_t) ((step >> 46) & 0x1) * 2 - 1;
+
+        if (recorder_append(recorder, &synthetic) < 0) {
+            fprintf(stderr, "could not append round %d\n", round);
+            goto release;
+        }
+        appended[nappended++] = synthetic;
+    }
+
+    // Every block is sorted by pid then time, the last one may be short.
+    for (size_t first=0; first < npoints; first += block_points) {
+        size_t count = npoints - first < block_points ?
+                       npoints - first : block_points;
+        qsort(appended + first, count, sizeof *appended, cmp_point);
+    }
+
+    uint64_t cpu_ticks = 0;
+    for (size_t i=0; i < npoints; i++) {
+        if (appended[i].pid != SYNTHETIC_PID)
+            cpu_ticks += appended[i].utime + appended[i].stime;
+    }
+
+    // A sub-range starting and ending inside blocks.
+    uint64_t span = now_ns() - begin;
+    uint64_t from = begin + span / 3;
+    uint64_t to = begin + 2 * span / 3;
+    size_t nrange = 0;
+    for (size_t i=0; i < npoints; i++)
+        nrange += appended[i].timestamp >= from && appended[i].timestamp <= to;
+
+    if (recorder_flush(recorder) < 0) {
+        fprintf(stderr, "could not flush the recording\n");
+        goto release;
+    }
+
+    uint64_t record_ns = now_ns() - begin;
+
+    struct check unclosed = check_all(path, appended, npoints);
+    struct check unclosed_range = check_range(path, appended, npoints,
+                                              from, to);
+
+    int ret = free_recorder(recorder);
+    recorder = NULL;
+    if (ret < 0) {
+        fprintf(stderr, "could not close the recording\n");
+        goto release;
+    }
+
+    begin = now_ns();
+    struct check closed = check_all(path, appended, npoints);
+    uint64_t replay_ns = now_ns() - begin;
+    struct check closed_range = check_range(path, appended, npoints,
+                                            from, to);
+
+    failed = !check_ok(unclosed, npoints) ||
+             !check_ok(unclosed_range, nrange) ||
+             !check_ok(closed, npoints) ||
+             !check_ok(closed_range, nrange) ||
+             !cpu_ticks;
+
+    printf("{\n  \"benchmark\": \"record\",\n"
+           "  \"points\": %zu, \"targets\": %d, \"block_points\": %zu,\n"
+           "  \"unclosed\": {\"replayed\": %zd, \"mismatches\": %d, "
+           "\"range_replayed\": %zd, \"range_mismatches\": %d},\n"
+           "  \"closed\": {\"replayed\": %zd, \"mismatches\": %d, "
+           "\"range_replayed\": %zd, \"range_mismatches\": %d},\n"
+           "  \"range_points\": %zu, \"cpu_ticks\": %llu,\n"
+           "  \"record_ns\": %llu, \"replay_ns\": %llu,\n  \"ok\": %s\n}\n",
+           npoints, ntargets, block_points,
+           unclosed.replayed, unclosed.mismatches,
+           unclosed_range.replayed, unclosed_range.mismatches,
+           closed.replayed, closed.mismatches,
+           closed_range.replayed, closed_range.mismatches,
+           nrange, (unsigned long long) cpu_ticks,
+           (unsigned long long) record_ns, (unsigned long long) replay_ns,
+           failed ? "false" : "true");
+
+release:
+    if (recorder)
+        free_recorder(recorder);
+    for (int i=0; i < started; i++) {
+        free_profile(profiles[i]);
+        kill(targets[i], SIGKILL);
+        waitpid(targets[i], NULL, 0);
+    }
+    unlink(path);
+    free(profiles);
+    free(targets);
+    free(appended);
+
+    return failed;
+}
@@ -0,0 +1,147 @@
+/*
+ * Compares the per-pid taskstats path against taskstats_batch_get.
+ *
+ *   bench_taskstats [-n children] [-i iterations] [-w window]
+ *
+ * Needs root, taskstats requests are refused to everyone else.
+ */
+
+#include "prax.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, size_t npids, int iterations,
+                   uint64_t elapsed, int ok, int last)
+{
+    double per_pid = (double) elapsed / ((double) npids * iterations);
+
+    printf("    {\"name\": \"%s\", \"pids\": %zu, \"iterations\": %d, "
+           "\"ns_per_pid\": %.1f, \"ok\": %d}%s\n",
+           name, npids, iterations, per_pid, ok, last ? "" : ",");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nchildren = 512;
+    int iterations = 10;
+    size_t window = TASKSTATS_BATCH_WINDOW;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:w:")) != -1) {
+        switch (opt) {
+            case ('n'):
+                nchildren = strtoul(optarg, NULL, 10);
+                break;
+            case ('i'):
+                iterations = atoi(optarg);
+                break;
+            case ('w'):
+                window = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n children] [-i iterations] "
+                                "[-w window]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "taskstats requests need root\n");
+        return 1;
+    }
+
+    pid_t *pids = calloc(nchildren, sizeof *pids);
+    struct taskstats *stats = calloc(nchildren, sizeof *stats);
+    int *errs = calloc(nchildren, sizeof *errs);
+    if (!pids || !stats || !errs)
+        return 1;
+
+    size_t npids = 0;
+    for (; npids < nchildren; npids++) {
+        pid_t child = fork();
+        if (child < 0)
+            break;
+        if (child == 0) {
+            pause();
+            _exit(0);
+        }
+        pids[npids] = child;
+    }
+
+    uint64_t start, elapsed;
+    int ok;
+
+    printf("{\n  \"benchmark\": \"taskstats\",\n  \"results\": [\n");
+
+    // What callers do today, one profile and one socket per pid.
+    ok = 0;
+    start = now_ns();
+    for (int i=0; i < iterations; i++) {
+        for (size_t j=0; j < npids; j++) {
+            profile_t *process = init_profile(pids[j]);
+            if (process && profile_refresh_taskstats(process) == 0)
+                ok++;
+            free_profile(process);
+        }
+    }
+    elapsed = now_ns() - start;
+    report("init_profile_per_pid", npids, iterations, elapsed, ok, 0);
+
+    // One socket, one request in flight at a time.
+    profile_t *process = init_profile(getpid());
+    ok = 0;
+    start = now_ns();
+    for (int i=0; i < iterations; i++) {
+        for (size_t j=0; j < npids; j++) {
+            process->pid = pids[j];
+            if (profile_refresh_taskstats(process) == 0)
+                ok++;
+        }
+    }
+    elapsed = now_ns() - start;
+    free_profile(process);
+    report("serial_per_pid", npids, iterations, elapsed, ok, 0);
+
+    taskstats_batch_t *batch = init_taskstats_batch(window);
+    if (!batch) {
+        fprintf(stderr, "init_taskstats_batch failed\n");
+        return 1;
+    }
+
+    ok = 0;
+    start = now_ns();
+    for (int i=0; i < iterations; i++) {
+        int filled = taskstats_batch_get(batch, pids, npids, stats, errs);
+        if (filled > 0)
+            ok += filled;
+    }
+    elapsed = now_ns() - start;
+    free_taskstats_batch(batch);
+    report("batch", npids, iterations, elapsed, ok, 1);
+
+    printf("  ]\n}\n");
+
+    for (size_t i=0; i < npids; i++)
+        kill(pids[i], SIGKILL);
+    while (wait(NULL) > 0)
+        ;
+
+    free(pids);
+    free(stats);
+    free(errs);
+
+    return 0;
+}
@@ -0,0 +1,493 @@
+#include "prax_internal.h"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+#define CGROUP_ROOT "/sys/fs/cgroup/"
+#define CGROUP_PROCS "cgroup.procs"
+
+enum control_kind {
+    CONTROL_NICE,
+    CONTROL_IOPRIO,
+    CONTROL_AFFINITY,
+    CONTROL_RLIMIT
+};
+
+struct control_op {
+    enum control_kind kind;
+    int flags;
+    int nice;
+    int ioprio;
+    const cpu_set_t *cpus;
+    size_t setsize;
+    int resource;
+    struct rlimit limit;
+};
+
+// Marks the result of a candidate outside the process group or session.
+#define NOT_IN_SET -1
+
+/*
+ * One call resolves the set into candidate pids and has the workers apply
+ * the change to contiguous shares of them, results[i] belonging to
+ * candidate i.  Candidates a process group or session set does not match
+ * are marked NOT_IN_SET and dropped afterwards.
+ */
+struct control {
+    int nworkers;
+    int proc_fd;
+    pid_t *candidates;
+    size_t candidates_cap;
+    struct control_result *results;
+    size_t results_cap;
+};
+
+struct control_worker {
+    control_t *control;
+    const struct proc_set *set;
+    const struct control_op *op;
+    const pid_t *pids;
+    size_t first;
+    size_t last;
+    // Thread listing of CONTROL_THREADS, kept across the pids of a share.
+    pid_t *tids;
+    size_t tids_cap;
+    bool started;
+    pthread_t thread;
+};
+
+control_t *init_control(int nworkers)
+{
+    control_t *control = prax_calloc(1, sizeof *control);
+    if (!control)
+        return NULL;
+
+    control->nworkers = nworkers > 0 ? nworkers :
+                                       sysconf(_SC_NPROCESSORS_ONLN);
+    control->proc_fd = prax_openat(AT_FDCWD, PROC,
+                                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (control->proc_fd < 0) {
+        free(control);
+        return NULL;
+    }
+
+    return control;
+}
+
+static int apply_op(const struct control_op *op, pid_t id)
+{
+    int ret;
+
+    switch (op->kind) {
+        case (CONTROL_NICE):
+            ret = setpriority(PRIO_PROCESS, id, op->nice);
+            break;
+        case (CONTROL_IOPRIO):
+            ret = syscall(SETIOPRIO, IOPRIO_WHO_PROCESS, id, op->ioprio);
+            break;
+        case (CONTROL_AFFINITY):
+            ret = sched_setaffinity(id, op->setsize, op->cpus);
+            break;
+        default:
+            ret = prlimit(id, op->resource, &(op->limit), NULL);
+            break;
+    }
+
+    return ret < 0 ? errno : 0;
+}
+
+// Applies the change to every thread of pid, one exiting meanwhile is not
+// an error.  Returns the first error.
+static int apply_threads(struct control_worker *worker, pid_t pid)
+{
+    char path[64];
+
+    int task_fd = prax_openat(worker->control->proc_fd,
+                              pid_path(path, pid, TASK),
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+        return errno == ENOENT ? ESRCH : errno;
+
+    int ntids = list_numeric_dir(task_fd, &(worker->tids),
+                                 &(worker->tids_cap));
+    int err = ntids < 0 ? errno : 0;
+
+    close(task_fd);
+
+    for (int i=0; i < ntids; i++) {
+        int tid_err = apply_op(worker->op, worker->tids[i]);
+        if (tid_err && tid_err != ESRCH && !err)
+            err = tid_err;
+    }
+
+    return err;
+}
+
+// Returns false when the stat of pid places it outside the process group
+// or session of the set.
+static bool in_set(struct control_worker *worker, pid_t pid)
+{
+    char path[64];
+    char buf[STAT_SIZE];
+    struct proc_stat stat;
+
+    if (read_procfs_at(worker->control->proc_fd, pid_path(path, pid, STAT),
+                       buf, sizeof buf) < 0 ||
+        parse_proc_stat(buf, &stat) < 0)
+        return false;
+
+    if (worker->set->type == PROC_SET_PGRP)
+        return stat.pgrp == worker->set->id;
+
+    return stat.session == worker->set->id;
+}
+
+/*
+ * The pidfd is polled right before the change, as in check_pid, so the pid
+ * cannot have been reused for another process in between.  A group or
+ * session candidate is matched before the pidfd is opened, most of /proc
+ * is not in the set, and matched again once it is open so the match holds
+ * for the process the pidfd refers to.  Kernels before 5.3 fall back to the
+ * bare pid.
+ */
+static int control_pid(struct control_worker *worker, pid_t pid,
+                       bool *matched)
+{
+    bool by_group = worker->set->type == PROC_SET_PGRP ||
+                    worker->set->type == PROC_SET_SESSION;
+    int err = 0;
+
+    *matched = !by_group;
+
+    // A zero pid would change the caller itself.
+    if (pid <= 0)
+        return EINVAL;
+
+    if (by_group && !in_set(worker, pid))
+        return 0;
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0 && errno != ENOSYS && errno != EINVAL)
+        return errno;
+
+    if (by_group && !(*matched = in_set(worker, pid)))
+        goto close_pidfd;
+
+    if (pidfd > -1) {
+        struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) != 0) {
+            err = ESRCH;
+            goto close_pidfd;
+        }
+    }
+
+    if ((worker->op->flags & CONTROL_THREADS) &&
+        worker->op->kind != CONTROL_RLIMIT)
+        err = apply_threads(worker, pid);
+    else
+        err = apply_op(worker->op, pid);
+
+close_pidfd:
+    if (pidfd > -1)
+        close(pidfd);
+
+    return err;
+}
+
+static void *control_share(void *arg)
+{
+    struct control_worker *worker = arg;
+    struct control_result *results = worker->control->results;
+
+    for (size_t i=worker->first; i < worker->last; i++) {
+        pid_t pid = worker->pids[i];
+        bool matched;
+
+        results[i].pid = pid;
+        results[i].err = control_pid(worker, pid, &matched);
+        if (!matched)
+            results[i].err = NOT_IN_SET;
+    }
+
+    free(worker->tids);
+
+    return NULL;
+}
+
+// Splits the candidates into contiguous shares as process_thread_stats does,
+// the calling thread taking the first one.
+static void fan_out(control_t *control, const struct proc_set *set,
+                    const struct control_op *op, const pid_t *pids,
+                    size_t npids)
+{
+    int nworkers = control->nworkers;
+
+    if (npids <= CONTROL_FANOUT)
+        nworkers = 1;
+    if (nworkers > (int) (npids / (CONTROL_FANOUT / 4)))
+        nworkers = npids / (CONTROL_FANOUT / 4);
+    if (nworkers < 1)
+        nworkers = 1;
+
+    struct control_worker workers[nworkers];
+    size_t per_worker = (npids + nworkers - 1) / nworkers;
+
+    memset(workers, 0, sizeof workers);
+
+    for (int i=0; i < nworkers; i++) {
+        workers[i].control = control;
+        workers[i].set = set;
+        workers[i].op = op;
+        workers[i].pids = pids;
+        workers[i].first = i * per_worker;
+        workers[i].last = (i + 1) * per_worker;
+        if (workers[i].last > npids)
+            workers[i].last = npids;
+        if (workers[i].first > npids)
+            workers[i].first = npids;
+    }
+
+    for (int i=1; i < nworkers; i++)
+        workers[i].started = !pthread_create(&(workers[i].thread), NULL,
+                                             control_share, &workers[i]);
+
+    control_share(&workers[0]);
+
+    for (int i=1; i < nworkers; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        else
+            control_share(&workers[i]);
+    }
+}
+
+static int add_candidate(control_t *control, size_t count, pid_t pid)
+{
+    if (count == control->candidates_cap) {
+        size_t new_cap = count ? count * 2 : 1024;
+        pid_t *candidates = prax_realloc(control->candidates,
+                                         new_cap * sizeof *candidates);
+        if (!candidates)
+            return -1;
+        control->candidates = candidates;
+        control->candidates_cap = new_cap;
+    }
+
+    control->candidates[count] = pid;
+
+    return 0;
+}
+
+// Streams cgroup.procs, a pid per line, into the candidates.  Returns the
+// count.
+static int read_cgroup_pids(control_t *control, const char *cgroup)
+{
+    char buf[4096];
+    int count = -1;
+
+    // Relative paths are taken from the cgroup2 mount.
+    const char *root = *cgroup == '/' ? "" : CGROUP_ROOT;
+    size_t root_len = strlen(root);
+    size_t len = strlen(cgroup);
+    char path[root_len + len + sizeof CGROUP_PROCS + 1];
+
+    memcpy(path, root, root_len);
+    memcpy(path + root_len, cgroup, len);
+    path[root_len + len] = '/';
+    memcpy(path + root_len + len + 1, CGROUP_PROCS, sizeof CGROUP_PROCS);
+
+    int fd = prax_openat(AT_FDCWD, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    int npids = 0;
+    pid_t pid = 0;
+    bool in_pid = false;
+
+    for (;;) {
+        ssize_t bytes_read = read(fd, buf, sizeof buf);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+            goto close_procs;
+
+        STATS_ADD(bytes_read, bytes_read);
+
+        // A pid may be split across two reads, so the digits are carried.
+        for (ssize_t i=0; i < bytes_read; i++) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                pid = pid * 10 + (buf[i] - '0');
+                in_pid = true;
+            } else if (in_pid) {
+                if (add_candidate(control, npids++, pid) < 0)
+                    goto close_procs;
+                pid = 0;
+                in_pid = false;
+            }
+        }
+
+        if (bytes_read == 0)
+            break;
+    }
+
+    if (in_pid && add_candidate(control, npids++, pid) < 0)
+        goto close_procs;
+
+    count = npids;
+
+close_procs:
+    close(fd);
+
+    return count;
+}
+
+// Resolves the set into candidate pids, *pids is pointed at them.
+static int resolve_set(control_t *control, const struct proc_set *set,
+                       const pid_t **pids)
+{
+    int npids;
+
+    switch (set->type) {
+        case (PROC_SET_PIDS):
+            *pids = set->pids;
+            return set->npids;
+        case (PROC_SET_PGRP):
+        case (PROC_SET_SESSION):
+            if (set->id <= 0)
+                break;
+            npids = list_numeric_dir(control->proc_fd, &(control->candidates),
+                                     &(control->candidates_cap));
+            *pids = control->candidates;
+            return npids;
+        case (PROC_SET_CGROUP):
+            if (!set->cgroup)
+                break;
+            npids = read_cgroup_pids(control, set->cgroup);
+            *pids = control->candidates;
+            return npids;
+    }
+
+    errno = EINVAL;
+
+    return -1;
+}
+
+static int control_set(control_t *control, const struct proc_set *set,
+                       const struct control_op *op,
+                       struct control_result **results)
+{
+    STATS_TIMED(STATS_CONTROL);
+
+    if (!control || !set || !results)
+        return -1;
+
+    const pid_t *pids;
+    int npids = resolve_set(control, set, &pids);
+    if (npids < 0)
+        return -1;
+
+    if ((size_t) npids > control->results_cap) {
+        struct control_result *grown =
+            prax_realloc(control->results, npids * sizeof *grown);
+        if (!grown)
+            return -1;
+        control->results = grown;
+        control->results_cap = npids;
+    }
+
+    fan_out(control, set, op, pids, npids);
+
+    // Drop the candidates outside the process group or session.
+    int count = 0;
+    for (int i=0; i < npids; i++) {
+        if (control->results[i].err == NOT_IN_SET)
+            continue;
+        if (count != i)
+            control->results[count] = control->results[i];
+        count++;
+    }
+
+    *results = control->results;
+
+    return count;
+}
+
+int control_nice(control_t *control, const struct proc_set *set, int nice,
+                 int flags, struct control_result **results)
+{
+    struct control_op op = {
+        .kind = CONTROL_NICE,
+        .flags = flags,
+        .nice = nice
+    };
+
+    return control_set(control, set, &op, results);
+}
+
+int control_ioprio(control_t *control, const struct proc_set *set,
+                   int class, int value, int flags,
+                   struct control_result **results)
+{
+    struct control_op op = {
+        .kind = CONTROL_IOPRIO,
+        .flags = flags,
+        .ioprio = IOPRIO_VALUE(class, value)
+    };
+
+    return control_set(control, set, &op, results);
+}
+
+int control_affinity(control_t *control, const struct proc_set *set,
+                     const cpu_set_t *cpus, size_t setsize, int flags,
+                     struct control_result **results)
+{
+    if (!cpus) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct control_op op = {
+        .kind = CONTROL_AFFINITY,
+        .flags = flags,
+        .cpus = cpus,
+        .setsize = setsize
+    };
+
+    return control_set(control, set, &op, results);
+}
+
+int control_rlimit(control_t *control, const struct proc_set *set,
+                   int resource, const struct rlimit *limit,
+                   struct control_result **results)
+{
+    if (!limit) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct control_op op = {
+        .kind = CONTROL_RLIMIT,
+        .resource = resource,
+        .limit = *limit
+    };
+
+    return control_set(control, set, &op, results);
+}
+
+void free_control(control_t *control)
+{
+    if (!control)
+        return;
+
+    if (control->proc_fd > -1)
+        close(control->proc_fd);
+
+    free(control->candidates);
+    free(control->results);
+    free(control);
+}
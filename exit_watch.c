@@ -0,0 +1,240 @@
+#include "prax_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+
+// Events taken per epoll_wait call.
+#define WATCH_BATCH 256
+
+#define WATCH_EMPTY 0
+#define WATCH_REMOVED -1
+
+struct watch_slot {
+    pid_t pid;
+    int fd;
+};
+
+/*
+ * Every watched pidfd sits in one epoll instance with its pid and fd packed
+ * into the event data, a pidfd turns readable once its process exited.  The
+ * pid to fd table is open addressed, only exit_watch_remove needs it.
+ */
+struct exit_watch {
+    int epoll_fd;
+    struct watch_slot *slots;
+    size_t nslots;
+    size_t count;
+    // Live entries plus the WATCH_REMOVED markers left in the table.
+    size_t used;
+};
+
+static inline size_t hash_pid(pid_t pid, size_t nslots)
+{
+    return ((uint32_t) pid * 2654435761u) & (nslots - 1);
+}
+
+static struct watch_slot *find_slot(exit_watch_t *watch, pid_t pid)
+{
+    size_t mask = watch->nslots - 1;
+
+    for (size_t i=hash_pid(pid, watch->nslots); ; i = (i + 1) & mask) {
+        struct watch_slot *slot = &(watch->slots[i]);
+        if (slot->pid == pid || slot->pid == WATCH_EMPTY)
+            return slot;
+    }
+}
+
+// Doubles the table once it is half used, dropping the removed markers.
+static int grow_slots(exit_watch_t *watch)
+{
+    if ((watch->used + 1) * 2 < watch->nslots)
+        return 0;
+
+    size_t nslots = watch->count * 4 > watch->nslots ? watch->nslots * 2 :
+                                                       watch->nslots;
+    struct watch_slot *slots = prax_calloc(nslots, sizeof *slots);
+    if (!slots)
+        return -1;
+
+    struct watch_slot *old = watch->slots;
+    size_t nold = watch->nslots;
+
+    watch->slots = slots;
+    watch->nslots = nslots;
+    watch->used = watch->count;
+
+    for (size_t i=0; i < nold; i++) {
+        if (old[i].pid > 0)
+            *find_slot(watch, old[i].pid) = old[i];
+    }
+
+    free(old);
+
+    return 0;
+}
+
+static void remove_slot(exit_watch_t *watch, struct watch_slot *slot)
+{
+    slot->pid = WATCH_REMOVED;
+    slot->fd = -1;
+    watch->count--;
+}
+
+// A forked child may share the pidfd, closing it would then leave it in
+// the epoll set.
+static void unwatch_fd(exit_watch_t *watch, int pidfd)
+{
+    epoll_ctl(watch->epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+}
+
+exit_watch_t *init_exit_watch(void)
+{
+    exit_watch_t *watch = prax_calloc(1, sizeof *watch);
+    if (!watch)
+        return NULL;
+
+    watch->nslots = 1024;
+    watch->slots = prax_calloc(watch->nslots, sizeof *watch->slots);
+    watch->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (!watch->slots || watch->epoll_fd < 0) {
+        free_exit_watch(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+// Takes ownership of pidfd.
+static int watch_pidfd(exit_watch_t *watch, pid_t pid, int pidfd)
+{
+    if (pid <= 0 || grow_slots(watch) < 0)
+        goto close_pidfd;
+
+    struct watch_slot *slot = find_slot(watch, pid);
+    if (slot->pid == pid) {
+        errno = EEXIST;
+        goto close_pidfd;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = (uint64_t) pidfd << 32 | (uint32_t) pid
+    };
+
+    if (epoll_ctl(watch->epoll_fd, EPOLL_CTL_ADD, pidfd, &event) < 0)
+        goto close_pidfd;
+
+    slot->pid = pid;
+    slot->fd = pidfd;
+    watch->count++;
+    watch->used++;
+
+    return 0;
+
+close_pidfd:
+    close(pidfd);
+
+    return -1;
+}
+
+int exit_watch_add(exit_watch_t *watch, pid_t pid)
+{
+    if (!watch)
+        return -1;
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0)
+        return -1;
+
+    return watch_pidfd(watch, pid, pidfd);
+}
+
+int exit_watch_add_profile(exit_watch_t *watch, profile_t *process)
+{
+    if (!watch || !process || process->pidfd < 0)
+        return -1;
+
+    int pidfd = fcntl(process->pidfd, F_DUPFD_CLOEXEC, 0);
+    if (pidfd < 0)
+        return -1;
+
+    return watch_pidfd(watch, process->pid, pidfd);
+}
+
+int exit_watch_remove(exit_watch_t *watch, pid_t pid)
+{
+    if (!watch || pid <= 0)
+        return -1;
+
+    struct watch_slot *slot = find_slot(watch, pid);
+    if (slot->pid != pid) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    unwatch_fd(watch, slot->fd);
+    remove_slot(watch, slot);
+
+    return 0;
+}
+
+int exit_watch_wait(exit_watch_t *watch, pid_t *pids, int max,
+                    int timeout_ms)
+{
+    struct epoll_event events[WATCH_BATCH];
+
+    if (!watch || max <= 0)
+        return -1;
+
+    int nevents = epoll_wait(watch->epoll_fd, events,
+                             max < WATCH_BATCH ? max : WATCH_BATCH,
+                             timeout_ms);
+    if (nevents < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i=0; i < nevents; i++) {
+        pid_t pid = (uint32_t) events[i].data.u64;
+        int pidfd = events[i].data.u64 >> 32;
+
+        struct watch_slot *slot = find_slot(watch, pid);
+        if (slot->pid == pid)
+            remove_slot(watch, slot);
+
+        unwatch_fd(watch, pidfd);
+        pids[i] = pid;
+    }
+
+    return nevents;
+}
+
+int exit_watch_fd(exit_watch_t *watch)
+{
+    return watch ? watch->epoll_fd : -1;
+}
+
+size_t exit_watch_count(exit_watch_t *watch)
+{
+    return watch ? watch->count : 0;
+}
+
+void free_exit_watch(exit_watch_t *watch)
+{
+    if (!watch)
+        return;
+
+    for (size_t i=0; watch->slots && i < watch->nslots; i++) {
+        if (watch->slots[i].pid > 0)
+            close(watch->slots[i].fd);
+    }
+
+    if (watch->epoll_fd > -1)
+        close(watch->epoll_fd);
+
+    free(watch->slots);
+    free(watch);
+}
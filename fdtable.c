@@ -0,0 +1,319 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int fd_type(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+        case (S_IFREG):
+            return FD_TYPE_FILE;
+        case (S_IFDIR):
+            return FD_TYPE_DIR;
+        case (S_IFCHR):
+            return FD_TYPE_CHAR;
+        case (S_IFBLK):
+            return FD_TYPE_BLOCK;
+        case (S_IFIFO):
+            return FD_TYPE_PIPE;
+        case (S_IFSOCK):
+            return FD_TYPE_SOCKET;
+        case (S_IFLNK):
+            return FD_TYPE_LINK;
+        case (0):
+            return FD_TYPE_ANON;
+    }
+
+    return FD_TYPE_UNKNOWN;
+}
+
+static inline void fd_name(char *name, int fd)
+{
+    char digits[16];
+    int ndigits = 0;
+
+    do {
+        digits[ndigits++] = '0' + fd % 10;
+        fd /= 10;
+    } while (fd);
+
+    while (ndigits)
+        *name++ = digits[--ndigits];
+    *name = '\0';
+}
+
+/*
+ * Resolves the link of a stat'ed descriptor into entry, reading its target
+ * straight into the end of the path slab.
+ */
+static int link_fd(char **paths, size_t *paths_len, size_t *paths_cap,
+                   int dirfd, const char *name, const struct stat *st,
+                   struct fd_entry *entry)
+{
+    if (RESERVE(*paths, *paths_cap, *paths_len + PATH_MAX + 1) < 0)
+        return -1;
+
+    char *path = *paths + *paths_len;
+    ssize_t len = readlinkat(dirfd, name, path, PATH_MAX);
+    if (len < 0)
+        return -1;
+
+    path[len] = '\0';
+
+    entry->type = fd_type(st->st_mode);
+    entry->mode = st->st_mode;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->path_off = *paths_len;
+
+    *paths_len += len + 1;
+
+    return 0;
+}
+
+static int open_fd_dir(profile_t *process)
+{
+    return prax_openat(process->proc_fd, FD,
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static int cmp_fd(const void *a, const void *b)
+{
+    return *(const pid_t *) a - *(const pid_t *) b;
+}
+
+// Lists the open descriptor numbers of the fd directory in ascending order.
+static int list_fds(struct fd_table *table, int dirfd)
+{
+    int nfds = list_numeric_dir(dirfd, &(table->listing),
+                                &(table->listing_cap));
+
+    for (int i=1; i < nfds; i++) {
+        if (table->listing[i - 1] > table->listing[i]) {
+            qsort(table->listing, nfds, sizeof *table->listing, cmp_fd);
+            break;
+        }
+    }
+
+    return nfds;
+}
+
+int process_fd_stats(profile_t *process)
+{
+    STATS_TIMED(STATS_FD_STATS);
+
+    PROFILE_LOCKED(process);
+
+    struct fd_table *table = &(process->fds);
+
+    int dirfd = open_fd_dir(process);
+    if (dirfd < 0)
+        return -1;
+
+    int ret = -1;
+
+    int nfds = list_fds(table, dirfd);
+    if (nfds < 0)
+        goto close_dir;
+
+    // Resetting the table keeps both slabs for the next refresh.
+    table->count = 0;
+    table->paths_len = 0;
+    table->nchanges = 0;
+
+    if (RESERVE(table->entries, table->cap, nfds) < 0)
+        goto close_dir;
+
+    for (int i=0; i < nfds; i++) {
+        struct fd_entry *entry = &(table->entries[table->count]);
+        char name[16];
+        struct stat st;
+
+        fd_name(name, table->listing[i]);
+        if (fstatat(dirfd, name, &st, 0) < 0)
+            continue;
+
+        entry->fd = table->listing[i];
+        if (link_fd(&(table->paths), &(table->paths_len),
+                    &(table->paths_cap), dirfd, name, &st, entry) == 0)
+            table->count++;
+    }
+
+    ret = 0;
+
+close_dir:
+    close(dirfd);
+
+    return ret;
+}
+
+static inline void add_change(struct fd_table *table, int fd, int change)
+{
+    struct fd_delta *delta = &(table->changes[table->nchanges++]);
+
+    delta->fd = fd;
+    delta->change = change;
+}
+
+/*
+ * The old and new tables are both sorted by fd number, so they are merged in
+ * one pass into the spare buffers which are then swapped in.  Paths of kept
+ * descriptors are copied across, which costs no syscall.
+ */
+int process_fd_refresh(profile_t *process, int flags)
+{
+    STATS_TIMED(STATS_FD_REFRESH);
+
+    PROFILE_LOCKED(process);
+
+    struct fd_table *table = &(process->fds);
+
+    int dirfd = open_fd_dir(process);
+    if (dirfd < 0)
+        return -1;
+
+    int ret = -1;
+
+    int nfds = list_fds(table, dirfd);
+    if (nfds < 0)
+        goto close_dir;
+
+    size_t max_changes = nfds + table->count;
+    if (RESERVE(table->spare_entries, table->spare_cap, nfds) < 0 ||
+        RESERVE(table->changes, table->changes_cap, max_changes) < 0)
+        goto close_dir;
+
+    struct fd_entry *old = table->entries;
+    struct fd_entry *new = table->spare_entries;
+    char *new_paths = table->spare_paths;
+    size_t new_paths_len = 0;
+    size_t nold = table->count, nnew = 0;
+    size_t i = 0, j = 0;
+
+    table->nchanges = 0;
+
+    while (i < nold || j < (size_t) nfds) {
+        if (j == (size_t) nfds || (i < nold && old[i].fd < table->listing[j])) {
+            add_change(table, old[i++].fd, FD_REMOVED);
+            continue;
+        }
+
+        int fd = table->listing[j++];
+        bool known = i < nold && old[i].fd == fd;
+        struct fd_entry *prev = known ? &old[i++] : NULL;
+        struct fd_entry *entry = &new[nnew];
+        char name[16];
+        struct stat st;
+
+        if (prev && (flags & FD_REFRESH_TRUST)) {
+            st.st_dev = prev->dev;
+            st.st_ino = prev->ino;
+            st.st_mode = prev->mode;
+        } else {
+            fd_name(name, fd);
+            if (fstatat(dirfd, name, &st, 0) < 0) {
+                if (prev)
+                    add_change(table, fd, FD_REMOVED);
+                continue;
+            }
+        }
+
+        if (prev && prev->dev == st.st_dev && prev->ino == st.st_ino &&
+            prev->mode == st.st_mode) {
+            const char *path = table->paths + prev->path_off;
+            size_t len = strlen(path) + 1;
+
+            if (RESERVE(new_paths, table->spare_paths_cap,
+                        new_paths_len + len) < 0)
+                goto save_paths;
+
+            *entry = *prev;
+            entry->path_off = new_paths_len;
+            memcpy(new_paths + new_paths_len, path, len);
+            new_paths_len += len;
+            nnew++;
+            continue;
+        }
+
+        entry->fd = fd;
+        if (link_fd(&new_paths, &new_paths_len, &(table->spare_paths_cap),
+                    dirfd, name, &st, entry) < 0) {
+            if (prev)
+                add_change(table, fd, FD_REMOVED);
+            continue;
+        }
+
+        add_change(table, fd, prev ? FD_CHANGED : FD_ADDED);
+        nnew++;
+    }
+
+    table->spare_entries = table->entries;
+    table->entries = new;
+    size_t cap = table->cap;
+    table->cap = table->spare_cap;
+    table->spare_cap = cap;
+    table->count = nnew;
+
+    table->spare_paths = table->paths;
+    table->paths = new_paths;
+    cap = table->paths_cap;
+    table->paths_cap = table->spare_paths_cap;
+    table->spare_paths_cap = cap;
+    table->paths_len = new_paths_len;
+
+    close(dirfd);
+
+    return table->nchanges;
+
+save_paths:
+    // The slab may have moved while growing, keep hold of it.
+    table->spare_paths = new_paths;
+
+close_dir:
+    close(dirfd);
+
+    return ret;
+}
+
+const char *fd_entry_path(profile_t *process, const struct fd_entry *entry)
+{
+    return process->fds.paths + entry->path_off;
+}
+
+int fd_stats_next(profile_t *process, size_t *cursor, fdstats_t *fdstats)
+{
+    PROFILE_LOCKED(process);
+
+    struct fd_table *table = &(process->fds);
+
+    if (*cursor >= table->count)
+        return 0;
+
+    struct fd_entry *entry = &(table->entries[(*cursor)++]);
+
+    memset(fdstats, 0, sizeof *fdstats);
+    fdstats->file = table->paths + entry->path_off;
+    fdstats->file_stats.st_dev = entry->dev;
+    fdstats->file_stats.st_ino = entry->ino;
+    fdstats->file_stats.st_mode = entry->mode;
+
+    return 1;
+}
+
+void free_profile_fd(profile_t *process)
+{
+    struct fd_table *table = &(process->fds);
+
+    free(table->entries);
+    free(table->paths);
+    free(table->changes);
+    free(table->spare_entries);
+    free(table->spare_paths);
+    free(table->listing);
+
+    memset(table, 0, sizeof *table);
+}
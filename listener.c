@@ -0,0 +1,401 @@
+#include "prax_internal.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+
+#define EXIT_RECV_SIZE 16384
+#define EXIT_RCVBUF (4 << 20)
+
+struct exit_group {
+    exit_listener_t *listener;
+    int nl_conn;
+    int nl_family_id;
+    char *cpumask;
+    bool started;
+    pthread_t thread;
+    char *recv_buf;
+    struct exit_record *ring;
+    size_t head;
+    size_t tail;
+    uint64_t dropped;
+};
+
+struct exit_listener {
+    int ngroups;
+    int stop_fd;
+    int next_group;
+    exit_callback_t callback;
+    void *arg;
+    struct exit_group groups[];
+};
+
+/*
+ * Formats the cpus as a cpulist ("0-3,8,10-11"), the form the kernel
+ * expects in TASKSTATS_CMD_ATTR_REGISTER_CPUMASK.
+ */
+static char *format_cpulist(const int *cpus, int ncpus)
+{
+    size_t len = ncpus * 24 + 1;
+    char *cpulist = prax_malloc(len);
+    if (!cpulist)
+        return NULL;
+
+    size_t off = 0;
+    for (int i=0; i < ncpus; i++) {
+        int first = cpus[i];
+        for (; i + 1 < ncpus && cpus[i + 1] == cpus[i] + 1; i++)
+            ;
+        if (first == cpus[i])
+            off += snprintf(cpulist + off, len - off, "%s%d",
+                            off ? "," : "", first);
+        else
+            off += snprintf(cpulist + off, len - off, "%s%d-%d",
+                            off ? "," : "", first, cpus[i]);
+    }
+
+    return cpulist;
+}
+
+static int register_cpumask(struct exit_group *group)
+{
+    int data_len = strlen(group->cpumask) + 1;
+    struct taskmsg *msg = prax_calloc(1, sizeof *msg + data_len);
+    if (!msg)
+        return -1;
+
+    build_req(msg, group->nl_family_id, TASKSTATS_CMD_GET,
+              TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
+              data_len, group->cpumask);
+    msg->nl.nlmsg_flags |= NLM_F_ACK;
+
+    int ret = -1;
+
+    if (send_nl_req(group->nl_conn, msg, msg->nl.nlmsg_len) < 0)
+        goto release;
+
+    // Exit records may already be queued ahead of the ack.
+    for (;;) {
+        ssize_t len = recv(group->nl_conn, group->recv_buf,
+                           EXIT_RECV_SIZE, 0);
+        if (len < 0) {
+            if (errno == EINTR || errno == ENOBUFS)
+                continue;
+            goto release;
+        }
+
+        struct nlmsghdr *nlh = (struct nlmsghdr *) group->recv_buf;
+        for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            STATS_ADD(nl_received, 1);
+            if (nlh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            struct nlmsgerr *nl_err = NLMSG_DATA(nlh);
+            errno = -nl_err->error;
+            ret = nl_err->error ? -1 : 0;
+            goto release;
+        }
+    }
+
+release:
+    free(msg);
+
+    return ret;
+}
+
+static void deliver_record(struct exit_group *group,
+                           struct exit_record *record)
+{
+    exit_listener_t *listener = group->listener;
+
+    if (listener->callback) {
+        listener->callback(record, listener->arg);
+        return;
+    }
+
+    size_t head = group->head;
+    size_t tail = __atomic_load_n(&(group->tail), __ATOMIC_ACQUIRE);
+
+    if (head - tail == EXIT_RING_SIZE) {
+        __atomic_add_fetch(&(group->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    group->ring[head & (EXIT_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&(group->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * An exit message carries an AGGR_PID nest for the task and, when it was
+ * the last thread of its group, an AGGR_TGID nest for the whole group.
+ */
+static void parse_exit_msg(struct exit_group *group, struct nlmsghdr *nlh)
+{
+    struct exit_record record;
+    int msglength = nlh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+    struct nlattr *nla = (struct nlattr *) ((char *) NLMSG_DATA(nlh) +
+                                                     GENL_HDRLEN);
+
+    while (msglength >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+           nla->nla_len <= msglength) {
+        int type = nla->nla_type & NLA_TYPE_MASK;
+
+        if (type == TASKSTATS_TYPE_AGGR_PID ||
+            type == TASKSTATS_TYPE_AGGR_TGID) {
+            int nest_len = nla->nla_len - NLA_HDRLEN;
+            struct nlattr *inner = NLA_DATA(nla);
+
+            record.type = type;
+            record.pid = 0;
+
+            while (nest_len >= NLA_HDRLEN && inner->nla_len >= NLA_HDRLEN &&
+                   inner->nla_len <= nest_len) {
+                int inner_type = inner->nla_type & NLA_TYPE_MASK;
+
+                if (inner_type == TASKSTATS_TYPE_PID ||
+                    inner_type == TASKSTATS_TYPE_TGID)
+                    record.pid = *(uint32_t *) NLA_DATA(inner);
+                else if (inner_type == TASKSTATS_TYPE_STATS) {
+                    copy_taskstats(&record.stats, NLA_DATA(inner));
+                    deliver_record(group, &record);
+                }
+
+                nest_len -= NLA_ALIGN(inner->nla_len);
+                inner = (struct nlattr *) ((char *) inner +
+                                           NLA_ALIGN(inner->nla_len));
+            }
+        }
+
+        msglength -= NLA_ALIGN(nla->nla_len);
+        nla = (struct nlattr *) ((char *) nla + NLA_ALIGN(nla->nla_len));
+    }
+}
+
+static void *exit_reader(void *arg)
+{
+    struct exit_group *group = arg;
+
+    struct pollfd fds[2] = {
+        { .fd = group->nl_conn, .events = POLLIN },
+        { .fd = group->listener->stop_fd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        for (;;) {
+            ssize_t len = recv(group->nl_conn, group->recv_buf,
+                               EXIT_RECV_SIZE, MSG_DONTWAIT);
+            if (len < 0) {
+                if (errno == ENOBUFS) {
+                    // The kernel does not say how many were lost.
+                    __atomic_add_fetch(&(group->dropped), 1,
+                                       __ATOMIC_RELAXED);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            struct nlmsghdr *nlh = (struct nlmsghdr *) group->recv_buf;
+            for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                STATS_ADD(nl_received, 1);
+                if (nlh->nlmsg_type == group->nl_family_id)
+                    parse_exit_msg(group, nlh);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int init_exit_group(exit_listener_t *listener, struct exit_group *group,
+                           const int *cpus, int ncpus)
+{
+    group->listener = listener;
+    group->nl_conn = create_nl_conn();
+    if (group->nl_conn < 0)
+        return -1;
+
+    group->nl_family_id = get_nl_family_id(group->nl_conn);
+    if (group->nl_family_id < 0)
+        return -1;
+
+    int rcvbuf = EXIT_RCVBUF;
+    if (setsockopt(group->nl_conn, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &rcvbuf, sizeof rcvbuf) < 0)
+        setsockopt(group->nl_conn, SOL_SOCKET, SO_RCVBUF,
+                   &rcvbuf, sizeof rcvbuf);
+
+    group->recv_buf = prax_malloc(EXIT_RECV_SIZE);
+    group->cpumask = format_cpulist(cpus, ncpus);
+    if (!group->recv_buf || !group->cpumask)
+        return -1;
+
+    if (!listener->callback) {
+        group->ring = prax_calloc(EXIT_RING_SIZE, sizeof *group->ring);
+        if (!group->ring)
+            return -1;
+    }
+
+    if (register_cpumask(group) < 0)
+        return -1;
+
+    if (pthread_create(&(group->thread), NULL, exit_reader, group))
+        return -1;
+
+    group->started = true;
+
+    return 0;
+}
+
+exit_listener_t *init_exit_listener(const cpu_set_t *cpus, size_t setsize,
+                                    int group_size, exit_callback_t callback,
+                                    void *arg)
+{
+    int max_cpus = cpus ? setsize * 8 : sysconf(_SC_NPROCESSORS_CONF);
+    if (max_cpus <= 0)
+        return NULL;
+
+    int *cpu_list = prax_malloc(max_cpus * sizeof *cpu_list);
+    if (!cpu_list)
+        return NULL;
+
+    int ncpus = 0;
+    for (int cpu=0; cpu < max_cpus; cpu++) {
+        if (!cpus || CPU_ISSET_S(cpu, setsize, cpus))
+            cpu_list[ncpus++] = cpu;
+    }
+
+    if (group_size <= 0 || group_size > ncpus)
+        group_size = ncpus;
+
+    int ngroups = ncpus ? (ncpus + group_size - 1) / group_size : 0;
+
+    if (!ngroups) {
+        free(cpu_list);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    exit_listener_t *listener = prax_calloc(1, sizeof *listener +
+                                            ngroups * sizeof(struct exit_group));
+    if (!listener) {
+        free(cpu_list);
+        return NULL;
+    }
+
+    listener->callback = callback;
+    listener->arg = arg;
+    listener->stop_fd = -1;
+
+    for (int i=0; i < ngroups; i++)
+        listener->groups[i].nl_conn = -1;
+
+    listener->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (listener->stop_fd < 0)
+        goto listener_error;
+
+    for (int i=0; i < ngroups; i++) {
+        int first = i * group_size;
+        int count = ncpus - first < group_size ? ncpus - first : group_size;
+
+        listener->ngroups++;
+        if (init_exit_group(listener, &(listener->groups[i]),
+                            cpu_list + first, count) < 0)
+            goto listener_error;
+    }
+
+    free(cpu_list);
+
+    return listener;
+
+listener_error:
+    free(cpu_list);
+    free_exit_listener(listener);
+
+    return NULL;
+}
+
+int exit_listener_read(exit_listener_t *listener, struct exit_record *records,
+                       int max)
+{
+    if (!listener || listener->callback)
+        return -1;
+
+    int count = 0;
+
+    // Start at a different group each call so a busy one can't starve
+    // the rest.
+    for (int i=0; i < listener->ngroups && count < max; i++) {
+        int idx = (listener->next_group + i) % listener->ngroups;
+        struct exit_group *group = &(listener->groups[idx]);
+
+        size_t tail = group->tail;
+        size_t head = __atomic_load_n(&(group->head), __ATOMIC_ACQUIRE);
+
+        for (; tail != head && count < max; tail++)
+            records[count++] = group->ring[tail & (EXIT_RING_SIZE - 1)];
+
+        __atomic_store_n(&(group->tail), tail, __ATOMIC_RELEASE);
+    }
+
+    listener->next_group = (listener->next_group + 1) % listener->ngroups;
+
+    return count;
+}
+
+uint64_t exit_listener_dropped(exit_listener_t *listener)
+{
+    uint64_t dropped = 0;
+
+    for (int i=0; listener && i < listener->ngroups; i++)
+        dropped += __atomic_load_n(&(listener->groups[i].dropped),
+                                   __ATOMIC_RELAXED);
+
+    return dropped;
+}
+
+void free_exit_listener(exit_listener_t *listener)
+{
+    if (!listener)
+        return;
+
+    if (listener->stop_fd > -1)
+        eventfd_write(listener->stop_fd, 1);
+
+    for (int i=0; i < listener->ngroups; i++) {
+        struct exit_group *group = &(listener->groups[i]);
+
+        if (group->started)
+            pthread_join(group->thread, NULL);
+
+        // Closing the socket drops its registration, waiting for the ack
+        // of a deregister could hang with nothing left to drain exit
+        // records ahead of it.
+        if (group->nl_conn > -1)
+            close(group->nl_conn);
+
+        free(group->cpumask);
+        free(group->recv_buf);
+        free(group->ring);
+    }
+
+    if (listener->stop_fd > -1)
+        close(listener->stop_fd);
+
+    free(listener);
+}
@@ -0,0 +1,552 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+
+// Fixed read buffer of the smaps stream, a line never spans more than it.
+#define SMAPS_BUF_SIZE 32768
+
+#define MEM_FIELD(key, member) PROCFS_FIELD(struct proc_mem, key, FIELD_DEC, member)
+
+static const struct procfs_field smaps_fields[] = {
+    MEM_FIELD("Size", size),
+    MEM_FIELD("Rss", rss),
+    MEM_FIELD("Pss", pss),
+    MEM_FIELD("Pss_Anon", pss_anon),
+    MEM_FIELD("Pss_File", pss_file),
+    MEM_FIELD("Pss_Shmem", pss_shmem),
+    MEM_FIELD("Shared_Clean", shared_clean),
+    MEM_FIELD("Shared_Dirty", shared_dirty),
+    MEM_FIELD("Private_Clean", private_clean),
+    MEM_FIELD("Private_Dirty", private_dirty),
+    MEM_FIELD("Referenced", referenced),
+    MEM_FIELD("Anonymous", anonymous),
+    MEM_FIELD("Swap", swap),
+    MEM_FIELD("SwapPss", swap_pss),
+    MEM_FIELD("Locked", locked)
+};
+
+
+#define NMEM_COUNTERS (sizeof(struct proc_mem) / sizeof(uint64_t))
+
+struct smaps_parser {
+    // NULL when only the totals are wanted.
+    struct smaps_table *table;
+    int flags;
+    struct proc_mem *total;
+    // Fields of the mapping being read and the entry it is summed into.
+    struct proc_mem mapping;
+    bool in_mapping;
+    size_t entry;
+};
+
+int profile_refresh_statm(profile_t *process)
+{
+    STATS_TIMED(STATS_REFRESH_STATM);
+
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    char buf[128];
+    if (read_procfs_hot(process, PROCFS_STATM, buf, sizeof buf) <= 0)
+        return -1;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    // size resident shared text lib data dt, lib and dt are always 0.
+    uint64_t pages[7];
+    char *field = buf;
+    for (int i=0; i < 7; i++)
+        field = scan_dec(field, &pages[i]);
+
+    struct proc_statm *statm = &(process->statm);
+    statm->size = pages[0] * page_size;
+    statm->resident = pages[1] * page_size;
+    statm->shared = pages[2] * page_size;
+    statm->text = pages[3] * page_size;
+    statm->data = pages[5] * page_size;
+
+    return 0;
+}
+
+static void add_mem(struct proc_mem *dst, const struct proc_mem *src)
+{
+    uint64_t *d = (uint64_t *) dst;
+    const uint64_t *s = (const uint64_t *) src;
+
+    for (size_t i=0; i < NMEM_COUNTERS; i++)
+        d[i] += s[i];
+}
+
+static void derive_mem(struct proc_mem *mem)
+{
+    mem->uss = mem->private_clean + mem->private_dirty;
+    mem->file = mem->rss > mem->anonymous ? mem->rss - mem->anonymous : 0;
+}
+
+static uint32_t hash_path(const char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *path; path++)
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+
+    return hash;
+}
+
+// Returns the bucket holding path, or the empty one it belongs in.
+static size_t find_bucket(struct smaps_table *table, const char *path)
+{
+    size_t mask = table->nbuckets - 1;
+    size_t slot;
+
+    for (slot = hash_path(path) & mask; table->buckets[slot];
+         slot = (slot + 1) & mask) {
+        const struct smaps_entry *entry =
+            &(table->entries[table->buckets[slot] - 1]);
+        if (!strcmp(table->paths + entry->path_off, path))
+            break;
+    }
+
+    return slot;
+}
+
+// Doubles the buckets once they are half full and reinserts every entry.
+static int rehash(struct smaps_table *table)
+{
+    if (table->count * 2 < table->nbuckets)
+        return 0;
+
+    size_t nbuckets = table->nbuckets ? table->nbuckets * 2 : 256;
+    uint32_t *buckets = prax_calloc(nbuckets, sizeof *buckets);
+    if (!buckets)
+        return -1;
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+
+    for (size_t i=0; i < table->count; i++) {
+        const char *path = table->paths + table->entries[i].path_off;
+        table->buckets[find_bucket(table, path)] = i + 1;
+    }
+
+    return 0;
+}
+
+// Returns the index of the entry a mapping of path is summed into, adding
+// one when needed, or -1.
+static ssize_t smaps_entry_for(struct smaps_parser *parser, const char *path,
+                               bool *added)
+{
+    struct smaps_table *table = parser->table;
+    bool by_file = parser->flags & SMAPS_BY_FILE;
+    size_t slot = 0;
+
+    *added = false;
+
+    if (by_file) {
+        if (rehash(table) < 0)
+            return -1;
+        slot = find_bucket(table, path);
+        if (table->buckets[slot])
+            return table->buckets[slot] - 1;
+    }
+
+    size_t len = strlen(path) + 1;
+    if (RESERVE(table->entries, table->cap, table->count + 1) < 0 ||
+        RESERVE(table->paths, table->paths_cap, table->paths_len + len) < 0)
+        return -1;
+
+    struct smaps_entry *entry = &(table->entries[table->count]);
+    memset(entry, 0, sizeof *entry);
+    entry->path_off = table->paths_len;
+    memcpy(table->paths + table->paths_len, path, len);
+    table->paths_len += len;
+
+    if (by_file)
+        table->buckets[slot] = table->count + 1;
+
+    *added = true;
+
+    return table->count++;
+}
+
+static void end_mapping(struct smaps_parser *parser)
+{
+    if (!parser->in_mapping)
+        return;
+
+    add_mem(parser->total, &(parser->mapping));
+    if (parser->table)
+        add_mem(&(parser->table->entries[parser->entry].mem),
+                &(parser->mapping));
+
+    parser->in_mapping = false;
+}
+
+// "start-end perms offset major:minor inode    path"
+static int parse_mapping_header(struct smaps_parser *parser, char *line)
+{
+    uint64_t start, end, offset, major, minor, ino;
+    char perms[5];
+
+    line = scan_hex(line, &start);
+    line = scan_hex(line + 1, &end);
+    for (; *line == ' '; line++)
+        ;
+    memcpy(perms, line, 4);
+    perms[4] = '\0';
+    line = scan_hex(line + 4, &offset);
+    line = scan_hex(line, &major);
+    line = scan_hex(line + 1, &minor);
+    line = scan_dec(line, &ino);
+    for (; *line == ' ' || *line == '\t'; line++)
+        ;
+
+    memset(&(parser->mapping), 0, sizeof parser->mapping);
+    parser->in_mapping = true;
+
+    if (!parser->table)
+        return 0;
+
+    bool added;
+    ssize_t index = smaps_entry_for(parser, line, &added);
+    if (index < 0)
+        return -1;
+
+    struct smaps_entry *entry = &(parser->table->entries[index]);
+    if (added) {
+        entry->start = start;
+        entry->end = end;
+        entry->offset = offset;
+        entry->dev = makedev(major, minor);
+        entry->ino = ino;
+        memcpy(entry->perms, perms, sizeof entry->perms);
+    }
+    entry->nmappings++;
+    parser->entry = index;
+
+    return 0;
+}
+
+static int parse_smaps_line(void *ctx, char *line)
+{
+    struct smaps_parser *parser = ctx;
+
+    // Headers start with the lower case hex start address, field keys with
+    // an upper case letter.
+    if ((*line >= '0' && *line <= '9') || (*line >= 'a' && *line <= 'f')) {
+        end_mapping(parser);
+        return parse_mapping_header(parser, line);
+    }
+
+    if (parser->in_mapping)
+        parse_procfs_fields(line, smaps_fields, NFIELDS(smaps_fields),
+                            &(parser->mapping));
+
+    return 0;
+}
+
+/*
+ * Reads file in SMAPS_BUF_SIZE pieces, handing the complete lines of each to
+ * parse_line and carrying the partial last line over to the front of the
+ * buffer, so memory stays fixed however many mappings the process has.
+ */
+static int stream_lines(profile_t *process, const char *file,
+                        int (*parse_line)(void *ctx, char *line), void *ctx)
+{
+    char buf[SMAPS_BUF_SIZE];
+    size_t len = 0;
+    int ret = -1;
+
+    int fd = prax_openat(process->proc_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    for (;;) {
+        ssize_t bytes_read = read(fd, buf + len, sizeof buf - 1 - len);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+            goto close_file;
+
+        STATS_ADD(bytes_read, bytes_read);
+
+        len += bytes_read;
+        buf[len] = '\0';
+
+        char *line = buf;
+        char *end;
+        while ((end = memchr(line, '\n', buf + len - line))) {
+            *end = '\0';
+            if (parse_line(ctx, line) < 0)
+                goto close_file;
+            line = end + 1;
+        }
+
+        len = buf + len - line;
+
+        // A line filling the whole buffer is cut short rather than lost.
+        if ((bytes_read == 0 && len) || len == sizeof buf - 1) {
+            if (parse_line(ctx, line) < 0)
+                goto close_file;
+            len = 0;
+        }
+
+        if (bytes_read == 0)
+            break;
+
+        memmove(buf, line, len);
+    }
+
+    ret = 0;
+
+close_file:
+    close(fd);
+
+    return ret;
+}
+
+static int stream_smaps(profile_t *process, struct smaps_parser *parser)
+{
+    memset(parser->total, 0, sizeof *parser->total);
+
+    if (stream_lines(process, SMAPS, parse_smaps_line, parser) < 0)
+        return -1;
+
+    end_mapping(parser);
+    derive_mem(parser->total);
+
+    return 0;
+}
+
+int profile_refresh_memory(profile_t *process)
+{
+    STATS_TIMED(STATS_REFRESH_MEMORY);
+
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    char buf[STAT_SIZE];
+    if (read_procfs_hot(process, PROCFS_SMAPS_ROLLUP, buf, sizeof buf) < 0) {
+        if (errno != ENOENT)
+            return -1;
+
+        // Before 4.14, sum every mapping instead.
+        struct smaps_parser parser = { .total = &(process->mem) };
+        return stream_smaps(process, &parser);
+    }
+
+    memset(&(process->mem), 0, sizeof process->mem);
+    parse_procfs_fields(buf, smaps_fields, NFIELDS(smaps_fields),
+                        &(process->mem));
+    derive_mem(&(process->mem));
+
+    return 0;
+}
+
+int process_smaps(profile_t *process, int flags)
+{
+    STATS_TIMED(STATS_SMAPS);
+
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    struct smaps_table *table = &(process->maps);
+
+    // Resetting the table keeps the entries, slab and buckets for the next
+    // refresh.
+    table->count = 0;
+    table->paths_len = 0;
+    if (table->buckets)
+        memset(table->buckets, 0, table->nbuckets * sizeof *table->buckets);
+
+    struct smaps_parser parser = {
+        .table = table,
+        .flags = flags,
+        .total = &(process->mem)
+    };
+
+    if (stream_smaps(process, &parser) < 0)
+        return -1;
+
+    for (size_t i=0; i < table->count; i++)
+        derive_mem(&(table->entries[i].mem));
+
+    return table->count;
+}
+
+// Grows the nodes to cover node, zeroing the new ones.
+static int cover_node(struct numa_mem *numa, size_t node)
+{
+    if (node < numa->nnodes)
+        return 0;
+
+    if (RESERVE(numa->nodes, numa->cap, node + 1) < 0)
+        return -1;
+
+    memset(&(numa->nodes[numa->nnodes]), 0,
+           (node + 1 - numa->nnodes) * sizeof *numa->nodes);
+    numa->nnodes = node + 1;
+
+    return 0;
+}
+
+/*
+ * "start policy [file=path|heap|stack] [huge] [anon=n] ... N0=n N1=n
+ * kernelpagesize_kB=n", the page counts of every node come before the page
+ * size they are in.  hugetlbfs mappings are counted as huge only, file
+ * backed ones as file even for their private copies.
+ */
+static int parse_numa_line(void *ctx, char *line)
+{
+    struct numa_mem *numa = ctx;
+    bool file = false;
+    bool huge = false;
+    uint64_t page_kb;
+
+    char *page_size = strstr(line, " kernelpagesize_kB=");
+    if (!page_size)
+        return 0;
+    scan_dec(page_size + 19, &page_kb);
+
+    for (char *token=strchr(line, ' '); token; token = strchr(token, ' ')) {
+        token++;
+
+        if (!strncmp(token, "file=", 5)) {
+            file = true;
+        } else if (!strncmp(token, "huge", 4) &&
+                   (token[4] == ' ' || !token[4])) {
+            huge = true;
+        } else if (*token == 'N' && token[1] >= '0' && token[1] <= '9') {
+            uint64_t node, pages;
+            char *count = scan_dec(token + 1, &node);
+            if (*count != '=')
+                continue;
+            scan_dec(count + 1, &pages);
+
+            if (cover_node(numa, node) < 0)
+                return -1;
+
+            struct numa_node_mem *mem = &(numa->nodes[node]);
+            uint64_t kb = pages * page_kb;
+            if (huge)
+                mem->huge += kb;
+            else if (file)
+                mem->file += kb;
+            else
+                mem->anon += kb;
+            numa->total += kb;
+        }
+    }
+
+    return 0;
+}
+
+// Cpus of node, read on first use since the topology does not change.
+static const struct cpu_mask *node_cpus(struct numa_mem *numa, size_t node)
+{
+    if (node >= numa->nnode_cpus) {
+        if (RESERVE(numa->node_cpus, numa->node_cpus_cap, node + 1) < 0)
+            return NULL;
+
+        memset(&(numa->node_cpus[numa->nnode_cpus]), 0,
+               (node + 1 - numa->nnode_cpus) * sizeof *numa->node_cpus);
+        numa->nnode_cpus = node + 1;
+    }
+
+    struct cpu_mask *mask = &(numa->node_cpus[node]);
+
+    // A node with memory only has an empty list and keeps an empty mask.
+    if (!mask->set && node_cpu_mask(node, mask) < 0 && !mask->set)
+        return NULL;
+
+    return mask;
+}
+
+static bool masks_intersect(const struct cpu_mask *a,
+                            const struct cpu_mask *b)
+{
+    size_t size = a->size < b->size ? a->size : b->size;
+
+    for (size_t cpu=0; cpu < size * 8; cpu++) {
+        if (CPU_ISSET_S(cpu, a->size, a->set) &&
+            CPU_ISSET_S(cpu, b->size, b->set))
+            return true;
+    }
+
+    return false;
+}
+
+int profile_refresh_numa(profile_t *process)
+{
+    STATS_TIMED(STATS_REFRESH_NUMA);
+
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    struct numa_mem *numa = &(process->numa);
+
+    // Nodes stay covered once seen, so indexes are stable across refreshes.
+    if (numa->nodes)
+        memset(numa->nodes, 0, numa->nnodes * sizeof *numa->nodes);
+    numa->total = 0;
+    numa->local = 0;
+    numa->locality = 1;
+
+    if (stream_lines(process, NUMA_MAPS, parse_numa_line, numa) < 0 ||
+        profile_refresh_affinity(process) < 0)
+        return -1;
+
+    for (size_t node=0; node < numa->nnodes; node++) {
+        struct numa_node_mem *mem = &(numa->nodes[node]);
+        if (!(mem->anon + mem->file + mem->huge))
+            continue;
+
+        // Nodes with memory only are never local.
+        const struct cpu_mask *cpus = node_cpus(numa, node);
+        if (cpus && masks_intersect(cpus, &(process->affinity)))
+            numa->local += mem->anon + mem->file + mem->huge;
+    }
+
+    if (numa->total)
+        numa->locality = (double) numa->local / numa->total;
+
+    return 0;
+}
+
+const char *smaps_entry_path(profile_t *process,
+                             const struct smaps_entry *entry)
+{
+    return process->maps.paths + entry->path_off;
+}
+
+void free_profile_smaps(profile_t *process)
+{
+    struct smaps_table *table = &(process->maps);
+
+    free(table->entries);
+    free(table->paths);
+    free(table->buckets);
+
+    memset(table, 0, sizeof *table);
+
+    for (size_t node=0; node < process->numa.nnode_cpus; node++)
+        cpu_mask_free(&(process->numa.node_cpus[node]));
+    free(process->numa.node_cpus);
+    free(process->numa.nodes);
+    memset(&(process->numa), 0, sizeof process->numa);
+}
@@ -1,14 +1,13 @@
-#include "prax.h"
+#include "prax_internal.h"
 
-#include <pwd.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <sched.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <limits.h>
-#include <dirent.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -17,386 +16,286 @@
 #include <sys/syscall.h>
 
 
+/*
+ * The pidfd turns readable once the process exited, so liveness never
+ * depends on the pid still naming the same process.  Kernels before 5.3
+ * have no pidfd and fall back to probing the pid.
+ */
 bool is_alive(profile_t *process)
 {
-    if (!opendir(process->procfs_base))
+    if (process->pidfd > -1) {
+        struct pollfd pfd = { .fd = process->pidfd, .events = POLLIN };
+        return poll(&pfd, 1, 0) == 0;
+    }
+
+    if (kill(process->pid, 0) < 0 && errno == ESRCH)
         return false;
 
     return true;
 }
 
-static inline void procfs_filename(char *base, char *field, size_t len)
+// Guards the calls that can only name the process by pid.  A pid is only
+// reused once its process exited, so a live pidfd right before the call
+// means the pid still names the profiled process.
+static int check_pid(profile_t *process)
 {
-    int field_len = strlen(field);
-
-    for (int i=0; i < field_len; i++)
-        base[len + i] = field[i];
+    if (is_alive(process))
+        return 0;
 
-    base[len + field_len] = '\0';
+    errno = ESRCH;
+    return -1;
 }
 
-static char *parse_status_fields(profile_t *p, char *field, int (*accept_char)(int c))
-{
-    p->procfs_base[p->procfs_len] = '\0';
-    procfs_filename(p->procfs_base, STATUS, p->procfs_len);
-
-    FILE *fp = fopen(p->procfs_base, "r");
-    if (!fp)
-        return NULL;
-
-    char status[STATUS_SIZE];
-    if (fread(status, 1, STATUS_SIZE - 1, fp) < 0)
-        goto close_path;
-
-    char *delimiter = "\n";
-    char *field_token = strtok(status, delimiter);
-
-    char *value = NULL;
-    while (field_token) {
-        if (strstr(field_token, field)) {
-            char *value_raw = strchr(field_token, '\t');
-            for (; isblank(*value_raw); value_raw++);
-            value = malloc(MAX_FIELD);
-            int idx = 0;
-            for (; idx < MAX_FIELD - 1 && accept_char(value_raw[idx]); idx++)
-                value[idx] = value_raw[idx];
-            value[idx] = '\0';
-            goto close_path;
-        }
-
-        field_token = strtok(NULL, delimiter);
+#define STATUS_FIELD(key, type, member) PROCFS_FIELD(profile_t, key, type, member)
+
+static const struct procfs_field status_fields[] = {
+    STATUS_FIELD("Tgid", FIELD_DEC, tgid),
+    STATUS_FIELD("TracerPid", FIELD_DEC, trace_pid),
+    STATUS_FIELD("Uid", FIELD_UIDS, cred),
+    STATUS_FIELD("Gid", FIELD_GIDS, cred),
+    STATUS_FIELD("VmPeak", FIELD_DEC, vm_peak),
+    STATUS_FIELD("VmSize", FIELD_DEC, vmem),
+    STATUS_FIELD("VmRSS", FIELD_DEC, vm_rss),
+    STATUS_FIELD("Threads", FIELD_DEC, thread_count),
+    STATUS_FIELD("SigQ", FIELD_SIGQ, psig),
+    STATUS_FIELD("SigPnd", FIELD_HEX, psig.signal_thr_mask),
+    STATUS_FIELD("ShdPnd", FIELD_HEX, psig.signal_ps_mask),
+    STATUS_FIELD("SigBlk", FIELD_HEX, psig.signals_blocked),
+    STATUS_FIELD("SigIgn", FIELD_HEX, psig.signals_ignored),
+    STATUS_FIELD("SigCgt", FIELD_HEX, psig.signals_caught),
+    STATUS_FIELD("voluntary_ctxt_switches", FIELD_DEC, vol_ctxt_swt),
+    STATUS_FIELD("nonvoluntary_ctxt_switches", FIELD_DEC, invol_ctxt_swt)
+};
+
+
+#define IO_FIELD(key, member) PROCFS_FIELD(profile_t, key, FIELD_DEC, member)
+
+static const struct procfs_field io_fields[] = {
+    IO_FIELD("rchar", io.read_char),
+    IO_FIELD("wchar", io.write_char),
+    IO_FIELD("read_bytes", io.read_bytes),
+    IO_FIELD("write_bytes", io.write_bytes),
+    IO_FIELD("cancelled_write_bytes", io.cancelled_write_bytes)
+};
+
+
+static const char *hot_files[PROCFS_NHOT] = {
+    [PROCFS_STAT] = STAT,
+    [PROCFS_STATUS] = STATUS,
+    [PROCFS_STATM] = STATM,
+    [PROCFS_IO] = IO,
+    [PROCFS_SCHEDSTAT] = SCHEDSTAT,
+    [PROCFS_SMAPS_ROLLUP] = SMAPS_ROLLUP,
+    [PROCFS_LIMITS] = LIMITS
+};
+
+/*
+ * Reads one of the hot files through its cached descriptor, opening it
+ * relative to proc_fd the first time.  Two callers racing on the first open
+ * both succeed, the loser closes its descriptor.
+ */
+ssize_t read_procfs_hot(profile_t *process, enum procfs_hot file,
+                               char *buf, size_t size)
+{
+    int fd = __atomic_load_n(&(process->hot_fds[file]), __ATOMIC_ACQUIRE);
+
+    if (fd < 0) {
+        int new_fd = prax_openat(process->proc_fd, hot_files[file],
+                                 O_RDONLY | O_CLOEXEC);
+        if (new_fd < 0)
+            return -1;
+
+        if (__atomic_compare_exchange_n(&(process->hot_fds[file]), &fd,
+                                        new_fd, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            fd = new_fd;
+        else
+            close(new_fd);
     }
 
-close_path:
-    fclose(fp);
-
-    return value;
+    return read_procfs_fd(fd, buf, size);
 }
 
-int yama_enabled(void)
+int profile_refresh_status(profile_t *process)
 {
-    FILE *fh = fopen(YAMA, "r");
-
-    if (!fh)
-        return 0;
-
-    char yama_byte;
+    STATS_TIMED(STATS_REFRESH_STATUS);
 
-    if (fread(&yama_byte, 1, 1, fh) < 0)
-        return 0;
-
-    return yama_byte == '1';
-}
-
-int is_traced(profile_t *process)
-{
-    char *tracer_pidstr = parse_status_fields(process, "TracerPid", isdigit);
-    if (!tracer_pidstr)
-        return 0;
-
-    errno = 0;
-    strtol(tracer_pidstr, NULL, 0);
-    return errno ? 0 : 1;
-}
-
-void get_trace_pid(profile_t *process)
-{
-    char *tracer_pidstr = parse_status_fields(process, "TracerPid", isdigit);
-    errno = 0;
-    process->trace_pid = strtol(tracer_pidstr, NULL, 0);
-    if (errno)
-        process->trace_pid = 0;
-}
+    if (!process)
+        return -1;
 
-static void *parse_taskmsg(int req, struct taskmsg *msg)
-{
-    int msglength = msg->nl.nlmsg_len;
+    PROFILE_LOCKED(process);
 
-    msglength -= (NLMSG_HDRLEN + GENL_HDRLEN);
-    struct nlattr *nla = GENLMSG_DATA(msg->gnl);
-    int nla_msg_len = 0;
+    char buf[STATUS_SIZE];
+    if (read_procfs_hot(process, PROCFS_STATUS, buf, sizeof buf) < 0)
+        return -1;
 
-    while (msglength > 0) {
-        if (nla->nla_type == req)
-            return (void *) ((char *) nla + NLA_HDRLEN);
-        else if (nla->nla_type == TASKSTATS_TYPE_AGGR_PID) {
-            nla_msg_len = NLA_HDRLEN;
-            msglength -= nla_msg_len;
-        } else {
-            nla_msg_len = NLMSG_ALIGN(nla->nla_len);
-            msglength -= nla->nla_len;
-        }
+    parse_procfs_fields(buf, status_fields, NFIELDS(status_fields), process);
 
-        nla = (struct nlattr *) ((char *) nla + nla_msg_len);        
-    }
+    process->is_traced = process->trace_pid != 0;
 
-    return NULL;
+    return 0;
 }
 
-static int create_nl_conn(void)
+int profile_refresh_stat(profile_t *process)
 {
-    int nl_conn = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    STATS_TIMED(STATS_REFRESH_STAT);
 
-    if (nl_conn < 0)
+    if (!process)
         return -1;
 
-    struct sockaddr_nl addr;
-    memset(&addr, 0, sizeof addr);
+    PROFILE_LOCKED(process);
 
-    addr.nl_family = AF_NETLINK;
+    char buf[STAT_SIZE];
+    if (read_procfs_hot(process, PROCFS_STAT, buf, sizeof buf) <= 0)
+        return -1;
 
-    if (bind(nl_conn, (struct sockaddr *) &addr, sizeof addr) < 0)
+    if (parse_proc_stat(buf, &(process->stat)) < 0)
         return -1;
 
-    return nl_conn;
+    process->start_time = process->stat.starttime;
+
+    return 0;
 }
 
-static inline void build_req(struct taskmsg *msg, int nl_type, int cmd,
-                        int nla_type, int nla_data_len, void *nla_data)
+int profile_refresh_io(profile_t *process)
 {
-    msg->nl.nlmsg_flags = NLM_F_REQUEST;
-    msg->nl.nlmsg_type = nl_type;
-    msg->nl.nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN;
+    STATS_TIMED(STATS_REFRESH_IO);
 
-    msg->gnl.version = 0x1;
-    msg->gnl.cmd = cmd;
+    if (!process)
+        return -1;
 
-    struct nlattr *nla = GENLMSG_DATA(msg->gnl);
-    nla->nla_type = nla_type;
-    nla->nla_len = NLA_HDRLEN + nla_data_len;
-    msg->nl.nlmsg_len += NLMSG_ALIGN(nla->nla_len);
-    memcpy(NLA_DATA(nla), nla_data, nla_data_len); 
-}
- 
-static int recv_nl_req(int conn, struct taskmsg *msg)
-{
-    int bytes_recv = recv(conn, msg, sizeof *msg, 0);
+    PROFILE_LOCKED(process);
 
-    if (bytes_recv < 0)
+    char buf[STAT_SIZE];
+    if (read_procfs_hot(process, PROCFS_IO, buf, sizeof buf) <= 0)
         return -1;
 
+    parse_procfs_fields(buf, io_fields, NFIELDS(io_fields), process);
+
     return 0;
 }
 
-static void *make_nl_req(int req, profile_t *process)
+int profile_refresh_schedstat(profile_t *process)
 {
-    struct taskmsg *msg = calloc(1, sizeof *msg);
-    void *task_ret = NULL;
-
-    int data_len;
+    STATS_TIMED(STATS_REFRESH_SCHEDSTAT);
 
-    switch (req) {
+    if (!process)
+        return -1;
 
-        case (CTRL_CMD_GETFAMILY):
-            data_len = strlen(TASKSTATS_GENL_NAME) + 1;
-            build_req(msg, GENL_ID_CTRL, req, CTRL_ATTR_FAMILY_NAME,
-                       data_len, TASKSTATS_GENL_NAME);
-            break;
-        case (TASKSTATS_CMD_GET):
-            build_req(msg, process->nl_family_id, req,
-                TASKSTATS_CMD_ATTR_PID, sizeof(int), &(process->pid));
-            break;
-    }
+    PROFILE_LOCKED(process);
 
-    struct sockaddr_nl addr;
-    memset(&addr, 0, sizeof addr);
-    addr.nl_family = AF_NETLINK;
-    
-    int msglength = msg->nl.nlmsg_len;
-    char *msg_buffer = (char *) msg;
-
-    while (msglength > 0) {
-        int bytes_sent = sendto(process->nl_conn, msg_buffer, msglength, 0,
-                            (struct sockaddr *) &addr, sizeof addr);
-        if (bytes_sent < 0)
-            goto release;
-        msglength -= bytes_sent;
-        msg_buffer += bytes_sent;
-    }
-    
-    memset(msg, 0, sizeof *msg);
-    
-    if (recv_nl_req(process->nl_conn, msg) < 0)
-        goto release;
-
-    // rm copy dup
-    if (req == TASKSTATS_CMD_GET) {
-        void *parse_results = parse_taskmsg(TASKSTATS_TYPE_STATS, msg);
-        if (parse_results) {
-            task_ret = malloc(sizeof(struct taskstats));
-            memcpy(task_ret, parse_results, sizeof(struct taskstats));
-        }
-    } else if (req == CTRL_CMD_GETFAMILY) {
-        void *parse_results = parse_taskmsg(CTRL_ATTR_FAMILY_ID, msg);
-        if (parse_results) {
-            task_ret = malloc(sizeof(int));
-            memcpy(task_ret, parse_results, sizeof(int));
-        }
-    }
+    char buf[128];
+    if (read_procfs_hot(process, PROCFS_SCHEDSTAT, buf, sizeof buf) <= 0)
+        return -1;
 
-release:
-    free(msg);
+    char *field = scan_dec(buf, &(process->sched.run_time));
+    field = scan_dec(field, &(process->sched.run_delay));
+    scan_dec(field, &(process->sched.timeslices));
 
-    return task_ret;
+    return 0;
 }
 
-#define TASK_REQ(profile, field, p_off, size)                             \
-    get_task_field(profile, offsetof(struct taskstats, field), p_off, size)
-
-static void get_task_field(profile_t *process, int st_off, 
-                                   int p_off, size_t size)
+int yama_enabled(void)
 {
-    struct taskstats *st = (struct taskstats *) make_nl_req(TASKSTATS_CMD_GET, 
-                                                                     process);
-    
-    if (st == NULL)
-        return;
+    char buf[16];
 
-    *(((char *) process) + p_off) = *(((char *) st) + st_off);
+    if (read_procfs_at(AT_FDCWD, YAMA, buf, sizeof buf) <= 0)
+        return 0;
+
+    return buf[0] == '1';
 }
 
-static int get_nl_family_id(profile_t *process)
+int is_traced(profile_t *process)
 {
-    void *family_id = make_nl_req(CTRL_CMD_GETFAMILY, process);
+    PROFILE_LOCKED(process);
 
-    if (family_id) {
-        int id = *(int *) family_id;
-        free(family_id);
-        return id;
-    }
+    if (profile_refresh_status(process) < 0)
+        return 0;
 
-    return -1;
+    return process->is_traced;
 }
 
-int get_signals(profile_t *process)
+void get_trace_pid(profile_t *process)
 {
-    if (!process)
-        return -1;
-
-    procfs_filename(process->procfs_base, STATUS, process->procfs_len);
-
-    char buf[STATUS_SIZE] = { '\0' };
-
-    FILE *fp = fopen(process->procfs_base, "r");
-    if (!fp)
-        return -1;
+    PROFILE_LOCKED(process);
 
-    if (fread(buf, STATUS_SIZE - 1, 1, fp) < 0)
-        goto error;
-
-    char *d1 = "Q";
-    char *d2 = "\t";
-
-    char *signals = strtok(buf, d1);
-    if (!signals) 
-        goto error;
-
-    signals = strtok(NULL, d2);
-    char signal_bytes[32] = { '\0' };
-    long *psig = (long *) &(process->psig);
-    for (int i=0; i < 6; i++, psig++) {
-        signals = strtok(NULL, d2);
-        for (int j=1; isalnum(signals[j]); j++)
-            signal_bytes[j - 1] = signals[j];
-       *psig = strtol(signal_bytes, NULL, 16); 
-    }
-
-    return 0;
-
-error:
-    fclose(fp);
-    return -1;
+    if (profile_refresh_status(process) < 0)
+        process->trace_pid = 0;
 }
 
-int pid_name(profile_t *process)
+int profile_refresh_taskstats(profile_t *process)
 {
-    procfs_filename(process->procfs_base, COMM, process->procfs_len);
+    STATS_TIMED(STATS_REFRESH_TASKSTATS);
 
-    FILE *proc = fopen(process->procfs_base, "r");
-
-    if (proc == NULL) 
+    if (!process || process->nl_conn < 0 || process->nl_family_id < 0)
         return -1;
 
-    if (fscanf(proc, "%32c", process->name) < 1)
+    // Also keeps a single request in flight on the profile's socket.
+    PROFILE_LOCKED(process);
+
+    struct taskmsg msg;
+    void *stats = make_nl_req(TASKSTATS_CMD_GET, process->nl_conn, 
+                              process->nl_family_id, process->pid, &msg);
+    if (!stats)
         return -1;
 
-    fclose(proc);
-    process->name[strlen(process->name) - 1] = '\0';
+    struct taskstats *st = &(process->tstats);
+    copy_taskstats(st, stats);
+
+    process->nice = (int8_t) st->ac_nice;
+    process->vol_ctxt_swt = st->nvcsw;
+    process->invol_ctxt_swt = st->nivcsw;
+    process->start_time = st->ac_btime;
+    process->virtmem = st->virtmem;
+    process->coremem = st->coremem;
+    process->utime = st->ac_utime;
+    process->stime = st->ac_stime;
+
+    process->delay.cpu_total = st->cpu_delay_total;
+    process->delay.blkio_total = st->blkio_delay_total;
+    process->delay.swapin_total = st->swapin_delay_total;
+    process->delay.freepages_total = st->freepages_delay_total;
+    process->delay.thrashing_total = st->thrashing_delay_total;
+
+    process->io.read_bytes = st->read_bytes;
+    process->io.write_bytes = st->write_bytes;
+    process->io.cancelled_write_bytes = st->cancelled_write_bytes;
+    process->io.read_char = st->read_char;
+    process->io.write_char = st->write_char;
 
     return 0;
 }
 
-static void set_realpath(char *path, fdstats_t *fdstats)
+int get_signals(profile_t *process)
 {
-    char realpath[PATH_MAX + 1] = { '\0' };
-    size_t len;
+    PROFILE_LOCKED(process);
 
-    fdstats->file = NULL;
-
-    if ((len = readlink(path, realpath, PATH_MAX)) < 0)
-        return;
-
-    realpath[len] = '\0';
-
-    fdstats->file = strdup(realpath);
+    return profile_refresh_status(process);
 }
 
-int process_fd_stats(profile_t *process)
+int pid_name(profile_t *process)
 {
-    struct dirent *files;
-
-    size_t procfs_len = process->procfs_len;
-    char *base = (char *) &(process->procfs_base);
-    procfs_filename(base, FD, procfs_len);
-    procfs_len += strlen(FD);
+    STATS_TIMED(STATS_PID_NAME);
 
-    DIR *fd_dir = opendir(base);
+    PROFILE_LOCKED(process);
 
-    if (!fd_dir) 
+    ssize_t len = read_procfs_at(process->proc_fd, COMM, process->name,
+                                 sizeof process->name);
+    if (len <= 0)
         return -1;
 
-    if (process->fd != NULL)
-        free_profile_fd(process);
-
-    if (!(process->fd = calloc(1, sizeof(fdstats_t))))
-        return -1;
-
-    process->fd->next_fd = NULL;
-    fdstats_t *curr = process->fd;
-     
-    while ((files = readdir(fd_dir))) {
-        if (files->d_type == DT_LNK) {
- 
-            procfs_filename(base, files->d_name, procfs_len);
-
-            if (stat(base, &(curr->file_stats)) < 0)
-                continue;
-
-            set_realpath(base, curr);
-
-            if (!curr->file) 
-                continue;
-
-            if (!(curr->next_fd = calloc(1, sizeof(fdstats_t))))
-                break;
-
-            curr->next_fd->next_fd = NULL;
-            curr = curr->next_fd;
-        }
-    }
-
-    if (fd_dir)
-        closedir(fd_dir);
+    if (process->name[len - 1] == '\n')
+        process->name[len - 1] = '\0';
 
     return 0;
 }
 
 int get_process_nice(profile_t *process)
 {
-    if (process->uid == 0) {
-        TASK_REQ(process, ac_nice, offsetof(profile_t, nice), sizeof(int));
+    PROFILE_LOCKED(process);
+
+    if (process->uid == 0 && profile_refresh_taskstats(process) == 0)
         return 0;
-    }
 
     errno = 0;
 
@@ -411,12 +310,18 @@ int get_process_nice(profile_t *process)
 
 void set_pid_nice(profile_t *process, int priority)
 {
-    if (setpriority(PRIO_PROCESS, process->pid, priority) < 0)
+    PROFILE_LOCKED(process);
+
+    if (check_pid(process) < 0 ||
+        setpriority(PRIO_PROCESS, process->pid, priority) < 0)
         process->nice_err = -1;
     else
         process->nice = priority;
 }
 
+static const char *nice_class[4] = {"be/", "rt/", "rt/", "idle"};
+static const char *prio_class[4] = {"", "rt/", "be/", "idle"};
+
 static int get_ioprio_nice(profile_t *process, int ioprio)
 {
     if (get_process_nice(process) < 0)
@@ -445,6 +350,8 @@ static int get_ioprio_nice(profile_t *process, int ioprio)
 
 int get_ioprio(profile_t *process)
 {
+    PROFILE_LOCKED(process);
+
     int ioprio = syscall(GETIOPRIO, IOPRIO_WHO_PROCESS, process->pid);
 
     if (ioprio < 0)
@@ -460,6 +367,11 @@ int get_ioprio(profile_t *process)
 
 int set_ioprio(profile_t *process, int class, int value)
 {
+    PROFILE_LOCKED(process);
+
+    if (check_pid(process) < 0)
+        return -1;
+
     int ioprio = IOPRIO_VALUE(class, value);
     int setioprio = syscall(SETIOPRIO, IOPRIO_WHO_PROCESS, 
                                      process->pid, ioprio);
@@ -471,32 +383,35 @@ int set_ioprio(profile_t *process, int class, int value)
 
 void cpu_affinity(profile_t *process)
 {
-    cpu_set_t procset;
+    PROFILE_LOCKED(process);
 
-    size_t procsize = sizeof procset;
-    if (sched_getaffinity(process->pid, procsize, &procset) < 0)
-        process->cpu_affinity = -1;
-    else 
-        process->cpu_affinity = CPU_COUNT(&procset);
+    profile_refresh_affinity(process);
 }
 
 void setcpu_affinity(profile_t *process, int affinity)
 {
-    cpu_set_t procset;
+    PROFILE_LOCKED(process);
 
-    CPU_ZERO(&procset);
-    for (int i=0; i < affinity; CPU_SET(i++, &procset))
-        ;
-    size_t procsize = sizeof procset;
-    
-    if (sched_setaffinity(process->pid, procsize, &procset) < 0)
+    struct cpu_mask mask = { 0 };
+
+    if (cpu_mask_alloc(&mask) < 0) {
         process->cpu_affinity = -1;
-    else 
-        process->cpu_affinity = affinity;
+        return;
+    }
+
+    for (int i=0; i < affinity && i < mask.size * 8; i++)
+        CPU_SET_S(i, mask.size, mask.set);
+
+    if (set_cpu_mask(process, &mask, 0) < 0)
+        process->cpu_affinity = -1;
+
+    cpu_mask_free(&mask);
 }
 
 void process_sid(profile_t *process)
 {
+    PROFILE_LOCKED(process);
+
     pid_t sid = getsid(process->pid);
     process->sid = sid;
 }
@@ -505,7 +420,8 @@ int set_soft_rlimit(profile_t *process, int resource, unsigned long limit)
 {
     struct rlimit limits = { .rlim_cur=limit };
     
-    if (prlimit(process->pid, resource, &limits, NULL) < 0)
+    if (check_pid(process) < 0 ||
+        prlimit(process->pid, resource, &limits, NULL) < 0)
         return -1;
 
     return 0;
@@ -515,269 +431,262 @@ int set_hard_rlimit(profile_t *process, int resource, unsigned long limit)
 {
     struct rlimit limits = { .rlim_max=limit };
     
-    if (prlimit(process->pid, resource, &limits, NULL) < 0)
+    if (check_pid(process) < 0 ||
+        prlimit(process->pid, resource, &limits, NULL) < 0)
         return -1;
 
     return 0;
 }
 
-int get_rlimits(profile_t *process, int resource_mask)
-{
-    struct rlimit limits;
-    pid_t pid = process->pid;
-    struct proc_rlim *prlim = &(process->prlim);
+#define RLIM_FIELD(mask, resource, member)                                \
+    { mask, resource, offsetof(struct proc_rlim, member##_cur),            \
+      offsetof(struct proc_rlim, member##_max) }
+
+// LIMIT_* mask bit, RLIMIT_* resource and proc_rlim fields of each limit.
+static const struct {
+    int mask;
+    int resource;
+    size_t cur;
+    size_t max;
+} rlim_fields[NLIMITS] = {
+    RLIM_FIELD(LIMIT_CPU, RLIMIT_CPU, cpu),
+    RLIM_FIELD(LIMIT_FSIZE, RLIMIT_FSIZE, fsize),
+    RLIM_FIELD(LIMIT_DATA, RLIMIT_DATA, data),
+    RLIM_FIELD(LIMIT_STACK, RLIMIT_STACK, stack),
+    RLIM_FIELD(LIMIT_CORE, RLIMIT_CORE, core),
+    RLIM_FIELD(LIMIT_RSS, RLIMIT_RSS, rss),
+    RLIM_FIELD(LIMIT_NOFILE, RLIMIT_NOFILE, nofile),
+    RLIM_FIELD(LIMIT_AS, RLIMIT_AS, addr_space),
+    RLIM_FIELD(LIMIT_NPROC, RLIMIT_NPROC, nproc),
+    RLIM_FIELD(LIMIT_MEMLOCK, RLIMIT_MEMLOCK, memlock),
+    RLIM_FIELD(LIMIT_LOCKS, RLIMIT_LOCKS, locks),
+    RLIM_FIELD(LIMIT_SIGPENDING, RLIMIT_SIGPENDING, sigpending),
+    RLIM_FIELD(LIMIT_MSGQUEUE, RLIMIT_MSGQUEUE, msgqueue),
+    RLIM_FIELD(LIMIT_NICE, RLIMIT_NICE, nice),
+    RLIM_FIELD(LIMIT_RTPRIO, RLIMIT_RTPRIO, rtprio),
+    RLIM_FIELD(LIMIT_RTTIME, RLIMIT_RTTIME, rttime)
+};
+
+int profile_refresh_limits(profile_t *process)
+{
+    STATS_TIMED(STATS_REFRESH_LIMITS);
 
-    for (int i=0; i < NLIMITS; i++) {
-        if (resource_mask & prlimits[i]) {
-            
-            int resource = prlimit_values[i];
-
-            if (prlimit(pid, resource, NULL, &limits) < 0)
-                return -1;
-
-            switch (resource) {
-                case(RLIMIT_AS): 
-                    prlim->addr_space_cur = limits.rlim_cur;
-                    prlim->addr_space_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_CORE):
-                    prlim->core_cur = limits.rlim_cur;
-                    prlim->core_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_CPU):
-                    prlim->cpu_cur = limits.rlim_cur;
-                    prlim->cpu_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_DATA):
-                    prlim->data_cur = limits.rlim_cur;
-                    prlim->data_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_FSIZE):
-                    prlim->fsize_cur = limits.rlim_cur;
-                    prlim->fsize_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_LOCKS):
-                    prlim->locks_cur = limits.rlim_cur;
-                    prlim->locks_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_MEMLOCK):
-                    prlim->memlock_cur = limits.rlim_cur;
-                    prlim->memlock_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_MSGQUEUE):
-                    prlim->msgqueue_cur = limits.rlim_cur;
-                    prlim->msgqueue_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_NICE):
-                    prlim->nice_cur = limits.rlim_cur;
-                    prlim->nice_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_NOFILE):
-                    prlim->nofile_cur = limits.rlim_cur;
-                    prlim->nofile_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_NPROC):
-                    prlim->nproc_cur = limits.rlim_cur;
-                    prlim->nproc_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_RSS):
-                    prlim->rss_cur = limits.rlim_cur;
-                    prlim->rss_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_RTPRIO):
-                    prlim->rtprio_cur = limits.rlim_cur;
-                    prlim->rtprio_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_SIGPENDING):
-                    prlim->sigpending_cur = limits.rlim_cur;
-                    prlim->sigpending_max = limits.rlim_max;
-                    break;
-                case(RLIMIT_STACK):
-                    prlim->stack_cur = limits.rlim_cur;
-                    prlim->stack_max = limits.rlim_max;
-                    break;
-            }
-        }
-    }
+    if (!process)
+        return -1;
+
+    PROFILE_LOCKED(process);
+
+    char buf[STAT_SIZE];
+    if (read_procfs_hot(process, PROCFS_LIMITS, buf, sizeof buf) <= 0)
+        return -1;
+
+    if (parse_proc_limits(buf, process->rlimits) < RLIM_NLIMITS)
+        return -1;
 
     return 0;
 }
 
-int running_threads(profile_t *process)
+int get_rlimits(profile_t *process, int resource_mask)
 {
-    struct dirent *task;
-    
-    procfs_filename(process->procfs_base, TASK, process->procfs_len);
+    STATS_TIMED(STATS_RLIMITS);
+
+    PROFILE_LOCKED(process);
+
+    resource_mask &= (1 << NLIMITS) - 1;
+
+    // Formatting limits costs about 20 prlimit calls, 8us against 0.4us,
+    // so it never wins on cost.  A full mask still reads it, 16 prlimit
+    // calls are near the break even and one read is a single snapshot.
+    bool bulk = resource_mask == (1 << NLIMITS) - 1;
+
+    for (int i=0; i < NLIMITS && !bulk; i++) {
+        int resource = rlim_fields[i].resource;
+        if (!(resource_mask & rlim_fields[i].mask) ||
+            prlimit(process->pid, resource, NULL,
+                    &(process->rlimits[resource])) == 0)
+            continue;
+
+        // prlimit needs the process' uid, limits is world readable.
+        if (errno != EPERM)
+            return -1;
+        bulk = true;
+    }
 
-    DIR *task_dir = opendir(process->procfs_base);
-    if (task_dir == NULL)
+    if (bulk && profile_refresh_limits(process) < 0)
         return -1;
 
-    int thread_cnt = 0;
-    while ((task = readdir(task_dir))) {
-        if (isdigit(task->d_name[0])) 
-            process->threads[thread_cnt++] = atoi(task->d_name);
+    char *prlim = (char *) &(process->prlim);
+
+    for (int i=0; i < NLIMITS; i++) {
+        if (!(resource_mask & rlim_fields[i].mask))
+            continue;
+
+        struct rlimit *limit = &(process->rlimits[rlim_fields[i].resource]);
+        *(rlim_t *) (prlim + rlim_fields[i].cur) = limit->rlim_cur;
+        *(rlim_t *) (prlim + rlim_fields[i].max) = limit->rlim_max;
     }
 
-    closedir(task_dir);
-    process->thread_count = thread_cnt;
     return 0;
 }
 
-void tkill(profile_t *process, int tid)
+int running_threads(profile_t *process)
 {
-    if (syscall(TGKILL, process->tgid, tid, SIGTERM) < 0)
-        printf("Thread kill failed :: id - %d\n", tid);
-}
+    STATS_TIMED(STATS_RUNNING_THREADS);
 
-static char *parse_stat(pid_t pid, int field)
-{
-    char *fieldstr = NULL;
-    
-    char path[PATH_MAX + 1];
-    snprintf(path, PATH_MAX, "%s%d/stat", PROC, pid);
+    PROFILE_LOCKED(process);
 
-    FILE *fh = fopen(path, "r");
-    if (!fh) 
-        return NULL;
+    struct thread_table *table = &(process->tasks);
 
-    size_t n = 0;
-    char *line = NULL;
-    if (getline(&line, &n, fh) < 0)
-        goto close_fh;
+    int task_fd = prax_openat(process->proc_fd, TASK,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+        return -1;
 
-    char *delim = " ";
-    fieldstr = strtok(line, delim);
-    if (!fieldstr || field == 0)
-        goto free_line;
+    int thread_cnt = list_numeric_dir(task_fd, &(table->listing),
+                                      &(table->listing_cap));
+    close(task_fd);
 
-    // how expensive is strtok vs. say 1 scanf
-    for (int fieldno=0; fieldstr && fieldno < field; fieldno++)
-        fieldstr = strtok(NULL, delim);
+    if (thread_cnt < 0)
+        return -1;
 
-free_line:
-        free(line);
-close_fh:
-        fclose(fh);
+    for (int i=0; i < thread_cnt && i < MAX_THREADS; i++)
+        process->threads[i] = table->listing[i];
 
-    return strdup(fieldstr);
+    process->thread_count = thread_cnt;
+    return 0;
+}
+
+void tkill(profile_t *process, int tid)
+{
+    // tgkill also fails once tid left the thread group of the pid.
+    if (check_pid(process) == 0)
+        syscall(TGKILL, process->pid, tid, SIGTERM);
 }
 
 void getusernam(profile_t *process)
 {
-    struct passwd *username = getpwuid(process->uid);
-    process->username = username->pw_name;
+    PROFILE_LOCKED(process);
+
+    process->username = prax_username(process->uid);
 }
 
 void voluntary_context_switches(profile_t *process)
 {
-    if (process->uid == 0) {
-        TASK_REQ(process, nvcsw, offsetof(profile_t, vol_ctxt_swt), 
-                                                 sizeof(uint64_t));
+    PROFILE_LOCKED(process);
+
+    if (process->uid == 0 && profile_refresh_taskstats(process) == 0)
         return;
-    }
 
-    char *vswitch = parse_status_fields(process, "voluntary_ctxt_switches", 
-                                        isdigit);
-    if (vswitch) { 
-        process->vol_ctxt_swt = atol(vswitch);
-        free(vswitch);
-    } else
+    if (profile_refresh_status(process) < 0)
         process->vol_ctxt_swt = -1;
 }
 
 void involuntary_context_switches(profile_t *process)
 {
-    if (process->uid == 0) {
-        TASK_REQ(process, nivcsw, offsetof(profile_t, invol_ctxt_swt),
-                                                    sizeof(uint64_t));
+    PROFILE_LOCKED(process);
+
+    if (process->uid == 0 && profile_refresh_taskstats(process) == 0)
         return;
-    }
 
-    char *invol_switch = "nonvoluntary_ctxt_switches";
-    char *ivswitch = parse_status_fields(process, invol_switch, isdigit);
-    if (ivswitch) {
-        process->invol_ctxt_swt = atol(ivswitch);
-        free(ivswitch);
-    }
+    profile_refresh_status(process);
 }
 
 void get_start_time(profile_t *process)
 {
-    if (process->uid == 0) {
-        TASK_REQ(process, ac_btime, offsetof(profile_t, start_time),
-                                                  sizeof(uint32_t));
+    PROFILE_LOCKED(process);
+
+    if (process->uid == 0 && profile_refresh_taskstats(process) == 0)
         return;
-    }
 
-    // Magic number?
-    char *start = parse_stat(process->pid, 22);
-    process->start_time = strtol(start, NULL, 0);
+    profile_refresh_stat(process);
 }
 
 void virtual_mem(profile_t *process)
 {
-    if (process->uid == 0) {
-        TASK_REQ(process, virtmem, offsetof(profile_t, vmem), sizeof(uint64_t));
-        return;
-    }
+    PROFILE_LOCKED(process);
 
-    // local static?
-    char *virtual_memory = "VmSize";
-    char *total_memory = parse_status_fields(process, virtual_memory, isdigit);
-    if (total_memory) {
-        process->vmem = atol(total_memory);
-        free(total_memory);
-    }
+    profile_refresh_status(process);
+}
+
+void gettgid(profile_t *process)
+{
+    PROFILE_LOCKED(process);
+
+    profile_refresh_status(process);
 }
 
 profile_t *init_profile(int pid)
 {
-    profile_t *profile = calloc(sizeof *profile, 1);
+    return open_profile(pid, 0);
+}
+
+profile_t *open_profile(pid_t pid, int flags)
+{
+    STATS_TIMED(STATS_INIT_PROFILE);
+
+    profile_t *profile = prax_calloc(sizeof *profile, 1);
     if (!profile)
         return NULL;
 
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&(profile->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    profile->nl_conn = -1;
+    profile->nl_family_id = -1;
+    profile->proc_fd = -1;
+    profile->pidfd = -1;
+    for (int i=0; i < PROCFS_NHOT; i++)
+        profile->hot_fds[i] = -1;
+
     profile->pid = pid;
     if ((profile->procfs_len = snprintf(profile->procfs_base, PROCFS_MAX,
                                                  "/proc/%d/", pid)) < 0) {
         goto profile_error;
     } 
-        
-    if (!is_alive(profile))
-        goto profile_error;
- 
+
+    // ENOSYS before 5.3 and EINVAL for a thread that is not the group
+    // leader, the profile then only holds the pid.
+    if (!(flags & PROFILE_NO_PIDFD)) {
+        profile->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (profile->pidfd < 0 && errno != ENOSYS && errno != EINVAL)
+            goto profile_error;
+    }
+
     if ((profile->uid = geteuid()) < 0)
         goto profile_error;
 
-    profile->nl_conn = -1;
+    profile->proc_fd = prax_openat(AT_FDCWD, profile->procfs_base,
+                                   O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (profile->proc_fd < 0)
+        goto profile_error;
+
+    // The pid could have been reused between the two opens, a pidfd that
+    // is still live means both name the same process.
+    if (!is_alive(profile))
+        goto profile_error;
 
-    if (profile->uid == 0) {
+    if (profile->uid == 0 && !(flags & PROFILE_NO_NETLINK)) {
         profile->nl_conn = create_nl_conn();
-        profile->nl_family_id = get_nl_family_id(profile);
+        profile->nl_family_id = get_nl_family_id(profile->nl_conn);
     } 
 
-    profile->fd = NULL;
-
     return profile; 
 
 profile_error:
 
+    if (profile->proc_fd > -1)
+        close(profile->proc_fd);
+    if (profile->pidfd > -1)
+        close(profile->pidfd);
+    pthread_mutex_destroy(&(profile->lock));
     free(profile);
 
     return NULL;
 }
 
-void free_profile_fd(profile_t *process)
-{
-    fdstats_t *curr = NULL, *next = NULL;
-    
-    for (curr=process->fd; curr; curr=next) {
-        next = curr->next_fd;
-        free(curr->file);
-        free(curr);
-    }
-}
-
 void free_profile(profile_t *process)
 {
     if (!process)
@@ -786,8 +695,43 @@ void free_profile(profile_t *process)
     if (process->nl_conn > -1)
         close(process->nl_conn);
 
-    if (process->fd)
-        free_profile_fd(process);
+    for (int i=0; i < PROCFS_NHOT; i++) {
+        if (process->hot_fds[i] > -1)
+            close(process->hot_fds[i]);
+    }
+
+    if (process->proc_fd > -1)
+        close(process->proc_fd);
+
+    if (process->pidfd > -1)
+        close(process->pidfd);
 
+    free_profile_fd(process);
+    free_profile_threads(process);
+    free_profile_smaps(process);
+    cpu_mask_free(&(process->affinity));
+
+    pthread_mutex_destroy(&(process->lock));
     free(process);
 }
+
+int profile_send_signal(profile_t *process, int sig)
+{
+    if (process->pidfd > -1)
+        return syscall(SYS_pidfd_send_signal, process->pidfd, sig, NULL, 0);
+
+    if (check_pid(process) < 0)
+        return -1;
+
+    return kill(process->pid, sig);
+}
+
+void profile_lock(profile_t *process)
+{
+    pthread_mutex_lock(&(process->lock));
+}
+
+void profile_unlock(profile_t *process)
+{
+    pthread_mutex_unlock(&(process->lock));
+}
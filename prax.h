@@ -1,7 +1,9 @@
 #define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
+#include <sched.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/stat.h>
@@ -52,9 +54,6 @@ enum {
 
 #define IOPRIO_SIZE 6 
 
-const char *nice_class[4] = {"be/", "rt/", "rt/", "idle"};
-const char *prio_class[4] = {"", "rt/", "be/", "idle"};
-
 // Returns the I/O scheduling class and priority of profiled pid.
 __attribute__(( visibility("default") ))
 int get_ioprio(profile_t *process);
@@ -75,7 +74,7 @@ int set_ioprio(profile_t *process, int class, int value);
                                                       GENL_HDRLEN)
 #define NLA_DATA(nla) (void *) ((char *) nla + NLA_HDRLEN)
 
-#define MAX_MSG 256
+#define MAX_MSG 1024
 
 struct taskmsg {
     struct nlmsghdr nl;
@@ -83,17 +82,343 @@ struct taskmsg {
     char buffer[MAX_MSG];
 };
 
+/*
+ * Batched taskstats requests, keeping many pids in flight over one netlink
+ * socket and matching the replies back by nlmsg_seq.
+ */
+
+typedef struct taskstats_batch taskstats_batch_t;
+
+#define TASKSTATS_BATCH_WINDOW 256
+
+// Opens a netlink socket that keeps up to window requests in flight
+// (TASKSTATS_BATCH_WINDOW when 0).
+__attribute__(( visibility("default") ))
+taskstats_batch_t *init_taskstats_batch(size_t window);
+
+// Fetches the taskstats record of every pid into stats, errs (optional) is
+// set to 0 or to the errno the kernel answered with for that pid.  Returns
+// the number of records filled.
+__attribute__(( visibility("default") ))
+int taskstats_batch_get(taskstats_batch_t *batch, const pid_t *pids, 
+                        size_t npids, struct taskstats *stats, int *errs);
+
+// Free memory and the netlink socket used by a taskstats_batch_t type.
+__attribute__(( visibility("default") ))
+void free_taskstats_batch(taskstats_batch_t *batch);
+
+/*
+ * Exit listener, taskstats records pushed by the kernel for every task that
+ * exits on the registered cpus.
+ */
+
+typedef struct exit_listener exit_listener_t;
+
+struct exit_record {
+    // TASKSTATS_TYPE_AGGR_PID for a task, TASKSTATS_TYPE_AGGR_TGID for the
+    // totals of a thread group whose last thread exited.
+    int type;
+    pid_t pid;
+    struct taskstats stats;
+};
+
+typedef void (*exit_callback_t)(const struct exit_record *record, void *arg);
+
+#define EXIT_RING_SIZE 4096
+
+// Registers cpus (every cpu when NULL) split into groups of group_size cpus,
+// each group with its own socket and reader thread.  Records are handed to
+// callback from the reader threads or, when callback is NULL, queued in a
+// ring per group for exit_listener_read.
+__attribute__(( visibility("default") ))
+exit_listener_t *init_exit_listener(const cpu_set_t *cpus, size_t setsize,
+                                    int group_size, exit_callback_t callback,
+                                    void *arg);
+
+// Copies up to max queued records without blocking, from one consumer
+// thread only.
+__attribute__(( visibility("default") ))
+int exit_listener_read(exit_listener_t *listener, struct exit_record *records,
+                       int max);
+
+// Number of records lost to socket overruns or full rings.
+__attribute__(( visibility("default") ))
+uint64_t exit_listener_dropped(exit_listener_t *listener);
+
+// Deregisters the cpus, stops the reader threads and frees the listener.
+__attribute__(( visibility("default") ))
+void free_exit_listener(exit_listener_t *listener);
+
+/*
+ * System wide process scanner, /proc is listed once per sweep and the pids
+ * are split across a pool of workers filling one contiguous record array.
+ */
+
+#define SCAN_STAT   0x1
+#define SCAN_STATUS 0x2
+#define SCAN_IO     0x4
+#define SCAN_LIMITS 0x8
+
+struct proc_record {
+    pid_t pid;
+    pid_t ppid;
+    uid_t uid;
+    gid_t gid;
+    int nice;
+    int num_threads;
+    int processor;
+    // SCAN_* groups that were collected for this pid.
+    int fields;
+    char state;
+    char comm[16];
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t start_time;
+    uint64_t vsize;
+    uint64_t rss;
+    uint64_t vol_ctxt_swt;
+    uint64_t invol_ctxt_swt;
+    uint64_t read_char;
+    uint64_t write_char;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    // Indexed by RLIMIT_*.
+    struct rlimit rlimits[RLIM_NLIMITS];
+};
+
+typedef struct scanner scanner_t;
+
+// Starts a scanner with nworkers threads (one per online cpu when 0), the
+// calling thread counts as one of them.
+__attribute__(( visibility("default") ))
+scanner_t *init_scanner(int nworkers);
+
+// Switches the workers to io_uring, each queueing the openat, read and
+// close of the files of hundreds of pids per submission.  Returns -1 when
+// io_uring is unavailable, the scanner then stays synchronous.  Not to be
+// called during a sweep.
+__attribute__(( visibility("default") ))
+int scanner_enable_uring(scanner_t *scanner);
+
+// Collects the SCAN_* groups in field_mask for every process, *records is
+// pointed at storage owned by the scanner that is valid until the next
+// sweep.  Returns the number of records.
+__attribute__(( visibility("default") ))
+int scan_processes(scanner_t *scanner, int field_mask, 
+                   struct proc_record **records);
+
+// Stops the workers and frees memory used by a scanner_t type.
+__attribute__(( visibility("default") ))
+void free_scanner(scanner_t *scanner);
+
+/*
+ * Process lifecycle events from the netlink proc connector, queued for a
+ * consumer and folded into a set of live processes kept up to date without
+ * rescanning /proc.
+ */
+
+typedef struct proc_events proc_events_t;
+
+// Same values as the PROC_EVENT_* constants of linux/cn_proc.h.  A
+// LIFECYCLE_RESYNC event is queued after the socket overran, events were
+// lost and the live set was rebuilt from /proc.
+#define LIFECYCLE_RESYNC 0x0
+#define LIFECYCLE_FORK   0x1
+#define LIFECYCLE_EXEC   0x2
+#define LIFECYCLE_UID    0x4
+#define LIFECYCLE_COMM   0x200
+#define LIFECYCLE_EXIT   0x80000000
+
+struct lifecycle_event {
+    uint32_t what;
+    int cpu;
+    uint64_t timestamp_ns;
+    pid_t pid;
+    pid_t tgid;
+    union {
+        struct {
+            pid_t parent_pid;
+            pid_t parent_tgid;
+        } fork;
+        struct {
+            uid_t ruid;
+            uid_t euid;
+        } uid;
+        struct {
+            uint32_t exit_code;
+            uint32_t exit_signal;
+        } exit;
+        char comm[16];
+    };
+};
+
+// Subscribes to the proc connector (root only) with a queue of queue_size
+// events (65536 when 0) and seeds the live set from /proc.
+__attribute__(( visibility("default") ))
+proc_events_t *init_proc_events(size_t queue_size);
+
+// Copies up to max queued events without blocking, from one consumer
+// thread only.
+__attribute__(( visibility("default") ))
+int proc_events_read(proc_events_t *events, struct lifecycle_event *out,
+                     int max);
+
+// Checks the live set for pid, lock free and safe from any thread.
+__attribute__(( visibility("default") ))
+bool proc_events_alive(proc_events_t *events, pid_t pid);
+
+// Number of processes in the live set.
+__attribute__(( visibility("default") ))
+size_t proc_events_count(proc_events_t *events);
+
+// Copies up to max pids of the live set into pids in ascending order.
+__attribute__(( visibility("default") ))
+int proc_events_pids(proc_events_t *events, pid_t *pids, size_t max);
+
+// Number of events lost to a full queue.
+__attribute__(( visibility("default") ))
+uint64_t proc_events_dropped(proc_events_t *events);
+
+// Number of times the live set was rebuilt after the socket overran.
+__attribute__(( visibility("default") ))
+uint64_t proc_events_resyncs(proc_events_t *events);
+
+// Unsubscribes, stops the reader thread and frees the proc_events_t type.
+__attribute__(( visibility("default") ))
+void free_proc_events(proc_events_t *events);
+
+/*
+ * Exit notification for many processes at once, one pidfd per pid in a
+ * single epoll set.  Each watched pid holds a descriptor, RLIMIT_NOFILE
+ * bounds how many can be watched.
+ */
+
+typedef struct exit_watch exit_watch_t;
+
+__attribute__(( visibility("default") ))
+exit_watch_t *init_exit_watch(void);
+
+// Starts watching pid, the pid is resolved to its process right away.
+__attribute__(( visibility("default") ))
+int exit_watch_add(exit_watch_t *watch, pid_t pid);
+
+// Watches the process of a profile through a duplicate of its pidfd, with
+// no window for the pid to be reused.
+__attribute__(( visibility("default") ))
+int exit_watch_add_profile(exit_watch_t *watch, profile_t *process);
+
+__attribute__(( visibility("default") ))
+int exit_watch_remove(exit_watch_t *watch, pid_t pid);
+
+// Waits up to timeout_ms (-1 for ever) and copies up to max pids that
+// exited, they are no longer watched.  Returns the number copied.
+__attribute__(( visibility("default") ))
+int exit_watch_wait(exit_watch_t *watch, pid_t *pids, int max,
+                    int timeout_ms);
+
+// Descriptor that polls readable while exits are pending, for an outside
+// event loop.
+__attribute__(( visibility("default") ))
+int exit_watch_fd(exit_watch_t *watch);
+
+// Number of pids watched.
+__attribute__(( visibility("default") ))
+size_t exit_watch_count(exit_watch_t *watch);
+
+// Closes every pidfd and frees the exit_watch_t type.
+__attribute__(( visibility("default") ))
+void free_exit_watch(exit_watch_t *watch);
+
+/*
+ * Bulk control of a set of processes given as a pid list, a process group,
+ * a session or a cgroup.  Each pid is held through a pidfd while it is
+ * changed, and large sets are split across worker threads.
+ */
+
+#define PROC_SET_PIDS    0
+#define PROC_SET_PGRP    1
+#define PROC_SET_SESSION 2
+#define PROC_SET_CGROUP  3
+
+struct proc_set {
+    int type;
+    // PROC_SET_PIDS.
+    const pid_t *pids;
+    size_t npids;
+    // Process group or session id.
+    pid_t id;
+    // cgroup v2 directory, relative paths start at /sys/fs/cgroup.
+    const char *cgroup;
+};
+
+// Changes every thread of each process rather than only the one whose tid
+// is the pid, nice, ioprio and affinity being per thread.  rlimits are per
+// process and ignore it.
+#define CONTROL_THREADS 0x1
+
+// Set sizes above which a change fans out to the workers.
+#define CONTROL_FANOUT 64
+
+struct control_result {
+    pid_t pid;
+    // 0, or the errno the change failed with for this pid.
+    int err;
+};
+
+typedef struct control control_t;
+
+// nworkers threads apply the changes (one per online cpu when 0), the
+// calling thread counts as one of them.
+__attribute__(( visibility("default") ))
+control_t *init_control(int nworkers);
+
+// Each change below returns the number of results, *results being pointed
+// at storage owned by control that is valid until the next change.  A pid
+// list gets a result for every entry, EINVAL for pids below 1, a process
+// group or session one for its members only.  -1 is returned when the set
+// could not be resolved.  Nothing is read back.
+__attribute__(( visibility("default") ))
+int control_nice(control_t *control, const struct proc_set *set, int nice,
+                 int flags, struct control_result **results);
+
+__attribute__(( visibility("default") ))
+int control_ioprio(control_t *control, const struct proc_set *set,
+                   int class, int value, int flags,
+                   struct control_result **results);
+
+__attribute__(( visibility("default") ))
+int control_affinity(control_t *control, const struct proc_set *set,
+                     const cpu_set_t *cpus, size_t setsize, int flags,
+                     struct control_result **results);
+
+__attribute__(( visibility("default") ))
+int control_rlimit(control_t *control, const struct proc_set *set,
+                   int resource, const struct rlimit *limit,
+                   struct control_result **results);
+
+// Frees memory used by a control_t type.
+__attribute__(( visibility("default") ))
+void free_control(control_t *control);
+
 /*
  * Procfs macros for path resolution and buffer sizing.
  */
 
-#define STATUS_SIZE 1024
-#define MAX_FIELD 32
+#define STATUS_SIZE 8192
+#define STAT_SIZE 2048
 
 #define PROC "/proc/"
 #define PROCLEN 6
 #define YAMA "/proc/sys/kernel/yama/ptrace_scope"
 #define STATUS "status"
+#define STAT "stat"
+#define STATM "statm"
+#define SMAPS "smaps"
+#define SMAPS_ROLLUP "smaps_rollup"
+#define NUMA_MAPS "numa_maps"
+#define IO "io"
+#define SCHEDSTAT "schedstat"
+#define LIMITS "limits"
 #define COMM "comm"
 #define TASK "task"
 #define FD "fd/"
@@ -101,9 +426,63 @@ struct taskmsg {
 
 /*
  * Functions and typedef structures for retrieving and containing 
- * the process' file-descriptor data
+ * the process' file-descriptor data.  The descriptors are kept in one array
+ * and their paths in one slab, both owned by the profile and reused from one
+ * refresh to the next.
  */
 
+enum fd_type {
+    FD_TYPE_UNKNOWN,
+    FD_TYPE_FILE,
+    FD_TYPE_DIR,
+    FD_TYPE_CHAR,
+    FD_TYPE_BLOCK,
+    FD_TYPE_PIPE,
+    FD_TYPE_SOCKET,
+    FD_TYPE_LINK,
+    // anon_inode descriptors, eventfd, epoll, timerfd, ...
+    FD_TYPE_ANON
+};
+
+struct fd_entry {
+    int fd;
+    int type;
+    mode_t mode;
+    dev_t dev;
+    ino_t ino;
+    // Offset of the nul terminated path in fd_table.paths.
+    uint32_t path_off;
+};
+
+#define FD_ADDED   0x1
+#define FD_REMOVED 0x2
+// The fd number was closed and reused for another file between refreshes.
+#define FD_CHANGED 0x4
+
+struct fd_delta {
+    int fd;
+    int change;
+};
+
+struct fd_table {
+    struct fd_entry *entries;
+    size_t count;
+    size_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    // Changes found by the last process_fd_refresh.
+    struct fd_delta *changes;
+    size_t nchanges;
+    size_t changes_cap;
+    struct fd_entry *spare_entries;
+    size_t spare_cap;
+    char *spare_paths;
+    size_t spare_paths_cap;
+    pid_t *listing;
+    size_t listing_cap;
+};
+
 typedef struct fdstats fdstats_t;
 
 struct fdstats {
@@ -113,10 +492,30 @@ struct fdstats {
 };
 
 // A function that traverses the "fd" directory of the pid from process
-// and loads a fdstat_t struct with stats for each file-descriptor found.
+// and loads the fd table of the profile with each file-descriptor found.
 __attribute__(( visibility("default") ))
 int process_fd_stats(profile_t *process);
 
+// Trust descriptors whose number is still open to be unchanged instead of
+// checking their dev/ino with one fstatat each.
+#define FD_REFRESH_TRUST 0x1
+
+// Diffs the "fd" directory against the fd table by fd number and only
+// resolves descriptors that are new or were reused, the changes are left
+// in fds.changes.  Returns the number of changes.
+__attribute__(( visibility("default") ))
+int process_fd_refresh(profile_t *process, int flags);
+
+// Returns the path the descriptor of entry points at.
+__attribute__(( visibility("default") ))
+const char *fd_entry_path(profile_t *process, const struct fd_entry *entry);
+
+// Iterates the fd table in the older fdstats_t form, *cursor starts at 0.
+// file points into the table and only st_dev, st_ino and st_mode of
+// file_stats are set.  Returns 0 once past the last descriptor.
+__attribute__(( visibility("default") ))
+int fd_stats_next(profile_t *process, size_t *cursor, fdstats_t *fdstats);
+
 // Free memory used by a profile_t type file descriptors field.
 __attribute__(( visibility("default") ))
 void free_profile_fd(profile_t *process);
@@ -143,44 +542,6 @@ void free_profile_fd(profile_t *process);
 #define LIMIT_RTPRIO     0x4000
 #define LIMIT_RTTIME     0x8000
 
-const int prlimits[] = {
-    LIMIT_CPU,
-    LIMIT_FSIZE,
-    LIMIT_DATA,
-    LIMIT_STACK,
-    LIMIT_CORE,
-    LIMIT_RSS,
-    LIMIT_NOFILE,
-    LIMIT_AS,
-    LIMIT_NPROC,
-    LIMIT_MEMLOCK,
-    LIMIT_LOCKS,
-    LIMIT_SIGPENDING,
-    LIMIT_MSGQUEUE,
-    LIMIT_NICE,
-    LIMIT_RTPRIO,
-    LIMIT_RTTIME
-};
-
-int prlimit_values[] = {
-    RLIMIT_CPU,
-    RLIMIT_FSIZE,
-    RLIMIT_DATA,
-    RLIMIT_STACK,
-    RLIMIT_CORE,
-    RLIMIT_RSS,
-    RLIMIT_NOFILE,
-    RLIMIT_AS,
-    RLIMIT_NPROC,
-    RLIMIT_MEMLOCK,
-    RLIMIT_LOCKS,
-    RLIMIT_SIGPENDING,
-    RLIMIT_MSGQUEUE,
-    RLIMIT_NICE,
-    RLIMIT_RTPRIO,
-    RLIMIT_RTTIME
-};
-
 #define NLIMITS 16
 
 struct proc_rlim {
@@ -224,6 +585,8 @@ int set_soft_rlimit(profile_t *process, int resource, unsigned long limit);
 __attribute__(( visibility("default") ))
 int set_hard_rlimit(profile_t *process, int resource, unsigned long limit);
 
+// Fills the LIMIT_* resources of resource_mask into 'rlimits' and 'prlim',
+// with one prlimit each for a few resources or one read of limits.
 __attribute__(( visibility("default") ))
 int get_rlimits(profile_t *process, int resource_mask);
 
@@ -238,18 +601,272 @@ struct proc_signal {
     long signals_blocked;
     long signals_ignored;
     long signals_caught;
+    long signal_queue_limit;
 };
 
 // Gets the number of pending signals for the process
 __attribute__(( visibility("default") ))
 int get_signals(profile_t *process);
 
+/*
+ * Delay accounting totals (nanoseconds) and I/O counters taken from the
+ * taskstats record of the process.
+ */
+
+struct proc_delay {
+    uint64_t cpu_total;
+    uint64_t blkio_total;
+    uint64_t swapin_total;
+    uint64_t freepages_total;
+    uint64_t thrashing_total;
+};
+
+struct proc_io {
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t cancelled_write_bytes;
+    uint64_t read_char;
+    uint64_t write_char;
+};
+
+/*
+ * Memory accounting.  statm is the cheap tier, in bytes.  The smaps figures
+ * are in kB as the kernel prints them, uss is private_clean + private_dirty
+ * and file is rss - anonymous.  pss_anon, pss_file and pss_shmem are only
+ * printed by smaps_rollup (5.7 on), they stay zero when summed from smaps.
+ */
+
+struct proc_statm {
+    uint64_t size;
+    uint64_t resident;
+    uint64_t shared;
+    uint64_t text;
+    uint64_t data;
+};
+
+struct proc_mem {
+    uint64_t size;
+    uint64_t rss;
+    uint64_t pss;
+    uint64_t pss_anon;
+    uint64_t pss_file;
+    uint64_t pss_shmem;
+    uint64_t shared_clean;
+    uint64_t shared_dirty;
+    uint64_t private_clean;
+    uint64_t private_dirty;
+    uint64_t uss;
+    uint64_t referenced;
+    uint64_t anonymous;
+    uint64_t file;
+    uint64_t swap;
+    uint64_t swap_pss;
+    uint64_t locked;
+};
+
+struct smaps_entry {
+    // Range, offset and perms of the first mapping folded in.
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    dev_t dev;
+    ino_t ino;
+    char perms[5];
+    // Mappings summed into this entry, 1 unless SMAPS_BY_FILE.
+    uint32_t nmappings;
+    // Offset of the nul terminated path in smaps_table.paths, empty for
+    // anonymous mappings.
+    uint32_t path_off;
+    struct proc_mem mem;
+};
+
+struct smaps_table {
+    struct smaps_entry *entries;
+    size_t count;
+    size_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    // Open addressed entry indexes + 1 by path, for SMAPS_BY_FILE.
+    uint32_t *buckets;
+    size_t nbuckets;
+};
+
+// Resident memory on one NUMA node, in kB.
+struct numa_node_mem {
+    uint64_t anon;
+    uint64_t file;
+    // hugetlbfs pages, counted apart from anon and file.
+    uint64_t huge;
+};
+
+struct numa_mem {
+    // Indexed by node, up to the highest node memory was seen on.
+    struct numa_node_mem *nodes;
+    size_t nnodes;
+    size_t cap;
+    uint64_t total;
+    // On the nodes holding cpus of the process' affinity.
+    uint64_t local;
+    // local / total, 1 with nothing resident.
+    double locality;
+    // Cpus of each node, read once from sysfs, unread while set is NULL.
+    struct cpu_mask *node_cpus;
+    size_t nnode_cpus;
+    size_t node_cpus_cap;
+};
+
+/*
+ * Per-thread stats, one entry per task in /proc/<pid>/task.  The table is
+ * owned by the profile and grows with the thread count.
+ */
+
+struct thread_stat {
+    pid_t tid;
+    char state;
+    int last_cpu;
+    char comm[16];
+    // Clock ticks, from stat.
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+    // Nanoseconds on a cpu and waiting on a run queue, from schedstat.
+    uint64_t run_time;
+    uint64_t run_delay;
+    uint64_t timeslices;
+};
+
+// A cpu_set_t sized for every possible cpu rather than CPU_SETSIZE, for the
+// CPU_*_S macros.
+struct cpu_mask {
+    cpu_set_t *set;
+    size_t size;
+};
+
+struct thread_table {
+    struct thread_stat *threads;
+    size_t count;
+    size_t cap;
+    pid_t *listing;
+    size_t listing_cap;
+};
+
+/*
+ * Every field of /proc/<pid>/stat, in line order, see proc(5).  Fields the
+ * running kernel does not print are left zero.
+ */
+
+struct proc_stat {
+    pid_t pid;
+    char comm[64];
+    char state;
+    pid_t ppid;
+    pid_t pgrp;
+    pid_t session;
+    int32_t tty_nr;
+    pid_t tpgid;
+    uint32_t flags;
+    uint64_t minflt;
+    uint64_t cminflt;
+    uint64_t majflt;
+    uint64_t cmajflt;
+    uint64_t utime;
+    uint64_t stime;
+    int64_t cutime;
+    int64_t cstime;
+    int64_t priority;
+    int64_t nice;
+    int64_t num_threads;
+    int64_t itrealvalue;
+    uint64_t starttime;
+    uint64_t vsize;
+    int64_t rss;
+    uint64_t rsslim;
+    uint64_t startcode;
+    uint64_t endcode;
+    uint64_t startstack;
+    uint64_t kstkesp;
+    uint64_t kstkeip;
+    uint64_t signal;
+    uint64_t blocked;
+    uint64_t sigignore;
+    uint64_t sigcatch;
+    uint64_t wchan;
+    uint64_t nswap;
+    uint64_t cnswap;
+    int32_t exit_signal;
+    int32_t processor;
+    uint32_t rt_priority;
+    uint32_t policy;
+    uint64_t delayacct_blkio_ticks;
+    uint64_t guest_time;
+    int64_t cguest_time;
+    uint64_t start_data;
+    uint64_t end_data;
+    uint64_t start_brk;
+    uint64_t arg_start;
+    uint64_t arg_end;
+    uint64_t env_start;
+    uint64_t env_end;
+    int32_t exit_code;
+};
+
+/*
+ * Time spent on a cpu and waiting on a run queue in nanoseconds, and the
+ * number of timeslices run, from /proc/<pid>/schedstat.
+ */
+
+struct proc_sched {
+    uint64_t run_time;
+    uint64_t run_delay;
+    uint64_t timeslices;
+};
+
+/*
+ * Real, effective, saved and filesystem ids of the process, in the order
+ * they are listed in the "Uid:" and "Gid:" lines of /proc/<pid>/status.
+ */
+
+struct proc_cred {
+    uid_t ruid;
+    uid_t euid;
+    uid_t suid;
+    uid_t fsuid;
+    gid_t rgid;
+    gid_t egid;
+    gid_t sgid;
+    gid_t fsgid;
+};
+
 /*
  * The main data structure that contains all other subsequent data from the 
  * profile of the process.
+ *
+ * Concurrency: profiles share no state, so different pids can be profiled
+ * from any number of threads.  Every accessor holds the lock of its profile
+ * while it runs, one profile can be refreshed from several threads at once
+ * and the calls are serialized.  Reading fields, the fd, thread or smaps
+ * tables while another thread may refresh them needs profile_lock held.
+ * The other handles (scanner_t, sampler_t, taskstats_batch_t, ...) are
+ * driven by one thread at a time unless their functions say otherwise.
  */
 
 #define PROCFS_MAX 32
+#define MAX_THREADS 256
+
+// Files of /proc/<pid> that are kept open by the profile and re-read with
+// pread, indexes into hot_fds.
+enum procfs_hot {
+    PROCFS_STAT,
+    PROCFS_STATUS,
+    PROCFS_STATM,
+    PROCFS_IO,
+    PROCFS_SCHEDSTAT,
+    PROCFS_SMAPS_ROLLUP,
+    PROCFS_LIMITS,
+    PROCFS_NHOT
+};
 
 
 struct profile {
@@ -257,14 +874,32 @@ struct profile {
     uint64_t vol_ctxt_swt;
     uint64_t invol_ctxt_swt;
     uint64_t vmem;
+    uint64_t vm_rss;
+    uint64_t vm_peak;
+    uint64_t virtmem;
+    uint64_t coremem;
+    uint64_t utime;
+    uint64_t stime;
     char procfs_base[PROCFS_MAX + 1];
     size_t procfs_len;
     char name[32];
-    char *username;
+    const char *username;
     char ioprio[16];
     struct proc_rlim prlim;
+    // Indexed by RLIMIT_*, RLIM_INFINITY when unlimited.
+    struct rlimit rlimits[RLIM_NLIMITS];
     struct proc_signal psig;
-    fdstats_t *fd;
+    struct proc_cred cred;
+    struct proc_delay delay;
+    struct proc_io io;
+    struct proc_sched sched;
+    struct proc_statm statm;
+    struct proc_mem mem;
+    struct smaps_table maps;
+    struct numa_mem numa;
+    struct taskstats tstats;
+    struct proc_stat stat;
+    struct fd_table fds;
     pid_t trace_pid;
     pid_t pid;
     uid_t uid;
@@ -275,29 +910,112 @@ struct profile {
     int nl_conn;
     // a low here?
     int nl_family_id;
+    // O_PATH descriptor of /proc/<pid>, every file is opened relative to
+    // it so a recycled pid is never read by mistake.
+    int proc_fd;
+    // pidfd of the process, -1 where pidfds are unsupported.
+    int pidfd;
+    // Opened on first use, -1 until then.
+    int hot_fds[PROCFS_NHOT];
     int thread_count;
-    int threads[256];
+    int threads[MAX_THREADS];
+    struct thread_table tasks;
     // bitfield
     int nice;
     int nice_err;
     pid_t sid;
-    int cpu_affinity:30;
-    int yama_enabled:1;
-    int is_traced:1;
+    // Cpus in 'affinity', -1 when it could not be read.
+    int cpu_affinity;
+    struct cpu_mask affinity;
+    unsigned int yama_enabled:1;
+    unsigned int is_traced:1;
+    pthread_mutex_t lock;
 };
 
 // Initializer for the profile_t type.
 __attribute__(( visibility("default") ))
 profile_t *init_profile(int pid);
 
+// Takes the (recursive) lock every accessor of process holds, for reading a
+// consistent set of fields.
+__attribute__(( visibility("default") ))
+void profile_lock(profile_t *process);
+
+__attribute__(( visibility("default") ))
+void profile_unlock(profile_t *process);
+
+// Reads /proc/<pid>/status once and fills every status derived field.
+__attribute__(( visibility("default") ))
+int profile_refresh_status(profile_t *process);
+
+// Re-reads /proc/<pid>/stat through the cached descriptor into 'stat'.
+__attribute__(( visibility("default") ))
+int profile_refresh_stat(profile_t *process);
+
+// Reads /proc/<pid>/io into 'io', ptrace access to the process is needed.
+__attribute__(( visibility("default") ))
+int profile_refresh_io(profile_t *process);
+
+// Reads every limit from one parse of /proc/<pid>/limits into 'rlimits'.
+__attribute__(( visibility("default") ))
+int profile_refresh_limits(profile_t *process);
+
+// Reads /proc/<pid>/schedstat into 'sched'.
+__attribute__(( visibility("default") ))
+int profile_refresh_schedstat(profile_t *process);
+
+// Reads /proc/<pid>/statm into 'statm'.
+__attribute__(( visibility("default") ))
+int profile_refresh_statm(profile_t *process);
+
+// Reads /proc/<pid>/smaps_rollup into 'mem', summing the whole of smaps on
+// kernels without it.  ptrace access to the process is needed.
+__attribute__(( visibility("default") ))
+int profile_refresh_memory(profile_t *process);
+
+// Fold every mapping of the same path (anonymous ones all together) into
+// one entry.
+#define SMAPS_BY_FILE 0x1
+
+// Streams /proc/<pid>/smaps through a fixed buffer into the 'maps' table,
+// one entry per mapping or per path with SMAPS_BY_FILE, and leaves the
+// totals in 'mem'.  Returns the number of entries.
+__attribute__(( visibility("default") ))
+int process_smaps(profile_t *process, int flags);
+
+// Returns the path of the mapping(s) of entry.
+__attribute__(( visibility("default") ))
+const char *smaps_entry_path(profile_t *process,
+                             const struct smaps_entry *entry);
+
+// Streams /proc/<pid>/numa_maps through a fixed buffer, summing the pages
+// of every node into 'numa' and weighing them against 'affinity', which is
+// refreshed along.
+__attribute__(( visibility("default") ))
+int profile_refresh_numa(profile_t *process);
+
+// Free memory used by a profile_t type smaps and numa tables.
+__attribute__(( visibility("default") ))
+void free_profile_smaps(profile_t *process);
+
+// Fetches the taskstats record of the pid with a single netlink request
+// (root only) and fills every taskstats derived field.
+__attribute__(( visibility("default") ))
+int profile_refresh_taskstats(profile_t *process);
+
 // Free memory used by a profile_t type.
 __attribute__(( visibility("default") ))
 void free_profile(profile_t *process);
 
-// Check if process exists.
+// Check if process exists, polling its pidfd so a reused pid is never
+// mistaken for it.
 __attribute__(( visibility("default") ))
 bool is_alive(profile_t *process);
 
+// Sends sig with pidfd_send_signal, kill where pidfds are unsupported.
+__attribute__(( visibility("default") ))
+int profile_send_signal(profile_t *process, int sig);
+
 // Count digit places in type int of the process being profiled.
 __attribute__(( visibility("default") ))
 int pid_digit_places(int pid);
@@ -318,17 +1036,89 @@ int pid_name(profile_t *process);
 __attribute__(( visibility("default") ))
 void cpu_affinity(profile_t *process);
 
+// Pins pid to cpus 0 up to affinity - 1.
 __attribute__(( visibility("default") ))
 void setcpu_affinity(profile_t *process, int affinity);
 
+/*
+ * Cpu masks of any size and the NUMA node and last level cache topology
+ * from /sys/devices/system (affinity.c).
+ */
+
+// Pins every thread of the task directory instead of the pid alone.
+#define AFFINITY_THREADS 0x1
+
+// Allocates an empty mask with room for every possible cpu.
+__attribute__(( visibility("default") ))
+int cpu_mask_alloc(struct cpu_mask *mask);
+
+__attribute__(( visibility("default") ))
+void cpu_mask_free(struct cpu_mask *mask);
+
+// Sets mask (allocated when its set is NULL) to the cpus of a "0-3,8,10-11"
+// list.  Returns the number of cpus set.
+__attribute__(( visibility("default") ))
+int cpu_mask_parse(struct cpu_mask *mask, const char *list);
+
+// Sets mask to the cpus of a NUMA node.  Returns the number of cpus set,
+// 0 for a node with memory only.
+__attribute__(( visibility("default") ))
+int node_cpu_mask(int node, struct cpu_mask *mask);
+
+// Sets mask to the cpus sharing the last level cache of cpu.  Returns the
+// number of cpus set.
+__attribute__(( visibility("default") ))
+int llc_cpu_mask(int cpu, struct cpu_mask *mask);
+
+// Highest online NUMA node, 0 without NUMA support.
+__attribute__(( visibility("default") ))
+int max_numa_node(void);
+
+// Reads the affinity of tid (the pid when 0) into mask.  Returns the number
+// of cpus in it.
+__attribute__(( visibility("default") ))
+int get_cpu_mask(profile_t *process, pid_t tid, struct cpu_mask *mask);
+
+// Reads the affinity of pid into 'affinity' and its count into
+// 'cpu_affinity'.
+__attribute__(( visibility("default") ))
+int profile_refresh_affinity(profile_t *process);
+
+// Pins pid, or every thread with AFFINITY_THREADS, to mask and refreshes
+// 'affinity'.
+__attribute__(( visibility("default") ))
+int set_cpu_mask(profile_t *process, const struct cpu_mask *mask, int flags);
+
+// Pins to the cpus of a NUMA node.
+__attribute__(( visibility("default") ))
+int bind_numa_node(profile_t *process, int node, int flags);
+
+// Pins to the cpus sharing the last level cache of cpu.
+__attribute__(( visibility("default") ))
+int bind_llc(profile_t *process, int cpu, int flags);
+
 // sets the session id field in profile_t struct
 __attribute__(( visibility("default") ))
 void process_sid(profile_t *process);
 
-// populates the 'threads' array in process struct if any threads are running.
+// populates the 'threads' array in process struct if any threads are running,
+// 'thread_count' holds the full count when there are more than MAX_THREADS.
 __attribute__(( visibility("default") ))
 int running_threads(profile_t *process);
 
+// Thread counts above which process_thread_stats fans out to workers.
+#define THREAD_FANOUT 512
+
+// Fills the 'tasks' table with the stat, status and schedstat of every
+// thread.  Large thread counts are split across nworkers threads (one per
+// online cpu when 0).
+__attribute__(( visibility("default") ))
+int process_thread_stats(profile_t *process, int nworkers);
+
+// Free memory used by a profile_t type thread table.
+__attribute__(( visibility("default") ))
+void free_profile_threads(profile_t *process);
+
 // kills a thread under the current processes group with the provided id.
 __attribute__(( visibility("default") ))
 void tkill(profile_t *process, int tid);
@@ -345,6 +1135,17 @@ void getpuid(profile_t *process);
 __attribute__(( visibility("default") ))
 void getusernam(profile_t *process);
 
+// Name of uid from a process wide cache, NULL when uid has no passwd entry.
+// The string is interned and stays valid for the life of the process.
+// Entries are looked up again once /etc/passwd changes or their ttl ran out.
+// Safe from any thread.
+__attribute__(( visibility("default") ))
+const char *prax_username(uid_t uid);
+
+// Sets the ttl of cached names, 60 seconds when 0.
+__attribute__(( visibility("default") ))
+void prax_username_ttl(uint64_t ttl_ns);
+
 // will find the number voluntary context switches for a process.
 __attribute__(( visibility("default") ))
 void voluntary_context_switches(profile_t *process);
@@ -374,3 +1175,196 @@ __attribute__(( visibility("default") ))
 void get_start_time(profile_t *process);
 
 
+
+/*
+ * Periodic sampler, registered pids are collected on a timerfd schedule by
+ * a small pool of threads into per-pid rings that are read lock free.
+ */
+
+#define SAMPLE_STAT      0x1
+#define SAMPLE_STATUS    0x2
+#define SAMPLE_IO        0x4
+#define SAMPLE_SCHEDSTAT 0x8
+
+// Slots per pid, a power of two.
+#define SAMPLE_RING_SIZE 128
+
+struct sample {
+    // CLOCK_MONOTONIC nanoseconds at collection.
+    uint64_t timestamp;
+    pid_t pid;
+    // SAMPLE_* groups that were collected.
+    int fields;
+    char state;
+    int processor;
+    int64_t num_threads;
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t vsize;
+    int64_t rss;
+    uint64_t vm_rss;
+    uint64_t vol_ctxt_swt;
+    uint64_t invol_ctxt_swt;
+    uint64_t read_char;
+    uint64_t write_char;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t run_time;
+    uint64_t run_delay;
+    uint64_t timeslices;
+};
+
+typedef struct sampler sampler_t;
+
+// Starts nworkers collector threads (1 when 0) ticking every tick_ns.
+__attribute__(( visibility("default") ))
+sampler_t *init_sampler(uint64_t tick_ns, int nworkers);
+
+// Samples the SAMPLE_* groups in field_mask of pid every interval_ns,
+// rounded up to whole ticks (every tick when 0).
+__attribute__(( visibility("default") ))
+int sampler_add(sampler_t *sampler, pid_t pid, int field_mask,
+                uint64_t interval_ns);
+
+// Stops sampling pid and frees its ring.
+__attribute__(( visibility("default") ))
+int sampler_remove(sampler_t *sampler, pid_t pid);
+
+// Copies up to max of the latest samples of pid, newest first, without
+// blocking the collectors.  Samples of an exited pid stay readable until
+// it is removed.  Returns the number copied or -1 for an unknown pid.
+__attribute__(( visibility("default") ))
+int sampler_latest(sampler_t *sampler, pid_t pid, struct sample *samples,
+                   int max);
+
+// Number of ticks the collectors fell behind on.
+__attribute__(( visibility("default") ))
+uint64_t sampler_overruns(sampler_t *sampler);
+
+// Also publishes the latest sample of up to nslots pids into
+// /dev/shm/<name>, laid out as described in prax_shm.h, for readers in
+// other processes.  The region is created mode 0600 (fchmod it through
+// /dev/shm to share it wider) and fails with EEXIST when the name is
+// taken.  It is unlinked by free_sampler.
+__attribute__(( visibility("default") ))
+int sampler_publish(sampler_t *sampler, const char *name, uint32_t nslots);
+
+// Stops the collectors and frees every ring.
+__attribute__(( visibility("default") ))
+void free_sampler(sampler_t *sampler);
+
+/*
+ * Recording of sampled fields into a compact file of columnar blocks that
+ * is replayed by time range, see record.c for the format.
+ */
+
+struct record_point {
+    // Any clock, nanoseconds.
+    uint64_t timestamp;
+    pid_t pid;
+    // Counters, delta encoded.
+    uint64_t vol_ctxt_swt;
+    uint64_t invol_ctxt_swt;
+    // Clock ticks, sysconf(_SC_CLK_TCK) per second.
+    uint64_t utime;
+    uint64_t stime;
+    // Gauges, zig-zag encoded.
+    uint64_t vmem;
+    uint64_t vm_rss;
+    uint64_t fd_count;
+    uint64_t thread_count;
+};
+
+// Points buffered per block when 0 is passed to init_recorder.
+#define RECORD_BLOCK_POINTS 16384
+
+typedef struct recorder recorder_t;
+typedef struct replay replay_t;
+
+// Opens path for recording, creating it or appending to an earlier
+// recording.  Blocks hold up to block_points points.
+__attribute__(( visibility("default") ))
+recorder_t *init_recorder(const char *path, size_t block_points);
+
+__attribute__(( visibility("default") ))
+int recorder_append(recorder_t *recorder, const struct record_point *point);
+
+// Appends the profile fields as they were last refreshed, cpu times from
+// 'stat' (profile_refresh_stat) and the rest from profile_refresh_status.
+__attribute__(( visibility("default") ))
+int recorder_append_profile(recorder_t *recorder, profile_t *process,
+                            uint64_t timestamp);
+
+// Writes out the buffered points as a block.
+__attribute__(( visibility("default") ))
+int recorder_flush(recorder_t *recorder);
+
+// Flushes, writes the block index and closes the recording.
+__attribute__(( visibility("default") ))
+int free_recorder(recorder_t *recorder);
+
+// Maps a recording and reads its block index, rebuilding it from the
+// blocks when the recording was not closed.
+__attribute__(( visibility("default") ))
+replay_t *init_replay(const char *path);
+
+// Decodes the points with from <= timestamp <= to, only the blocks whose
+// time span overlaps are touched.  *points is pointed at storage owned by
+// the replay, ordered by block then pid then time, valid until the next
+// call.  Returns the number of points.
+__attribute__(( visibility("default") ))
+ssize_t replay_range(replay_t *replay, uint64_t from, uint64_t to,
+                     struct record_point **points);
+
+__attribute__(( visibility("default") ))
+void free_replay(replay_t *replay);
+
+/*
+ * Library instrumentation.  Every thread counts into its own copy, the
+ * copies are summed by prax_get_stats so the accessors never take a lock.
+ */
+
+enum prax_accessor {
+    STATS_INIT_PROFILE,
+    STATS_REFRESH_STAT,
+    STATS_REFRESH_STATUS,
+    STATS_REFRESH_IO,
+    STATS_REFRESH_SCHEDSTAT,
+    STATS_REFRESH_TASKSTATS,
+    STATS_TASKSTATS_BATCH,
+    STATS_PID_NAME,
+    STATS_RLIMITS,
+    STATS_RUNNING_THREADS,
+    STATS_THREAD_STATS,
+    STATS_FD_STATS,
+    STATS_FD_REFRESH,
+    STATS_SCAN_PROCESSES,
+    STATS_REFRESH_STATM,
+    STATS_REFRESH_MEMORY,
+    STATS_SMAPS,
+    STATS_REFRESH_LIMITS,
+    STATS_CONTROL,
+    STATS_REFRESH_NUMA,
+    STATS_NACCESSORS
+};
+
+struct prax_stats {
+    uint64_t files_opened;
+    uint64_t bytes_read;
+    uint64_t nl_sent;
+    uint64_t nl_received;
+    uint64_t allocs;
+    // Indexed by enum prax_accessor, time is wall clock nanoseconds.
+    uint64_t calls[STATS_NACCESSORS];
+    uint64_t ns[STATS_NACCESSORS];
+};
+
+// Sums the counters of every thread, live or exited, into stats.
+__attribute__(( visibility("default") ))
+void prax_get_stats(struct prax_stats *stats);
+
+// Name of an enum prax_accessor value, NULL when out of range.
+__attribute__(( visibility("default") ))
+const char *prax_accessor_name(int accessor);
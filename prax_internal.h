@@ -0,0 +1,283 @@
+#ifndef PRAX_INTERNAL_H
+#define PRAX_INTERNAL_H
+
+#include "prax.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Same number on every architecture, older headers lack them.
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/*
+ * Helpers shared between the objects making up libprax.  Nothing in here
+ * is exported from libprax.so or installed with prax.h.
+ */
+
+/*
+ * Profiles opened by handles that track many pids at once (prax.c).
+ */
+
+// Leaves out the taskstats netlink socket a root caller gets, for holders
+// of many profiles that never refresh taskstats.
+#define PROFILE_NO_NETLINK 0x1
+// Leaves out the pidfd, is_alive then probes the pid.
+#define PROFILE_NO_PIDFD   0x2
+
+// init_profile without the descriptors left out by flags.
+profile_t *open_profile(pid_t pid, int flags);
+
+/*
+ * Procfs reading and "Key:  value" line parsing, shared by the parsers of
+ * status, io and the other files laid out that way (procfs.c).
+ */
+
+enum field_type {
+    FIELD_DEC,
+    FIELD_HEX,
+    // "queued/limit", stored into a struct proc_signal.
+    FIELD_SIGQ,
+    // Real, effective, saved and fs ids, stored into a struct proc_cred.
+    FIELD_UIDS,
+    FIELD_GIDS
+};
+
+struct procfs_field {
+    const char *key;
+    size_t key_len;
+    enum field_type type;
+    size_t offset;
+    size_t size;
+};
+
+#define PROCFS_FIELD(base_type, key, type, member)                        \
+    { key, sizeof(key) - 1, type, offsetof(base_type, member),            \
+      sizeof(((base_type *) 0)->member) }
+
+// Entries of a field table.
+#define NFIELDS(fields) (sizeof fields / sizeof fields[0])
+
+// Re-reads an already open procfs file from offset 0 into buf, nul
+// terminated.
+ssize_t read_procfs_fd(int fd, char *buf, size_t size);
+
+// Reads path relative to dirfd into buf, nul terminated, without stdio.
+ssize_t read_procfs_at(int dirfd, const char *path, char *buf, size_t size);
+
+// Grows *buf of *cap elements of size bytes, doubling from 64, until it
+// holds count of them.
+int prax_reserve(void **buf, size_t *cap, size_t count, size_t size);
+
+#define RESERVE(buf, cap, count) \
+    prax_reserve((void **) &(buf), &(cap), count, sizeof *(buf))
+
+// Reads one of the hot files of the profile through its cached descriptor
+// (prax.c).
+ssize_t read_procfs_hot(profile_t *process, enum procfs_hot file,
+                        char *buf, size_t size);
+
+// Walks the lines of buf (modified in place) once, storing the value of
+// every line whose key is in fields at its offset from base.  Returns the
+// number of fields found.
+int parse_procfs_fields(char *buf, const struct procfs_field *fields,
+                        int nfields, void *base);
+
+// Formats "<pid>/<file>" into path, for openat relative to /proc or a task
+// directory.  path needs room for 11 digits, the slash and file.
+char *pid_path(char *path, pid_t pid, const char *file);
+
+// Lists the numeric entries of dirfd (/proc, a task or an fd directory) with
+// getdents64 into *ids, growing it as needed.  Returns the count.
+int list_numeric_dir(int dirfd, pid_t **ids, size_t *cap);
+
+// Decodes a whole stat line into stat in one pass.  comm is found by the
+// last ')' as it may hold spaces and parentheses itself.  Returns the
+// number of fields found.
+int parse_proc_stat(char *buf, struct proc_stat *stat);
+
+// Decodes the rows of limits, which follow RLIMIT_* order, into limits.
+// Returns the number of rows found.
+int parse_proc_limits(char *buf, struct rlimit *limits);
+
+char *scan_dec(char *str, uint64_t *value);
+
+char *scan_hex(char *str, uint64_t *value);
+
+/*
+ * Generic-Netlink plumbing for the taskstats family (taskstats.c).
+ */
+
+int create_nl_conn(void);
+
+int get_nl_family_id(int nl_conn);
+
+static inline void build_req(struct taskmsg *msg, int nl_type, int cmd,
+                        int nla_type, int nla_data_len, void *nla_data)
+{
+    msg->nl.nlmsg_flags = NLM_F_REQUEST;
+    msg->nl.nlmsg_type = nl_type;
+    msg->nl.nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN;
+
+    msg->gnl.version = 0x1;
+    msg->gnl.cmd = cmd;
+
+    struct nlattr *nla = GENLMSG_DATA(msg->gnl);
+    nla->nla_type = nla_type;
+    nla->nla_len = NLA_HDRLEN + nla_data_len;
+    msg->nl.nlmsg_len += NLMSG_ALIGN(nla->nla_len);
+    memcpy(NLA_DATA(nla), nla_data, nla_data_len); 
+}
+
+int send_nl_req(int conn, void *buf, int msglength);
+
+void *make_nl_req(int req, int nl_conn, int family_id, pid_t pid, 
+                  struct taskmsg *msg);
+
+// Returns the payload of the first attribute of type req, descending into
+// AGGR_PID/AGGR_TGID nests.
+void *parse_taskmsg(int req, struct taskmsg *msg);
+
+// Older kernels send a shorter struct taskstats, the tail stays zeroed.
+void copy_taskstats(struct taskstats *dst, void *nla_data);
+
+/*
+ * Minimal io_uring through the raw syscalls, for batching procfs reads
+ * (uring.c).  One thread drives a ring at a time.
+ */
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_len;
+    size_t sqes_len;
+    // Prepared but not yet submitted.
+    unsigned pending;
+    // Sqes taken by the kernel and cqes reaped, equal when none is in
+    // flight.
+    unsigned submitted;
+    unsigned completed;
+};
+
+// Sets up a ring of at least entries sqes with a sparse table of nfiles
+// fixed files.  Fails unless openat can install into a fixed file slot
+// (5.15) and read and files update are supported.
+int init_uring(struct uring *ring, unsigned entries, unsigned nfiles);
+
+// Returns a zeroed sqe, or NULL when the submission queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// Submits the prepared sqes and waits for wait_nr completions.
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &(ring->cqes[head & ring->cq_mask]);
+}
+
+static inline void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+    ring->completed++;
+}
+
+// Drops the sqes not yet taken by the kernel and waits out the completion
+// of the others, discarding them, so the buffers they point into can be
+// freed.  Returns -1 when the ring cannot be waited on.
+int uring_quiesce(struct uring *ring);
+
+void free_uring(struct uring *ring);
+
+/*
+ * Instrumentation (stats.c).  The per-thread copy is found through a
+ * thread local pointer and only ever written by its thread, so counting is
+ * a plain load and store.
+ */
+
+struct prax_stats *stats_local(void);
+
+#define STATS_ADD(field, n)                                               \
+    do {                                                                  \
+        struct prax_stats *stats_ = stats_local();                        \
+        if (stats_)                                                       \
+            __atomic_store_n(&(stats_->field), stats_->field + (n),       \
+                             __ATOMIC_RELAXED);                           \
+    } while (0)
+
+struct stats_timer {
+    int accessor;
+    uint64_t start;
+};
+
+uint64_t stats_clock(void);
+
+void stats_timer_end(struct stats_timer *timer);
+
+// Times the rest of the enclosing scope, whichever way it is left.
+#define STATS_TIMED(accessor)                                             \
+    struct stats_timer stats_timer_                                       \
+        __attribute__(( cleanup(stats_timer_end) )) =                     \
+        { accessor, stats_clock() }
+
+static inline void profile_unlock_scope(profile_t **process)
+{
+    pthread_mutex_unlock(&((*process)->lock));
+}
+
+// Holds the (recursive) lock of the profile for the rest of the enclosing
+// scope, whichever way it is left.
+#define PROFILE_LOCKED(process)                                           \
+    profile_t *profile_locked_                                            \
+        __attribute__(( cleanup(profile_unlock_scope) )) =                \
+        (pthread_mutex_lock(&((process)->lock)), (process))
+
+static inline int prax_openat(int dirfd, const char *path, int flags)
+{
+    int fd = openat(dirfd, path, flags);
+    if (fd > -1)
+        STATS_ADD(files_opened, 1);
+    return fd;
+}
+
+static inline void *prax_malloc(size_t size)
+{
+    STATS_ADD(allocs, 1);
+    return malloc(size);
+}
+
+static inline void *prax_calloc(size_t nmemb, size_t size)
+{
+    STATS_ADD(allocs, 1);
+    return calloc(nmemb, size);
+}
+
+static inline void *prax_realloc(void *ptr, size_t size)
+{
+    STATS_ADD(allocs, 1);
+    return realloc(ptr, size);
+}
+
+#endif
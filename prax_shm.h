@@ -0,0 +1,184 @@
+#ifndef PRAX_SHM_H
+#define PRAX_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Reader side of the samples published by sampler_publish into
+ * /dev/shm/<name>.  Header only, it needs nothing from libprax and once the
+ * region is mapped reading it makes no syscall.
+ *
+ * Layout, native endianness, every offset fixed:
+ *
+ *   struct prax_shm_header   (64 bytes)
+ *   struct prax_shm_slot     nslots times (192 bytes each)
+ *
+ * A slot is a seqlock.  The publisher makes seq odd, writes the sample and
+ * makes it even again, so a copy taken between two equal even reads of seq
+ * is consistent.  A slot with a pid of 0 is unused, the slot of a target
+ * found exited is cleared to that at once, so a pid still showing is alive
+ * as of its timestamp.
+ */
+
+#define PRAX_SHM_MAGIC   0x58415250
+#define PRAX_SHM_VERSION 1
+
+// Retries of a slot being written before prax_shm_read gives up.
+#define PRAX_SHM_RETRIES 64
+
+struct prax_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_size;
+    uint32_t nslots;
+    uint32_t reserved;
+    // Sampler tick in nanoseconds.
+    uint64_t tick_ns;
+    uint8_t pad[32];
+};
+
+// The fields of struct sample (prax.h), same meaning and units.
+struct prax_shm_sample {
+    uint64_t timestamp;
+    int32_t pid;
+    int32_t fields;
+    int32_t processor;
+    uint8_t state;
+    uint8_t pad[3];
+    int64_t num_threads;
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t vsize;
+    int64_t rss;
+    uint64_t vm_rss;
+    uint64_t vol_ctxt_swt;
+    uint64_t invol_ctxt_swt;
+    uint64_t read_char;
+    uint64_t write_char;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t run_time;
+    uint64_t run_delay;
+    uint64_t timeslices;
+    uint64_t reserved[3];
+};
+
+struct prax_shm_slot {
+    uint64_t seq;
+    struct prax_shm_sample sample;
+};
+
+_Static_assert(sizeof(struct prax_shm_header) == 64, "prax_shm header");
+_Static_assert(sizeof(struct prax_shm_slot) == 192, "prax_shm slot");
+
+struct prax_shm {
+    const struct prax_shm_header *header;
+    const struct prax_shm_slot *slots;
+    size_t size;
+};
+
+// Maps /dev/shm/<name> read only and checks its layout.
+static inline int prax_shm_open(const char *name, struct prax_shm *shm)
+{
+    char path[256];
+    size_t len = strlen(name);
+    if (len + 2 > sizeof path)
+        return -1;
+
+    path[0] = '/';
+    memcpy(path + 1, name, len + 1);
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        (size_t) st.st_size < sizeof(struct prax_shm_header)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct prax_shm_header *header = map;
+    if (header->magic != PRAX_SHM_MAGIC ||
+        header->version != PRAX_SHM_VERSION ||
+        header->slot_size != sizeof(struct prax_shm_slot) ||
+        header->header_size + (size_t) header->nslots * header->slot_size >
+        (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    shm->header = header;
+    shm->slots = (const struct prax_shm_slot *) ((const char *) map +
+                                                 header->header_size);
+    shm->size = st.st_size;
+
+    return 0;
+}
+
+/*
+ * Copies a consistent snapshot of slot index into sample.  Returns 0, or
+ * -1 when the slot is unused or kept being rewritten.
+ */
+static inline int prax_shm_read(const struct prax_shm *shm, uint32_t index,
+                                struct prax_shm_sample *sample)
+{
+    if (index >= shm->header->nslots)
+        return -1;
+
+    const struct prax_shm_slot *slot = &(shm->slots[index]);
+
+    for (int i=0; i < PRAX_SHM_RETRIES; i++) {
+        uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        memcpy(sample, (const void *) &(slot->sample), sizeof *sample);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == seq)
+            return sample->pid ? 0 : -1;
+    }
+
+    return -1;
+}
+
+// Finds the slot of pid and reads it.
+static inline int prax_shm_find(const struct prax_shm *shm, int32_t pid,
+                                struct prax_shm_sample *sample)
+{
+    for (uint32_t i=0; i < shm->header->nslots; i++) {
+        if (__atomic_load_n(&(shm->slots[i].sample.pid), __ATOMIC_RELAXED) !=
+            pid)
+            continue;
+        if (prax_shm_read(shm, i, sample) == 0 && sample->pid == pid)
+            return 0;
+    }
+
+    return -1;
+}
+
+static inline void prax_shm_close(struct prax_shm *shm)
+{
+    if (shm->header)
+        munmap((void *) shm->header, shm->size);
+
+    shm->header = NULL;
+    shm->slots = NULL;
+}
+
+#endif
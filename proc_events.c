@@ -0,0 +1,419 @@
+#include "prax_internal.h"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+
+#define PROC_EVENTS_QUEUE 65536
+#define PROC_EVENTS_RECV 8192
+#define PROC_EVENTS_RCVBUF (4 << 20)
+#define PID_MAX_PATH "/proc/sys/kernel/pid_max"
+#define PID_MAX_DEFAULT 4194304
+
+struct proc_events {
+    int cn_conn;
+    int stop_fd;
+    int proc_fd;
+    pthread_t thread;
+    bool started;
+    struct lifecycle_event *queue;
+    size_t queue_mask;
+    size_t head;
+    size_t tail;
+    uint64_t dropped;
+    uint64_t resyncs;
+    // One bit per pid of a live process (thread group leader).
+    uint64_t *live;
+    size_t live_words;
+    size_t live_count;
+    pid_t *scan_pids;
+    size_t scan_cap;
+    char recv_buf[PROC_EVENTS_RECV];
+};
+
+static int cn_listen(int cn_conn, enum proc_cn_mcast_op op)
+{
+    char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof op)];
+    memset(buf, 0, sizeof buf);
+
+    struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+    struct cn_msg *msg = NLMSG_DATA(nlh);
+
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof *msg + sizeof op);
+    nlh->nlmsg_type = NLMSG_DONE;
+    msg->id.idx = CN_IDX_PROC;
+    msg->id.val = CN_VAL_PROC;
+    msg->len = sizeof op;
+    memcpy(msg->data, &op, sizeof op);
+
+    if (send(cn_conn, buf, nlh->nlmsg_len, 0) < 0)
+        return -1;
+
+    STATS_ADD(nl_sent, 1);
+
+    return 0;
+}
+
+static size_t read_pid_max(void)
+{
+    char buf[32];
+
+    if (read_procfs_at(AT_FDCWD, PID_MAX_PATH, buf, sizeof buf) < 0)
+        return PID_MAX_DEFAULT;
+
+    uint64_t pid_max;
+    scan_dec(buf, &pid_max);
+
+    return pid_max ? pid_max : PID_MAX_DEFAULT;
+}
+
+static inline void live_set(proc_events_t *events, pid_t pid)
+{
+    size_t word = pid / 64;
+    uint64_t bit = 1ULL << (pid % 64);
+
+    if (pid <= 0 || word >= events->live_words)
+        return;
+
+    if (!(__atomic_fetch_or(&(events->live[word]), bit, __ATOMIC_RELEASE) &
+          bit))
+        __atomic_add_fetch(&(events->live_count), 1, __ATOMIC_RELAXED);
+}
+
+static inline void live_clear(proc_events_t *events, pid_t pid)
+{
+    size_t word = pid / 64;
+    uint64_t bit = 1ULL << (pid % 64);
+
+    if (pid <= 0 || word >= events->live_words)
+        return;
+
+    if (__atomic_fetch_and(&(events->live[word]), ~bit, __ATOMIC_RELEASE) &
+        bit)
+        __atomic_sub_fetch(&(events->live_count), 1, __ATOMIC_RELAXED);
+}
+
+static void push_event(proc_events_t *events, struct lifecycle_event *event)
+{
+    size_t head = events->head;
+    size_t tail = __atomic_load_n(&(events->tail), __ATOMIC_ACQUIRE);
+
+    if (head - tail > events->queue_mask) {
+        __atomic_add_fetch(&(events->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    events->queue[head & events->queue_mask] = *event;
+    __atomic_store_n(&(events->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Rebuilds the live set from a /proc listing, on startup and whenever the
+ * socket overran and events were lost.
+ */
+static int rescan_live(proc_events_t *events)
+{
+    int npids = list_numeric_dir(events->proc_fd, &(events->scan_pids),
+                                 &(events->scan_cap));
+    if (npids < 0)
+        return -1;
+
+    uint64_t *fresh = prax_calloc(events->live_words, sizeof *fresh);
+    if (!fresh)
+        return -1;
+
+    for (int i=0; i < npids; i++) {
+        size_t word = events->scan_pids[i] / 64;
+        if (word < events->live_words)
+            fresh[word] |= 1ULL << (events->scan_pids[i] % 64);
+    }
+
+    size_t count = 0;
+    for (size_t i=0; i < events->live_words; i++) {
+        __atomic_store_n(&(events->live[i]), fresh[i], __ATOMIC_RELEASE);
+        count += __builtin_popcountll(fresh[i]);
+    }
+    __atomic_store_n(&(events->live_count), count, __ATOMIC_RELAXED);
+
+    free(fresh);
+
+    return 0;
+}
+
+static void parse_cn_event(proc_events_t *events, struct proc_event *ev)
+{
+    struct lifecycle_event event;
+    memset(&event, 0, sizeof event);
+
+    event.what = ev->what;
+    event.cpu = ev->cpu;
+    event.timestamp_ns = ev->timestamp_ns;
+
+    switch (ev->what) {
+        case (PROC_EVENT_FORK):
+            event.pid = ev->event_data.fork.child_pid;
+            event.tgid = ev->event_data.fork.child_tgid;
+            event.fork.parent_pid = ev->event_data.fork.parent_pid;
+            event.fork.parent_tgid = ev->event_data.fork.parent_tgid;
+            // A new thread shares the tgid of its creator.
+            if (event.pid == event.tgid)
+                live_set(events, event.tgid);
+            break;
+        case (PROC_EVENT_EXEC):
+            event.pid = ev->event_data.exec.process_pid;
+            event.tgid = ev->event_data.exec.process_tgid;
+            live_set(events, event.tgid);
+            break;
+        case (PROC_EVENT_UID):
+            event.pid = ev->event_data.id.process_pid;
+            event.tgid = ev->event_data.id.process_tgid;
+            event.uid.ruid = ev->event_data.id.r.ruid;
+            event.uid.euid = ev->event_data.id.e.euid;
+            break;
+        case (PROC_EVENT_COMM):
+            event.pid = ev->event_data.comm.process_pid;
+            event.tgid = ev->event_data.comm.process_tgid;
+            memcpy(event.comm, ev->event_data.comm.comm, sizeof event.comm);
+            event.comm[sizeof event.comm - 1] = '\0';
+            break;
+        case (PROC_EVENT_EXIT):
+            event.pid = ev->event_data.exit.process_pid;
+            event.tgid = ev->event_data.exit.process_tgid;
+            event.exit.exit_code = ev->event_data.exit.exit_code;
+            event.exit.exit_signal = ev->event_data.exit.exit_signal;
+            if (event.pid == event.tgid)
+                live_clear(events, event.tgid);
+            break;
+        default:
+            return;
+    }
+
+    push_event(events, &event);
+}
+
+static void *proc_events_reader(void *arg)
+{
+    proc_events_t *events = arg;
+
+    struct pollfd fds[2] = {
+        { .fd = events->cn_conn, .events = POLLIN },
+        { .fd = events->stop_fd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        for (;;) {
+            ssize_t len = recv(events->cn_conn, events->recv_buf,
+                               PROC_EVENTS_RECV, MSG_DONTWAIT);
+            if (len < 0) {
+                if (errno == ENOBUFS) {
+                    struct lifecycle_event resync = {
+                        .what = LIFECYCLE_RESYNC
+                    };
+                    __atomic_add_fetch(&(events->resyncs), 1,
+                                       __ATOMIC_RELAXED);
+                    rescan_live(events);
+                    push_event(events, &resync);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            struct nlmsghdr *nlh = (struct nlmsghdr *) events->recv_buf;
+            for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                STATS_ADD(nl_received, 1);
+                if (nlh->nlmsg_type == NLMSG_ERROR ||
+                    nlh->nlmsg_type == NLMSG_NOOP)
+                    continue;
+
+                struct cn_msg *msg = NLMSG_DATA(nlh);
+                if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+                    continue;
+
+                parse_cn_event(events, (struct proc_event *) msg->data);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+proc_events_t *init_proc_events(size_t queue_size)
+{
+    proc_events_t *events = prax_calloc(1, sizeof *events);
+    if (!events)
+        return NULL;
+
+    events->cn_conn = -1;
+    events->stop_fd = -1;
+    events->proc_fd = -1;
+
+    size_t capacity = 1;
+    for (; capacity < (queue_size ? queue_size : PROC_EVENTS_QUEUE);
+         capacity <<= 1)
+        ;
+
+    events->queue_mask = capacity - 1;
+    events->queue = prax_calloc(capacity, sizeof *events->queue);
+    events->live_words = read_pid_max() / 64 + 1;
+    events->live = prax_calloc(events->live_words, sizeof *events->live);
+    if (!events->queue || !events->live)
+        goto events_error;
+
+    events->cn_conn = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                             NETLINK_CONNECTOR);
+    if (events->cn_conn < 0)
+        goto events_error;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+
+    if (bind(events->cn_conn, (struct sockaddr *) &addr, sizeof addr) < 0)
+        goto events_error;
+
+    int rcvbuf = PROC_EVENTS_RCVBUF;
+    if (setsockopt(events->cn_conn, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &rcvbuf, sizeof rcvbuf) < 0)
+        setsockopt(events->cn_conn, SOL_SOCKET, SO_RCVBUF,
+                   &rcvbuf, sizeof rcvbuf);
+
+    events->proc_fd = prax_openat(AT_FDCWD, PROC,
+                                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    events->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (events->proc_fd < 0 || events->stop_fd < 0)
+        goto events_error;
+
+    // Subscribe before listing /proc so nothing falls between the two.
+    if (cn_listen(events->cn_conn, PROC_CN_MCAST_LISTEN) < 0)
+        goto events_error;
+
+    if (rescan_live(events) < 0)
+        goto events_error;
+
+    if (pthread_create(&(events->thread), NULL, proc_events_reader, events))
+        goto events_error;
+
+    events->started = true;
+
+    return events;
+
+events_error:
+    free_proc_events(events);
+
+    return NULL;
+}
+
+int proc_events_read(proc_events_t *events, struct lifecycle_event *out,
+                     int max)
+{
+    if (!events || !out)
+        return -1;
+
+    size_t tail = events->tail;
+    size_t head = __atomic_load_n(&(events->head), __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    for (; tail != head && count < max; tail++)
+        out[count++] = events->queue[tail & events->queue_mask];
+
+    __atomic_store_n(&(events->tail), tail, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+bool proc_events_alive(proc_events_t *events, pid_t pid)
+{
+    size_t word = pid / 64;
+
+    if (!events || pid <= 0 || word >= events->live_words)
+        return false;
+
+    return __atomic_load_n(&(events->live[word]), __ATOMIC_ACQUIRE) &
+           (1ULL << (pid % 64));
+}
+
+size_t proc_events_count(proc_events_t *events)
+{
+    return events ? __atomic_load_n(&(events->live_count),
+                                    __ATOMIC_RELAXED) : 0;
+}
+
+int proc_events_pids(proc_events_t *events, pid_t *pids, size_t max)
+{
+    if (!events || !pids)
+        return -1;
+
+    size_t count = 0;
+
+    for (size_t i=0; i < events->live_words && count < max; i++) {
+        uint64_t word = __atomic_load_n(&(events->live[i]),
+                                        __ATOMIC_ACQUIRE);
+        while (word && count < max) {
+            int bit = __builtin_ctzll(word);
+            pids[count++] = i * 64 + bit;
+            word &= word - 1;
+        }
+    }
+
+    return count;
+}
+
+uint64_t proc_events_dropped(proc_events_t *events)
+{
+    return events ? __atomic_load_n(&(events->dropped),
+                                    __ATOMIC_RELAXED) : 0;
+}
+
+uint64_t proc_events_resyncs(proc_events_t *events)
+{
+    return events ? __atomic_load_n(&(events->resyncs),
+                                    __ATOMIC_RELAXED) : 0;
+}
+
+void free_proc_events(proc_events_t *events)
+{
+    if (!events)
+        return;
+
+    if (events->started) {
+        eventfd_write(events->stop_fd, 1);
+        pthread_join(events->thread, NULL);
+    }
+
+    if (events->cn_conn > -1) {
+        cn_listen(events->cn_conn, PROC_CN_MCAST_IGNORE);
+        close(events->cn_conn);
+    }
+
+    if (events->stop_fd > -1)
+        close(events->stop_fd);
+
+    if (events->proc_fd > -1)
+        close(events->proc_fd);
+
+    free(events->queue);
+    free(events->live);
+    free(events->scan_pids);
+    free(events);
+}
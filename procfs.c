@@ -0,0 +1,380 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+
+#define DENTS_SIZE 32768
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+
+ssize_t read_procfs_fd(int fd, char *buf, size_t size)
+{
+    size_t total = 0;
+    ssize_t bytes_read = 0;
+
+    while (total < size - 1) {
+        bytes_read = pread(fd, buf + total, size - 1 - total, total);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            break;
+        total += bytes_read;
+    }
+
+    if (bytes_read < 0)
+        return -1;
+
+    STATS_ADD(bytes_read, total);
+
+    buf[total] = '\0';
+    return total;
+}
+
+ssize_t read_procfs_at(int dirfd, const char *path, char *buf, size_t size)
+{
+    int fd = prax_openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t total = read_procfs_fd(fd, buf, size);
+
+    close(fd);
+
+    return total;
+}
+
+int prax_reserve(void **buf, size_t *cap, size_t count, size_t size)
+{
+    if (count <= *cap)
+        return 0;
+
+    size_t new_cap = *cap ? *cap : 64;
+    for (; new_cap < count; new_cap *= 2)
+        ;
+
+    void *new_buf = prax_realloc(*buf, new_cap * size);
+    if (!new_buf)
+        return -1;
+
+    *buf = new_buf;
+    *cap = new_cap;
+
+    return 0;
+}
+
+int list_numeric_dir(int dirfd, pid_t **ids, size_t *cap)
+{
+    char dents[DENTS_SIZE];
+    int count = 0;
+
+    if (lseek(dirfd, 0, SEEK_SET) < 0)
+        return -1;
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, dirfd, dents, sizeof dents);
+        if (nread < 0)
+            return -1;
+        if (nread == 0)
+            break;
+
+        for (long off=0; off < nread;) {
+            struct linux_dirent64 *dent = (void *) (dents + off);
+            off += dent->d_reclen;
+
+            char *name = dent->d_name;
+            if (*name < '0' || *name > '9')
+                continue;
+
+            pid_t id = 0;
+            for (; *name >= '0' && *name <= '9'; name++)
+                id = id * 10 + (*name - '0');
+            if (*name)
+                continue;
+
+            if (count == *cap) {
+                size_t new_cap = *cap ? *cap * 2 : 1024;
+                pid_t *new_ids = prax_realloc(*ids,
+                                              new_cap * sizeof *new_ids);
+                if (!new_ids)
+                    return -1;
+                *ids = new_ids;
+                *cap = new_cap;
+            }
+
+            (*ids)[count++] = id;
+        }
+    }
+
+    return count;
+}
+
+char *pid_path(char *path, pid_t pid, const char *file)
+{
+    char digits[16];
+    int ndigits = 0;
+
+    do {
+        digits[ndigits++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid);
+
+    char *p = path;
+    while (ndigits)
+        *p++ = digits[--ndigits];
+    *p++ = '/';
+    while ((*p++ = *file++))
+        ;
+
+    return path;
+}
+
+char *scan_dec(char *str, uint64_t *value)
+{
+    uint64_t n = 0;
+
+    for (; *str == ' ' || *str == '\t'; str++)
+        ;
+    for (; *str >= '0' && *str <= '9'; str++)
+        n = n * 10 + (*str - '0');
+
+    *value = n;
+    return str;
+}
+
+char *scan_hex(char *str, uint64_t *value)
+{
+    uint64_t n = 0;
+
+    for (; *str == ' ' || *str == '\t'; str++)
+        ;
+    for (;; str++) {
+        if (*str >= '0' && *str <= '9')
+            n = (n << 4) | (*str - '0');
+        else if (*str >= 'a' && *str <= 'f')
+            n = (n << 4) | (*str - 'a' + 10);
+        else
+            break;
+    }
+
+    *value = n;
+    return str;
+}
+
+static char *scan_signed(char *str, int64_t *value)
+{
+    uint64_t n;
+    bool negative = false;
+
+    for (; *str == ' '; str++)
+        ;
+    if (*str == '-') {
+        negative = true;
+        str++;
+    }
+
+    str = scan_dec(str, &n);
+    *value = negative ? -(int64_t) n : (int64_t) n;
+
+    return str;
+}
+
+static inline void store_field(void *dst, size_t size, uint64_t value)
+{
+    switch (size) {
+        case (sizeof(uint64_t)):
+            *(uint64_t *) dst = value;
+            break;
+        case (sizeof(uint32_t)):
+            *(uint32_t *) dst = value;
+            break;
+    }
+}
+
+#define STAT_FIELD(member)                                                \
+    { offsetof(struct proc_stat, member),                                 \
+      sizeof(((struct proc_stat *) 0)->member) }
+
+// Fields 4 (ppid) on, the ones after comm and state.
+static const struct {
+    size_t offset;
+    size_t size;
+} stat_fields[] = {
+    STAT_FIELD(ppid), STAT_FIELD(pgrp), STAT_FIELD(session),
+    STAT_FIELD(tty_nr), STAT_FIELD(tpgid), STAT_FIELD(flags),
+    STAT_FIELD(minflt), STAT_FIELD(cminflt), STAT_FIELD(majflt),
+    STAT_FIELD(cmajflt), STAT_FIELD(utime), STAT_FIELD(stime),
+    STAT_FIELD(cutime), STAT_FIELD(cstime), STAT_FIELD(priority),
+    STAT_FIELD(nice), STAT_FIELD(num_threads), STAT_FIELD(itrealvalue),
+    STAT_FIELD(starttime), STAT_FIELD(vsize), STAT_FIELD(rss),
+    STAT_FIELD(rsslim), STAT_FIELD(startcode), STAT_FIELD(endcode),
+    STAT_FIELD(startstack), STAT_FIELD(kstkesp), STAT_FIELD(kstkeip),
+    STAT_FIELD(signal), STAT_FIELD(blocked), STAT_FIELD(sigignore),
+    STAT_FIELD(sigcatch), STAT_FIELD(wchan), STAT_FIELD(nswap),
+    STAT_FIELD(cnswap), STAT_FIELD(exit_signal), STAT_FIELD(processor),
+    STAT_FIELD(rt_priority), STAT_FIELD(policy),
+    STAT_FIELD(delayacct_blkio_ticks), STAT_FIELD(guest_time),
+    STAT_FIELD(cguest_time), STAT_FIELD(start_data), STAT_FIELD(end_data),
+    STAT_FIELD(start_brk), STAT_FIELD(arg_start), STAT_FIELD(arg_end),
+    STAT_FIELD(env_start), STAT_FIELD(env_end), STAT_FIELD(exit_code)
+};
+
+#define NSTAT_FIELDS (sizeof stat_fields / sizeof stat_fields[0])
+
+int parse_proc_stat(char *buf, struct proc_stat *stat)
+{
+    char *comm_start = strchr(buf, '(');
+    char *comm_end = strrchr(buf, ')');
+    if (!comm_start || !comm_end || comm_end[1] != ' ')
+        return -1;
+
+    memset(stat, 0, sizeof *stat);
+
+    int64_t value;
+    scan_signed(buf, &value);
+    stat->pid = value;
+
+    size_t comm_len = comm_end - comm_start - 1;
+    if (comm_len > sizeof stat->comm - 1)
+        comm_len = sizeof stat->comm - 1;
+    memcpy(stat->comm, comm_start + 1, comm_len);
+
+    char *field = comm_end + 2;
+    stat->state = *field++;
+
+    size_t count = 0;
+    for (; count < NSTAT_FIELDS && *field && *field != '\n'; count++) {
+        field = scan_signed(field, &value);
+        store_field((char *) stat + stat_fields[count].offset,
+                    stat_fields[count].size, value);
+    }
+
+    return count + 3;
+}
+
+// Width of the "Max cpu time" name column of limits, padding included.
+#define LIMITS_NAME_WIDTH 26
+
+static char *scan_limit(char *str, rlim_t *limit)
+{
+    uint64_t n;
+
+    for (; *str == ' '; str++)
+        ;
+    if (!strncmp(str, "unlimited", 9)) {
+        *limit = RLIM_INFINITY;
+        return str + 9;
+    }
+
+    str = scan_dec(str, &n);
+    *limit = n;
+
+    return str;
+}
+
+int parse_proc_limits(char *buf, struct rlimit *limits)
+{
+    // Skip the header row.
+    char *line = strchr(buf, '\n');
+    int count = 0;
+
+    for (; line && count < RLIM_NLIMITS; count++) {
+        line++;
+        if (strnlen(line, LIMITS_NAME_WIDTH) < LIMITS_NAME_WIDTH)
+            break;
+
+        char *field = scan_limit(line + LIMITS_NAME_WIDTH,
+                                 &(limits[count].rlim_cur));
+        scan_limit(field, &(limits[count].rlim_max));
+
+        line = strchr(line, '\n');
+    }
+
+    return count;
+}
+
+static void parse_field_value(void *dst, const struct procfs_field *field,
+                              char *value)
+{
+    uint64_t n;
+
+    switch (field->type) {
+        case (FIELD_DEC):
+            scan_dec(value, &n);
+            store_field(dst, field->size, n);
+            break;
+        case (FIELD_HEX):
+            scan_hex(value, &n);
+            store_field(dst, field->size, n);
+            break;
+        case (FIELD_SIGQ): {
+            struct proc_signal *psig = dst;
+            value = scan_dec(value, &n);
+            psig->signals_pending = n;
+            if (*value == '/') {
+                scan_dec(value + 1, &n);
+                psig->signal_queue_limit = n;
+            }
+            break;
+        }
+        case (FIELD_UIDS): {
+            uid_t *uids = &(((struct proc_cred *) dst)->ruid);
+            for (int i=0; i < 4; i++) {
+                value = scan_dec(value, &n);
+                uids[i] = n;
+            }
+            break;
+        }
+        case (FIELD_GIDS): {
+            gid_t *gids = &(((struct proc_cred *) dst)->rgid);
+            for (int i=0; i < 4; i++) {
+                value = scan_dec(value, &n);
+                gids[i] = n;
+            }
+            break;
+        }
+    }
+}
+
+int parse_procfs_fields(char *buf, const struct procfs_field *fields,
+                        int nfields, void *base)
+{
+    char *line = buf;
+    int matched = 0;
+
+    while (*line && matched < nfields) {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+
+        char *colon = strchr(line, ':');
+        if (colon) {
+            size_t key_len = colon - line;
+            for (int i=0; i < nfields; i++) {
+                const struct procfs_field *field = &fields[i];
+                if (field->key_len == key_len && 
+                    !memcmp(field->key, line, key_len)) {
+                    parse_field_value((char *) base + field->offset, field,
+                                      colon + 1);
+                    matched++;
+                    break;
+                }
+            }
+        }
+
+        if (!end)
+            break;
+        line = end + 1;
+    }
+
+    return matched;
+}
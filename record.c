@@ -0,0 +1,647 @@
+#include "prax_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/*
+ * Layout, in host byte order:
+ *
+ *   file header   "PRAXREC1", version, column count
+ *   blocks        block header, byte length of every column, the columns
+ *   index         one entry per block
+ *   trailer       block count, index offset, "PRAXIDX1"
+ *
+ * The points of a block are sorted by pid then time so every pid is one run
+ * of rows.  The first row of a run is stored as is, the others against the
+ * row before: counters as varint deltas, gauges as zig-zag varint deltas
+ * and timestamps as a varint delta followed by zig-zag deltas of deltas,
+ * which are a byte or two at a steady rate.  Every block decodes on its
+ * own.
+ *
+ * A recording that was not closed has no index.  It is rebuilt by walking
+ * the block headers, and appending resumes after the last whole block.
+ */
+
+#define RECORD_MAGIC   "PRAXREC1"
+#define INDEX_MAGIC    "PRAXIDX1"
+#define BLOCK_MAGIC    0x4b4c4250
+#define RECORD_VERSION 1
+
+// Longest varint of a 64 bit value.
+#define VARINT_MAX 10
+
+enum record_column {
+    COL_PID,
+    COL_TIMESTAMP,
+    COL_VOL_CTXT_SWT,
+    COL_INVOL_CTXT_SWT,
+    COL_UTIME,
+    COL_STIME,
+    COL_VMEM,
+    COL_VM_RSS,
+    COL_FD_COUNT,
+    COL_THREAD_COUNT,
+    NCOLUMNS
+};
+
+enum column_kind {
+    KIND_PID,
+    KIND_TIME,
+    KIND_COUNTER,
+    KIND_GAUGE
+};
+
+#define COLUMN(kind, member) { kind, offsetof(struct record_point, member) }
+
+static const struct {
+    enum column_kind kind;
+    size_t offset;
+} columns[NCOLUMNS] = {
+    [COL_PID] = COLUMN(KIND_PID, pid),
+    [COL_TIMESTAMP] = COLUMN(KIND_TIME, timestamp),
+    [COL_VOL_CTXT_SWT] = COLUMN(KIND_COUNTER, vol_ctxt_swt),
+    [COL_INVOL_CTXT_SWT] = COLUMN(KIND_COUNTER, invol_ctxt_swt),
+    [COL_UTIME] = COLUMN(KIND_COUNTER, utime),
+    [COL_STIME] = COLUMN(KIND_COUNTER, stime),
+    [COL_VMEM] = COLUMN(KIND_GAUGE, vmem),
+    [COL_VM_RSS] = COLUMN(KIND_GAUGE, vm_rss),
+    [COL_FD_COUNT] = COLUMN(KIND_GAUGE, fd_count),
+    [COL_THREAD_COUNT] = COLUMN(KIND_GAUGE, thread_count)
+};
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ncolumns;
+};
+
+struct block_header {
+    uint32_t magic;
+    uint32_t npoints;
+    // Bytes following the header, column lengths included.
+    uint64_t length;
+    uint64_t t_first;
+    uint64_t t_last;
+};
+
+struct index_entry {
+    uint64_t offset;
+    uint64_t t_first;
+    uint64_t t_last;
+    uint32_t npoints;
+    uint32_t reserved;
+};
+
+struct trailer {
+    uint64_t nblocks;
+    uint64_t index_offset;
+    char magic[8];
+};
+
+#define BLOCK_PREFIX (sizeof(struct block_header) + NCOLUMNS * sizeof(uint32_t))
+
+struct recorder {
+    int fd;
+    // Where the next block goes.
+    uint64_t end;
+    struct record_point *points;
+    size_t npoints;
+    size_t block_points;
+    uint8_t *buf;
+    size_t buf_cap;
+    struct index_entry *index;
+    size_t nblocks;
+    size_t index_cap;
+};
+
+struct replay {
+    const uint8_t *map;
+    size_t size;
+    struct index_entry *index;
+    size_t nblocks;
+    size_t index_cap;
+    struct record_point *points;
+    size_t points_cap;
+};
+
+static inline size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t len = 0;
+
+    for (; value >= 0x80; value >>= 7)
+        out[len++] = value | 0x80;
+    out[len++] = value;
+
+    return len;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *in, const uint8_t *end,
+                                        uint64_t *value)
+{
+    uint64_t result = 0;
+
+    for (int shift=0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return in;
+        }
+    }
+
+    return NULL;
+}
+
+static inline uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static inline uint64_t *point_field(struct record_point *point, int column)
+{
+    return (uint64_t *) ((char *) point + columns[column].offset);
+}
+
+/*
+ * Fills the block index from the trailer, or by walking the blocks when
+ * there is none, and sets *end past the last whole block.
+ */
+static int load_index(const uint8_t *map, size_t size,
+                      struct index_entry **index, size_t *nblocks,
+                      size_t *cap, uint64_t *end)
+{
+    const struct file_header *header = (const void *) map;
+
+    if (size < sizeof *header ||
+        memcmp(header->magic, RECORD_MAGIC, sizeof header->magic) ||
+        header->version != RECORD_VERSION || header->ncolumns != NCOLUMNS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *nblocks = 0;
+
+    if (size >= sizeof *header + sizeof(struct trailer)) {
+        const struct trailer *trailer =
+            (const void *) (map + size - sizeof *trailer);
+
+        if (!memcmp(trailer->magic, INDEX_MAGIC, sizeof trailer->magic) &&
+            trailer->index_offset >= sizeof *header &&
+            trailer->index_offset + trailer->nblocks *
+            sizeof(struct index_entry) + sizeof *trailer == size) {
+            if (RESERVE(*index, *cap, trailer->nblocks) < 0)
+                return -1;
+            memcpy(*index, map + trailer->index_offset,
+                   trailer->nblocks * sizeof **index);
+            *nblocks = trailer->nblocks;
+            *end = trailer->index_offset;
+            return 0;
+        }
+    }
+
+    uint64_t offset = sizeof *header;
+
+    while (offset + BLOCK_PREFIX <= size) {
+        const struct block_header *block = (const void *) (map + offset);
+
+        if (block->magic != BLOCK_MAGIC ||
+            block->length > size - offset - sizeof *block)
+            break;
+
+        if (RESERVE(*index, *cap, *nblocks + 1) < 0)
+            return -1;
+
+        struct index_entry *entry = &((*index)[(*nblocks)++]);
+        memset(entry, 0, sizeof *entry);
+        entry->offset = offset;
+        entry->t_first = block->t_first;
+        entry->t_last = block->t_last;
+        entry->npoints = block->npoints;
+
+        offset += sizeof *block + block->length;
+    }
+
+    *end = offset;
+
+    return 0;
+}
+
+recorder_t *init_recorder(const char *path, size_t block_points)
+{
+    recorder_t *recorder = prax_calloc(1, sizeof *recorder);
+    if (!recorder)
+        return NULL;
+
+    recorder->fd = -1;
+
+    recorder->block_points = block_points ? block_points : RECORD_BLOCK_POINTS;
+
+    recorder->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (recorder->fd < 0)
+        goto recorder_error;
+    STATS_ADD(files_opened, 1);
+
+    recorder->points = prax_calloc(recorder->block_points,
+                                   sizeof *recorder->points);
+    if (!recorder->points)
+        goto recorder_error;
+
+    struct stat st;
+    if (fstat(recorder->fd, &st) < 0)
+        goto recorder_error;
+
+    if (st.st_size == 0) {
+        struct file_header header = { .version = RECORD_VERSION,
+                                      .ncolumns = NCOLUMNS };
+        memcpy(header.magic, RECORD_MAGIC, sizeof header.magic);
+
+        if (pwrite(recorder->fd, &header, sizeof header, 0) != sizeof header)
+            goto recorder_error;
+
+        recorder->end = sizeof header;
+        return recorder;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                     recorder->fd, 0);
+    if (map == MAP_FAILED)
+        goto recorder_error;
+
+    int ret = load_index(map, st.st_size, &(recorder->index),
+                         &(recorder->nblocks), &(recorder->index_cap),
+                         &(recorder->end));
+    munmap(map, st.st_size);
+
+    // The old index and any torn block are written over.
+    if (ret < 0 || ftruncate(recorder->fd, recorder->end) < 0)
+        goto recorder_error;
+
+    return recorder;
+
+recorder_error:
+    if (recorder->fd > -1)
+        close(recorder->fd);
+    free(recorder->points);
+    free(recorder->index);
+    free(recorder);
+
+    return NULL;
+}
+
+int recorder_append(recorder_t *recorder, const struct record_point *point)
+{
+    if (!recorder || !point)
+        return -1;
+
+    recorder->points[recorder->npoints++] = *point;
+
+    if (recorder->npoints == recorder->block_points)
+        return recorder_flush(recorder);
+
+    return 0;
+}
+
+int recorder_append_profile(recorder_t *recorder, profile_t *process,
+                            uint64_t timestamp)
+{
+    if (!process)
+        return -1;
+
+    struct record_point point = {
+        .timestamp = timestamp,
+        .pid = process->pid,
+        .vol_ctxt_swt = process->vol_ctxt_swt,
+        .invol_ctxt_swt = process->invol_ctxt_swt,
+        .utime = process->stat.utime,
+        .stime = process->stat.stime,
+        .vmem = process->vmem,
+        .vm_rss = process->vm_rss,
+        .fd_count = process->fds.count,
+        .thread_count = process->thread_count
+    };
+
+    return recorder_append(recorder, &point);
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    const struct record_point *left = a, *right = b;
+
+    if (left->pid != right->pid)
+        return left->pid < right->pid ? -1 : 1;
+    if (left->timestamp != right->timestamp)
+        return left->timestamp < right->timestamp ? -1 : 1;
+
+    return 0;
+}
+
+static size_t encode_column(const struct record_point *points, size_t npoints,
+                            int column, uint64_t t_first, uint8_t *out)
+{
+    size_t len = 0;
+    uint64_t prev = 0, prev_delta = 0;
+
+    for (size_t i=0; i < npoints; i++) {
+        bool run_start = i == 0 || points[i].pid != points[i - 1].pid;
+        bool run_second = !run_start &&
+                          (i == 1 || points[i - 1].pid != points[i - 2].pid);
+        uint64_t value = *point_field((struct record_point *) &points[i],
+                                      column);
+
+        switch (columns[column].kind) {
+            case (KIND_PID):
+                value = (uint32_t) points[i].pid;
+                len += put_varint(out + len, i ? value - prev : value);
+                break;
+            case (KIND_TIME): {
+                uint64_t delta = value - prev;
+                if (run_start)
+                    len += put_varint(out + len, value - t_first);
+                else if (run_second)
+                    len += put_varint(out + len, delta);
+                else
+                    len += put_varint(out + len,
+                                      zigzag(delta - prev_delta));
+                prev_delta = delta;
+                break;
+            }
+            case (KIND_COUNTER):
+                len += put_varint(out + len, run_start ? value : value - prev);
+                break;
+            case (KIND_GAUGE):
+                len += put_varint(out + len, zigzag(run_start ? value :
+                                                    value - prev));
+                break;
+        }
+
+        prev = value;
+    }
+
+    return len;
+}
+
+int recorder_flush(recorder_t *recorder)
+{
+    if (!recorder)
+        return -1;
+
+    size_t npoints = recorder->npoints;
+    if (!npoints)
+        return 0;
+
+    struct record_point *points = recorder->points;
+    qsort(points, npoints, sizeof *points, cmp_point);
+
+    size_t max_len = BLOCK_PREFIX + npoints * NCOLUMNS * VARINT_MAX;
+    if (RESERVE(recorder->buf, recorder->buf_cap, max_len) < 0 ||
+        RESERVE(recorder->index, recorder->index_cap,
+                recorder->nblocks + 1) < 0)
+        return -1;
+
+    struct block_header *block = (struct block_header *) recorder->buf;
+    uint32_t *column_len = (uint32_t *) (block + 1);
+
+    block->magic = BLOCK_MAGIC;
+    block->npoints = npoints;
+    block->t_first = block->t_last = points[0].timestamp;
+    for (size_t i=1; i < npoints; i++) {
+        if (points[i].timestamp < block->t_first)
+            block->t_first = points[i].timestamp;
+        if (points[i].timestamp > block->t_last)
+            block->t_last = points[i].timestamp;
+    }
+
+    size_t len = BLOCK_PREFIX;
+    for (int column=0; column < NCOLUMNS; column++) {
+        column_len[column] = encode_column(points, npoints, column,
+                                           block->t_first,
+                                           recorder->buf + len);
+        len += column_len[column];
+    }
+    block->length = len - sizeof *block;
+
+    for (size_t off=0; off < len;) {
+        ssize_t written = pwrite(recorder->fd, recorder->buf + off,
+                                 len - off, recorder->end + off);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += written;
+    }
+
+    struct index_entry *entry = &(recorder->index[recorder->nblocks++]);
+    memset(entry, 0, sizeof *entry);
+    entry->offset = recorder->end;
+    entry->t_first = block->t_first;
+    entry->t_last = block->t_last;
+    entry->npoints = npoints;
+
+    recorder->end += len;
+    recorder->npoints = 0;
+
+    return 0;
+}
+
+int free_recorder(recorder_t *recorder)
+{
+    if (!recorder)
+        return -1;
+
+    int ret = recorder_flush(recorder);
+
+    struct trailer trailer = {
+        .nblocks = recorder->nblocks,
+        .index_offset = recorder->end
+    };
+    memcpy(trailer.magic, INDEX_MAGIC, sizeof trailer.magic);
+
+    size_t index_len = recorder->nblocks * sizeof *recorder->index;
+    if (ret == 0 &&
+        (pwrite(recorder->fd, recorder->index, index_len,
+                recorder->end) != (ssize_t) index_len ||
+         pwrite(recorder->fd, &trailer, sizeof trailer,
+                recorder->end + index_len) != sizeof trailer))
+        ret = -1;
+
+    if (close(recorder->fd) < 0)
+        ret = -1;
+
+    free(recorder->points);
+    free(recorder->buf);
+    free(recorder->index);
+    free(recorder);
+
+    return ret;
+}
+
+replay_t *init_replay(const char *path)
+{
+    replay_t *replay = prax_calloc(1, sizeof *replay);
+    if (!replay)
+        return NULL;
+
+    int fd = prax_openat(AT_FDCWD, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto replay_error;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        goto replay_error;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto replay_error;
+
+    replay->map = map;
+    replay->size = st.st_size;
+
+    uint64_t end;
+    if (load_index(replay->map, replay->size, &(replay->index),
+                   &(replay->nblocks), &(replay->index_cap), &end) < 0)
+        goto replay_error;
+
+    return replay;
+
+replay_error:
+    free_replay(replay);
+
+    return NULL;
+}
+
+static int decode_block(const struct index_entry *entry, const uint8_t *map,
+                        size_t size, struct record_point *points)
+{
+    if (entry->offset + BLOCK_PREFIX > size)
+        goto corrupt;
+
+    const struct block_header *block = (const void *) (map + entry->offset);
+    const uint32_t *column_len = (const uint32_t *) (block + 1);
+    const uint8_t *in = map + entry->offset + BLOCK_PREFIX;
+    size_t npoints = block->npoints;
+
+    if (block->magic != BLOCK_MAGIC || npoints != entry->npoints ||
+        block->length > size - entry->offset - sizeof *block)
+        goto corrupt;
+
+    const uint8_t *block_end = map + entry->offset + sizeof *block +
+                               block->length;
+
+    // The pid column comes first, it tells where the runs start.
+    for (int column=0; column < NCOLUMNS; column++) {
+        const uint8_t *column_end = in + column_len[column];
+        uint64_t prev = 0, prev_delta = 0, value;
+
+        if (column_end > block_end)
+            goto corrupt;
+
+        for (size_t i=0; i < npoints; i++) {
+            // Runs are only known once the pid column is decoded.
+            bool run_start = column != COL_PID &&
+                             (i == 0 || points[i].pid != points[i - 1].pid);
+            bool run_second = column != COL_PID && !run_start &&
+                              (i == 1 || points[i - 1].pid != points[i - 2].pid);
+
+            if (!(in = get_varint(in, column_end, &value)))
+                goto corrupt;
+
+            switch (columns[column].kind) {
+                case (KIND_PID):
+                    value = i ? prev + value : value;
+                    points[i].pid = value;
+                    break;
+                case (KIND_TIME): {
+                    if (run_start)
+                        value += block->t_first;
+                    else if (run_second)
+                        value += prev;
+                    else
+                        value = prev + prev_delta + unzigzag(value);
+                    prev_delta = value - prev;
+                    points[i].timestamp = value;
+                    break;
+                }
+                case (KIND_COUNTER):
+                    value = run_start ? value : prev + value;
+                    *point_field(&points[i], column) = value;
+                    break;
+                case (KIND_GAUGE):
+                    value = run_start ? (uint64_t) unzigzag(value) :
+                                        prev + unzigzag(value);
+                    *point_field(&points[i], column) = value;
+                    break;
+            }
+
+            prev = value;
+        }
+
+        in = column_end;
+    }
+
+    return 0;
+
+corrupt:
+    errno = EINVAL;
+
+    return -1;
+}
+
+ssize_t replay_range(replay_t *replay, uint64_t from, uint64_t to,
+                     struct record_point **points)
+{
+    if (!replay || !points)
+        return -1;
+
+    size_t count = 0;
+
+    for (size_t i=0; i < replay->nblocks; i++) {
+        const struct index_entry *entry = &(replay->index[i]);
+
+        if (entry->t_last < from || entry->t_first > to)
+            continue;
+
+        if (RESERVE(replay->points, replay->points_cap,
+                    count + entry->npoints) < 0)
+            return -1;
+
+        struct record_point *block_points = replay->points + count;
+        if (decode_block(entry, replay->map, replay->size, block_points) < 0)
+            return -1;
+
+        for (size_t j=0; j < entry->npoints; j++) {
+            uint64_t timestamp = block_points[j].timestamp;
+            if (timestamp >= from && timestamp <= to)
+                replay->points[count++] = block_points[j];
+        }
+    }
+
+    *points = replay->points;
+
+    return count;
+}
+
+void free_replay(replay_t *replay)
+{
+    if (!replay)
+        return;
+
+    if (replay->map)
+        munmap((void *) replay->map, replay->size);
+
+    free(replay->index);
+    free(replay->points);
+    free(replay);
+}
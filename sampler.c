@@ -0,0 +1,649 @@
+#include "prax_internal.h"
+#include "prax_shm.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+
+/*
+ * Every slot is a seqlock written by the one collector that owns the pid:
+ * seq is odd while the sample is being written, n is the index of the
+ * sample it holds so a reader can tell a slot that was lapped.
+ */
+struct sample_slot {
+    uint64_t seq;
+    uint64_t n;
+    struct sample sample;
+};
+
+struct sample_target {
+    pid_t pid;
+    int field_mask;
+    uint64_t interval;
+    uint64_t next_due;
+    bool exited;
+    profile_t *process;
+    // Slot in the published region, -1 when there is none.
+    int64_t shm_slot;
+    uint64_t head;
+    struct sample_slot ring[SAMPLE_RING_SIZE];
+};
+
+struct sample_worker {
+    sampler_t *sampler;
+    int id;
+    int timer_fd;
+    int epoll_fd;
+    bool started;
+    pthread_t thread;
+};
+
+/*
+ * Collectors and readers share the read side of the lock, only adding and
+ * removing pids takes the write side, so a reader never holds up a tick.
+ */
+struct sampler {
+    uint64_t tick;
+    int stop_fd;
+    pthread_rwlock_t lock;
+    // Sorted by pid.
+    struct sample_target **targets;
+    size_t ntargets;
+    size_t targets_cap;
+    uint64_t overruns;
+    struct prax_shm_header *shm;
+    struct prax_shm_slot *shm_slots;
+    size_t shm_size;
+    char *shm_name;
+    // Publisher side record of the slots handed out.
+    bool *shm_used;
+    int nworkers;
+    struct sample_worker workers[];
+};
+
+/*
+ * The slot of a target is only written by the collector owning it or, to
+ * hand it out or take it back, under the write side of the lock.
+ */
+static void publish_sample(sampler_t *sampler, int64_t index,
+                           const struct sample *sample)
+{
+    struct prax_shm_slot *slot = &(sampler->shm_slots[index]);
+    struct prax_shm_sample *out = &(slot->sample);
+    uint64_t seq = slot->seq;
+
+    __atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memset(out, 0, sizeof *out);
+    if (sample) {
+        out->timestamp = sample->timestamp;
+        out->pid = sample->pid;
+        out->fields = sample->fields;
+        out->processor = sample->processor;
+        out->state = sample->state;
+        out->num_threads = sample->num_threads;
+        out->utime = sample->utime;
+        out->stime = sample->stime;
+        out->minflt = sample->minflt;
+        out->majflt = sample->majflt;
+        out->vsize = sample->vsize;
+        out->rss = sample->rss;
+        out->vm_rss = sample->vm_rss;
+        out->vol_ctxt_swt = sample->vol_ctxt_swt;
+        out->invol_ctxt_swt = sample->invol_ctxt_swt;
+        out->read_char = sample->read_char;
+        out->write_char = sample->write_char;
+        out->read_bytes = sample->read_bytes;
+        out->write_bytes = sample->write_bytes;
+        out->run_time = sample->run_time;
+        out->run_delay = sample->run_delay;
+        out->timeslices = sample->timeslices;
+    }
+
+    __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+static void assign_slot(sampler_t *sampler, struct sample_target *target)
+{
+    target->shm_slot = -1;
+
+    for (uint32_t i=0; sampler->shm && i < sampler->shm->nslots; i++) {
+        if (!sampler->shm_used[i]) {
+            sampler->shm_used[i] = true;
+            target->shm_slot = i;
+            return;
+        }
+    }
+}
+
+static void release_slot(sampler_t *sampler, struct sample_target *target)
+{
+    if (target->shm_slot < 0)
+        return;
+
+    publish_sample(sampler, target->shm_slot, NULL);
+    sampler->shm_used[target->shm_slot] = false;
+    target->shm_slot = -1;
+}
+
+// Clears the published slot so readers see the pid gone rather than a
+// sample that stopped moving.
+static void mark_exited(sampler_t *sampler, struct sample_target *target)
+{
+    target->exited = true;
+
+    if (target->shm_slot > -1)
+        publish_sample(sampler, target->shm_slot, NULL);
+}
+
+static void collect_sample(sampler_t *sampler, struct sample_target *target,
+                           uint64_t now)
+{
+    profile_t *process = target->process;
+    int field_mask = target->field_mask;
+    struct sample sample;
+
+    memset(&sample, 0, sizeof sample);
+    sample.timestamp = now;
+    sample.pid = target->pid;
+
+    if (field_mask & SAMPLE_STAT) {
+        if (profile_refresh_stat(process) < 0) {
+            mark_exited(sampler, target);
+            return;
+        }
+
+        struct proc_stat *stat = &(process->stat);
+        sample.state = stat->state;
+        sample.processor = stat->processor;
+        sample.num_threads = stat->num_threads;
+        sample.utime = stat->utime;
+        sample.stime = stat->stime;
+        sample.minflt = stat->minflt;
+        sample.majflt = stat->majflt;
+        sample.vsize = stat->vsize;
+        sample.rss = stat->rss;
+        sample.fields |= SAMPLE_STAT;
+    }
+
+    if ((field_mask & SAMPLE_STATUS) && profile_refresh_status(process) == 0) {
+        sample.vm_rss = process->vm_rss;
+        sample.vol_ctxt_swt = process->vol_ctxt_swt;
+        sample.invol_ctxt_swt = process->invol_ctxt_swt;
+        sample.fields |= SAMPLE_STATUS;
+    }
+
+    if ((field_mask & SAMPLE_IO) && profile_refresh_io(process) == 0) {
+        sample.read_char = process->io.read_char;
+        sample.write_char = process->io.write_char;
+        sample.read_bytes = process->io.read_bytes;
+        sample.write_bytes = process->io.write_bytes;
+        sample.fields |= SAMPLE_IO;
+    }
+
+    if ((field_mask & SAMPLE_SCHEDSTAT) &&
+        profile_refresh_schedstat(process) == 0) {
+        sample.run_time = process->sched.run_time;
+        sample.run_delay = process->sched.run_delay;
+        sample.timeslices = process->sched.timeslices;
+        sample.fields |= SAMPLE_SCHEDSTAT;
+    }
+
+    // Nothing could be read, the process is gone.
+    if (!sample.fields) {
+        mark_exited(sampler, target);
+        return;
+    }
+
+    uint64_t n = target->head;
+    struct sample_slot *slot = &(target->ring[n & (SAMPLE_RING_SIZE - 1)]);
+    uint64_t seq = slot->seq;
+
+    __atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->sample = sample;
+    slot->n = n;
+
+    __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&(target->head), n + 1, __ATOMIC_RELEASE);
+
+    if (target->shm_slot > -1)
+        publish_sample(sampler, target->shm_slot, &sample);
+}
+
+static void collect_due(struct sample_worker *worker)
+{
+    sampler_t *sampler = worker->sampler;
+    uint64_t now = stats_clock();
+
+    pthread_rwlock_rdlock(&(sampler->lock));
+
+    // Pids are dealt to the workers round robin.
+    for (size_t i=worker->id; i < sampler->ntargets; i += sampler->nworkers) {
+        struct sample_target *target = sampler->targets[i];
+
+        if (target->exited || now < target->next_due)
+            continue;
+
+        // A late tick doesn't make up for the missed ones.
+        target->next_due += target->interval;
+        if (target->next_due <= now)
+            target->next_due = now + target->interval;
+
+        collect_sample(sampler, target, now);
+    }
+
+    pthread_rwlock_unlock(&(sampler->lock));
+}
+
+static void *sample_worker(void *arg)
+{
+    struct sample_worker *worker = arg;
+    sampler_t *sampler = worker->sampler;
+    struct epoll_event events[2];
+
+    for (;;) {
+        int nevents = epoll_wait(worker->epoll_fd, events, 2, -1);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        bool tick = false;
+        for (int i=0; i < nevents; i++) {
+            if (events[i].data.fd == sampler->stop_fd)
+                return NULL;
+
+            uint64_t expirations;
+            if (read(worker->timer_fd, &expirations,
+                     sizeof expirations) == sizeof expirations) {
+                if (expirations > 1)
+                    __atomic_add_fetch(&(sampler->overruns),
+                                       expirations - 1, __ATOMIC_RELAXED);
+                tick = true;
+            }
+        }
+
+        if (tick)
+            collect_due(worker);
+    }
+
+    return NULL;
+}
+
+static int init_sample_worker(sampler_t *sampler, struct sample_worker *worker,
+                              const struct itimerspec *schedule)
+{
+    worker->sampler = sampler;
+
+    worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->timer_fd < 0 || worker->epoll_fd < 0)
+        return -1;
+
+    struct epoll_event event = { .events = EPOLLIN };
+
+    event.data.fd = worker->timer_fd;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd,
+                  &event) < 0)
+        return -1;
+
+    event.data.fd = sampler->stop_fd;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sampler->stop_fd,
+                  &event) < 0)
+        return -1;
+
+    // Absolute expirations keep every worker on the same phase, and the
+    // schedule from drifting with the time spent collecting.
+    if (timerfd_settime(worker->timer_fd, TFD_TIMER_ABSTIME, schedule,
+                        NULL) < 0)
+        return -1;
+
+    if (pthread_create(&(worker->thread), NULL, sample_worker, worker))
+        return -1;
+
+    worker->started = true;
+
+    return 0;
+}
+
+sampler_t *init_sampler(uint64_t tick_ns, int nworkers)
+{
+    if (!tick_ns)
+        return NULL;
+
+    if (nworkers <= 0)
+        nworkers = 1;
+
+    sampler_t *sampler = prax_calloc(1, sizeof *sampler +
+                                     nworkers * sizeof(struct sample_worker));
+    if (!sampler)
+        return NULL;
+
+    sampler->tick = tick_ns;
+    sampler->nworkers = nworkers;
+
+    for (int i=0; i < nworkers; i++) {
+        sampler->workers[i].id = i;
+        sampler->workers[i].timer_fd = -1;
+        sampler->workers[i].epoll_fd = -1;
+    }
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(sampler->lock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    sampler->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (sampler->stop_fd < 0)
+        goto sampler_error;
+
+    uint64_t first = stats_clock() + tick_ns;
+    struct itimerspec schedule = {
+        .it_interval = {
+            .tv_sec = tick_ns / 1000000000ULL,
+            .tv_nsec = tick_ns % 1000000000ULL
+        },
+        .it_value = {
+            .tv_sec = first / 1000000000ULL,
+            .tv_nsec = first % 1000000000ULL
+        }
+    };
+
+    for (int i=0; i < nworkers; i++) {
+        if (init_sample_worker(sampler, &(sampler->workers[i]),
+                               &schedule) < 0)
+            goto sampler_error;
+    }
+
+    return sampler;
+
+sampler_error:
+    free_sampler(sampler);
+
+    return NULL;
+}
+
+// Index of the first target with a pid not below pid.
+static size_t find_target(sampler_t *sampler, pid_t pid)
+{
+    size_t low = 0, high = sampler->ntargets;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (sampler->targets[mid]->pid < pid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+int sampler_add(sampler_t *sampler, pid_t pid, int field_mask,
+                uint64_t interval_ns)
+{
+    if (!sampler || !field_mask)
+        return -1;
+
+    struct sample_target *target = prax_calloc(1, sizeof *target);
+    if (!target)
+        return -1;
+
+    // No SAMPLE_* group comes from taskstats, and a read through the
+    // /proc/<pid> descriptor fails once the process exited, so each pid
+    // holds neither a netlink socket nor a pidfd.
+    target->process = open_profile(pid, PROFILE_NO_NETLINK |
+                                        PROFILE_NO_PIDFD);
+    if (!target->process) {
+        free(target);
+        return -1;
+    }
+
+    uint64_t ticks = (interval_ns + sampler->tick - 1) / sampler->tick;
+    target->pid = pid;
+    target->field_mask = field_mask;
+    target->interval = (ticks ? ticks : 1) * sampler->tick;
+    target->shm_slot = -1;
+
+    pthread_rwlock_wrlock(&(sampler->lock));
+
+    size_t idx = find_target(sampler, pid);
+    if (idx < sampler->ntargets && sampler->targets[idx]->pid == pid) {
+        errno = EEXIST;
+        goto add_error;
+    }
+
+    if (sampler->ntargets == sampler->targets_cap) {
+        size_t cap = sampler->targets_cap ? sampler->targets_cap * 2 : 64;
+        struct sample_target **targets =
+            prax_realloc(sampler->targets, cap * sizeof *targets);
+        if (!targets)
+            goto add_error;
+        sampler->targets = targets;
+        sampler->targets_cap = cap;
+    }
+
+    memmove(&(sampler->targets[idx + 1]), &(sampler->targets[idx]),
+            (sampler->ntargets - idx) * sizeof *sampler->targets);
+    sampler->targets[idx] = target;
+    sampler->ntargets++;
+
+    assign_slot(sampler, target);
+
+    pthread_rwlock_unlock(&(sampler->lock));
+
+    return 0;
+
+add_error:
+    pthread_rwlock_unlock(&(sampler->lock));
+    free_profile(target->process);
+    free(target);
+
+    return -1;
+}
+
+int sampler_remove(sampler_t *sampler, pid_t pid)
+{
+    if (!sampler)
+        return -1;
+
+    pthread_rwlock_wrlock(&(sampler->lock));
+
+    size_t idx = find_target(sampler, pid);
+    if (idx == sampler->ntargets || sampler->targets[idx]->pid != pid) {
+        pthread_rwlock_unlock(&(sampler->lock));
+        return -1;
+    }
+
+    struct sample_target *target = sampler->targets[idx];
+
+    release_slot(sampler, target);
+
+    sampler->ntargets--;
+    memmove(&(sampler->targets[idx]), &(sampler->targets[idx + 1]),
+            (sampler->ntargets - idx) * sizeof *sampler->targets);
+
+    pthread_rwlock_unlock(&(sampler->lock));
+
+    free_profile(target->process);
+    free(target);
+
+    return 0;
+}
+
+int sampler_latest(sampler_t *sampler, pid_t pid, struct sample *samples,
+                   int max)
+{
+    if (!sampler || !samples)
+        return -1;
+
+    pthread_rwlock_rdlock(&(sampler->lock));
+
+    size_t idx = find_target(sampler, pid);
+    if (idx == sampler->ntargets || sampler->targets[idx]->pid != pid) {
+        pthread_rwlock_unlock(&(sampler->lock));
+        return -1;
+    }
+
+    struct sample_target *target = sampler->targets[idx];
+    uint64_t head = __atomic_load_n(&(target->head), __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    for (; count < max && count < SAMPLE_RING_SIZE &&
+           (uint64_t) count < head; count++) {
+        uint64_t n = head - 1 - count;
+        struct sample_slot *slot = &(target->ring[n & (SAMPLE_RING_SIZE - 1)]);
+
+        uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            break;
+
+        uint64_t slot_n = slot->n;
+        samples[count] = slot->sample;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // The collector lapped us, this and every older slot are newer
+        // samples now.
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq ||
+            slot_n != n)
+            break;
+    }
+
+    pthread_rwlock_unlock(&(sampler->lock));
+
+    return count;
+}
+
+int sampler_publish(sampler_t *sampler, const char *name, uint32_t nslots)
+{
+    if (!sampler || !name || !nslots)
+        return -1;
+
+    size_t size = sizeof(struct prax_shm_header) +
+                  (size_t) nslots * sizeof(struct prax_shm_slot);
+    size_t name_len = strlen(name);
+
+    char *path = prax_malloc(name_len + 2);
+    bool *used = prax_calloc(nslots, sizeof *used);
+    if (!path || !used)
+        goto publish_error;
+
+    path[0] = '/';
+    memcpy(path + 1, name, name_len + 1);
+
+    pthread_rwlock_wrlock(&(sampler->lock));
+
+    if (sampler->shm) {
+        errno = EBUSY;
+        goto unlock;
+    }
+
+    // A region left by another publisher may still be mapped by readers,
+    // it is never taken over.  The samples come from files that need
+    // ptrace access to the pid, so only the owner may read them.
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto unlock;
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(path);
+        goto unlock;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(path);
+        goto unlock;
+    }
+
+    struct prax_shm_header *header = map;
+    header->version = PRAX_SHM_VERSION;
+    header->header_size = sizeof *header;
+    header->slot_size = sizeof(struct prax_shm_slot);
+    header->nslots = nslots;
+    header->tick_ns = sampler->tick;
+    // Readers check the magic first, it goes in last.
+    __atomic_store_n(&(header->magic), PRAX_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    sampler->shm = header;
+    sampler->shm_slots = (struct prax_shm_slot *) (header + 1);
+    sampler->shm_size = size;
+    sampler->shm_name = path;
+    sampler->shm_used = used;
+
+    for (size_t i=0; i < sampler->ntargets; i++)
+        assign_slot(sampler, sampler->targets[i]);
+
+    pthread_rwlock_unlock(&(sampler->lock));
+
+    return 0;
+
+unlock:
+    pthread_rwlock_unlock(&(sampler->lock));
+
+publish_error:
+    free(path);
+    free(used);
+
+    return -1;
+}
+
+uint64_t sampler_overruns(sampler_t *sampler)
+{
+    return sampler ? __atomic_load_n(&(sampler->overruns), __ATOMIC_RELAXED) :
+                     0;
+}
+
+void free_sampler(sampler_t *sampler)
+{
+    if (!sampler)
+        return;
+
+    if (sampler->stop_fd > -1)
+        eventfd_write(sampler->stop_fd, 1);
+
+    for (int i=0; i < sampler->nworkers; i++) {
+        struct sample_worker *worker = &(sampler->workers[i]);
+
+        if (worker->started)
+            pthread_join(worker->thread, NULL);
+        if (worker->timer_fd > -1)
+            close(worker->timer_fd);
+        if (worker->epoll_fd > -1)
+            close(worker->epoll_fd);
+    }
+
+    if (sampler->stop_fd > -1)
+        close(sampler->stop_fd);
+
+    for (size_t i=0; i < sampler->ntargets; i++) {
+        free_profile(sampler->targets[i]->process);
+        free(sampler->targets[i]);
+    }
+
+    if (sampler->shm) {
+        munmap(sampler->shm, sampler->shm_size);
+        shm_unlink(sampler->shm_name);
+    }
+
+    pthread_rwlock_destroy(&(sampler->lock));
+
+    free(sampler->shm_name);
+    free(sampler->shm_used);
+    free(sampler->targets);
+    free(sampler);
+}
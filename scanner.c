@@ -0,0 +1,556 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+// Pids handed to a worker per grab of the shared cursor.
+#define SCAN_CHUNK 32
+
+// Files in flight per io_uring submission, each is an openat, read and
+// files update chain on its own fixed file slot.
+#define SCAN_URING_SLOTS 256
+
+enum {
+    URING_OPEN,
+    URING_READ,
+    URING_RELEASE
+};
+
+// Files update argument emptying a fixed file slot.
+static const int empty_slot = -1;
+
+struct uring_slot {
+    struct proc_record *record;
+    int flag;
+    int err;
+    char path[32];
+};
+
+struct scan_worker {
+    scanner_t *scanner;
+    pthread_t thread;
+    bool started;
+    char *buf;
+    bool uring;
+    struct uring ring;
+    struct uring_slot *slots;
+    char *uring_bufs;
+};
+
+struct scanner {
+    int nworkers;
+    int proc_fd;
+    pid_t *pids;
+    size_t pids_cap;
+    size_t npids;
+    struct proc_record *records;
+    size_t records_cap;
+    int field_mask;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    int running;
+    bool stop;
+    struct scan_worker workers[];
+};
+
+#define RECORD_FIELD(key, type, member)                                   \
+    PROCFS_FIELD(struct proc_record, key, type, member)
+
+static const struct procfs_field record_status_fields[] = {
+    RECORD_FIELD("Uid", FIELD_DEC, uid),
+    RECORD_FIELD("Gid", FIELD_DEC, gid),
+    RECORD_FIELD("voluntary_ctxt_switches", FIELD_DEC, vol_ctxt_swt),
+    RECORD_FIELD("nonvoluntary_ctxt_switches", FIELD_DEC, invol_ctxt_swt)
+};
+
+static const struct procfs_field record_io_fields[] = {
+    RECORD_FIELD("rchar", FIELD_DEC, read_char),
+    RECORD_FIELD("wchar", FIELD_DEC, write_char),
+    RECORD_FIELD("read_bytes", FIELD_DEC, read_bytes),
+    RECORD_FIELD("write_bytes", FIELD_DEC, write_bytes)
+};
+
+static int parse_record_stat(struct proc_record *record, char *buf)
+{
+    struct proc_stat stat;
+
+    if (parse_proc_stat(buf, &stat) < 0)
+        return -1;
+
+    memcpy(record->comm, stat.comm, sizeof record->comm - 1);
+    record->state = stat.state;
+    record->ppid = stat.ppid;
+    record->utime = stat.utime;
+    record->stime = stat.stime;
+    record->nice = stat.nice;
+    record->num_threads = stat.num_threads;
+    record->start_time = stat.starttime;
+    record->vsize = stat.vsize;
+    record->rss = stat.rss;
+    record->processor = stat.processor;
+
+    return 0;
+}
+
+static const struct {
+    int flag;
+    const char *file;
+} scan_files[] = {
+    { SCAN_STAT, STAT },
+    { SCAN_STATUS, STATUS },
+    { SCAN_IO, IO },
+    { SCAN_LIMITS, LIMITS }
+};
+
+// Whether failing to read one of the scan_files means the process is gone.
+// io needs ptrace access to the process, it is skipped when refused.
+static bool scan_file_gone(int flag, int err)
+{
+    return flag == SCAN_STAT || err == ENOENT || err == ESRCH;
+}
+
+static void parse_scan_file(struct proc_record *record, int flag, char *buf)
+{
+    switch (flag) {
+        case (SCAN_STAT):
+            if (parse_record_stat(record, buf) < 0)
+                return;
+            break;
+        case (SCAN_STATUS):
+            parse_procfs_fields(buf, record_status_fields,
+                                NFIELDS(record_status_fields), record);
+            break;
+        case (SCAN_IO):
+            parse_procfs_fields(buf, record_io_fields,
+                                NFIELDS(record_io_fields), record);
+            break;
+        case (SCAN_LIMITS):
+            if (parse_proc_limits(buf, record->rlimits) < RLIM_NLIMITS)
+                return;
+            break;
+    }
+
+    record->fields |= flag;
+}
+
+// Returns -1 only when the process is gone.
+static int collect_record(struct scan_worker *worker, pid_t pid,
+                          struct proc_record *record)
+{
+    scanner_t *scanner = worker->scanner;
+    char path[32];
+
+    memset(record, 0, sizeof *record);
+    record->pid = pid;
+
+    for (size_t i=0; i < NFIELDS(scan_files); i++) {
+        int flag = scan_files[i].flag;
+        if (!(scanner->field_mask & flag))
+            continue;
+
+        if (read_procfs_at(scanner->proc_fd,
+                           pid_path(path, pid, scan_files[i].file),
+                           worker->buf, STATUS_SIZE) < 0) {
+            if (scan_file_gone(flag, errno))
+                return -1;
+            continue;
+        }
+
+        parse_scan_file(record, flag, worker->buf);
+    }
+
+    return 0;
+}
+
+static void collect_records(struct scan_worker *worker, size_t first,
+                            size_t last)
+{
+    scanner_t *scanner = worker->scanner;
+
+    for (size_t i=first; i < last; i++) {
+        struct proc_record *record = &(scanner->records[i]);
+        if (collect_record(worker, scanner->pids[i], record) < 0)
+            record->pid = 0;
+    }
+}
+
+static void queue_file(struct scan_worker *worker, unsigned slot_index)
+{
+    struct uring_slot *slot = &(worker->slots[slot_index]);
+    struct io_uring_sqe *sqe;
+
+    // Open into a fixed slot, read and empty it again as one linked chain.
+    // A failed open cancels the rest, the read is hard linked as procfs
+    // reads are short and a short read would cancel the release.  The slot
+    // is emptied with a files update rather than a close, whose fd field
+    // would name a real descriptor wherever file_index were ignored.
+    sqe = uring_get_sqe(&(worker->ring));
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = worker->scanner->proc_fd;
+    sqe->addr = (uintptr_t) slot->path;
+    // Fixed files are never inherited, O_CLOEXEC is refused with them.
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot_index + 1;
+    sqe->user_data = (uint64_t) slot_index << 2 | URING_OPEN;
+
+    sqe = uring_get_sqe(&(worker->ring));
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd = slot_index;
+    sqe->addr = (uintptr_t) (worker->uring_bufs + slot_index * STATUS_SIZE);
+    sqe->len = STATUS_SIZE - 1;
+    sqe->user_data = (uint64_t) slot_index << 2 | URING_READ;
+
+    sqe = uring_get_sqe(&(worker->ring));
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->addr = (uintptr_t) &empty_slot;
+    sqe->len = 1;
+    sqe->off = slot_index;
+    sqe->user_data = (uint64_t) slot_index << 2 | URING_RELEASE;
+}
+
+// Returns -1 when the ring cannot be used, the fixed file slots included.
+static int reap_file(struct scan_worker *worker, struct io_uring_cqe *cqe)
+{
+    struct uring_slot *slot = &(worker->slots[cqe->user_data >> 2]);
+    int res = cqe->res;
+
+    switch (cqe->user_data & 3) {
+        case (URING_OPEN):
+            // init_uring checked file_index is honoured, a plain fd would
+            // mean it was not after all.
+            if (res > 0) {
+                close(res);
+                return -1;
+            }
+            if (res < 0)
+                slot->err = -res;
+            else
+                STATS_ADD(files_opened, 1);
+            break;
+        case (URING_READ):
+            if (res < 0) {
+                if (!slot->err)
+                    slot->err = -res;
+                break;
+            }
+            char *buf = worker->uring_bufs +
+                        (slot - worker->slots) * STATUS_SIZE;
+            buf[res] = '\0';
+            STATS_ADD(bytes_read, res);
+            parse_scan_file(slot->record, slot->flag, buf);
+            break;
+    }
+
+    return 0;
+}
+
+// Queues every file of pids first to last in one submission and parses the
+// reads as they complete.
+static int collect_batch(struct scan_worker *worker, size_t first,
+                         size_t last)
+{
+    scanner_t *scanner = worker->scanner;
+    unsigned nslots = 0;
+
+    for (size_t i=first; i < last; i++) {
+        struct proc_record *record = &(scanner->records[i]);
+
+        memset(record, 0, sizeof *record);
+        record->pid = scanner->pids[i];
+
+        for (size_t j=0; j < NFIELDS(scan_files); j++) {
+            if (!(scanner->field_mask & scan_files[j].flag))
+                continue;
+
+            struct uring_slot *slot = &(worker->slots[nslots]);
+            slot->record = record;
+            slot->flag = scan_files[j].flag;
+            slot->err = 0;
+            pid_path(slot->path, record->pid, scan_files[j].file);
+            queue_file(worker, nslots++);
+        }
+    }
+
+    unsigned outstanding = nslots * 3;
+    int ret = 0;
+
+    // On failure the caller quiesces the ring before reusing the slots.
+    if (uring_submit(&(worker->ring), outstanding) < 0)
+        return -1;
+
+    while (outstanding) {
+        struct io_uring_cqe *cqe;
+
+        while ((cqe = uring_peek_cqe(&(worker->ring)))) {
+            if (reap_file(worker, cqe) < 0)
+                ret = -1;
+            uring_cqe_seen(&(worker->ring));
+            outstanding--;
+        }
+
+        if (outstanding && uring_submit(&(worker->ring), 1) < 0)
+            return -1;
+    }
+
+    if (ret < 0)
+        return -1;
+
+    for (unsigned i=0; i < nslots; i++) {
+        struct uring_slot *slot = &(worker->slots[i]);
+        if (slot->err && scan_file_gone(slot->flag, slot->err))
+            slot->record->pid = 0;
+    }
+
+    return 0;
+}
+
+static void free_worker_uring(struct scan_worker *worker)
+{
+    // Sqes still in flight point into slots and uring_bufs, when they
+    // cannot be waited out the ring and buffers are left to the kernel.
+    if (worker->uring && uring_quiesce(&(worker->ring)) < 0) {
+        worker->slots = NULL;
+        worker->uring_bufs = NULL;
+        worker->uring = false;
+        return;
+    }
+
+    if (worker->uring)
+        free_uring(&(worker->ring));
+
+    free(worker->slots);
+    free(worker->uring_bufs);
+    worker->slots = NULL;
+    worker->uring_bufs = NULL;
+    worker->uring = false;
+}
+
+static void scan_chunks(struct scan_worker *worker)
+{
+    scanner_t *scanner = worker->scanner;
+    size_t npids = scanner->npids;
+    size_t chunk = SCAN_CHUNK;
+
+    if (worker->uring) {
+        int nfiles = 0;
+        for (size_t i=0; i < NFIELDS(scan_files); i++)
+            nfiles += !!(scanner->field_mask & scan_files[i].flag);
+        if (nfiles)
+            chunk = SCAN_URING_SLOTS / nfiles;
+    }
+
+    for (;;) {
+        size_t first = __atomic_fetch_add(&(scanner->next), chunk,
+                                          __ATOMIC_RELAXED);
+        if (first >= npids)
+            break;
+
+        size_t last = first + chunk < npids ? first + chunk : npids;
+
+        if (worker->uring && collect_batch(worker, first, last) == 0)
+            continue;
+
+        // The ring failed, this worker stays synchronous from now on.
+        if (worker->uring)
+            free_worker_uring(worker);
+
+        collect_records(worker, first, last);
+    }
+}
+
+static void *scan_worker(void *arg)
+{
+    struct scan_worker *worker = arg;
+    scanner_t *scanner = worker->scanner;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&(scanner->lock));
+
+    for (;;) {
+        while (scanner->generation == seen && !scanner->stop)
+            pthread_cond_wait(&(scanner->start), &(scanner->lock));
+
+        if (scanner->stop)
+            break;
+
+        seen = scanner->generation;
+        pthread_mutex_unlock(&(scanner->lock));
+
+        scan_chunks(worker);
+
+        pthread_mutex_lock(&(scanner->lock));
+        if (--scanner->running == 0)
+            pthread_cond_signal(&(scanner->done));
+    }
+
+    pthread_mutex_unlock(&(scanner->lock));
+
+    return NULL;
+}
+
+scanner_t *init_scanner(int nworkers)
+{
+    if (nworkers <= 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0)
+        nworkers = 1;
+
+    scanner_t *scanner = prax_calloc(1, sizeof *scanner +
+                                     nworkers * sizeof(struct scan_worker));
+    if (!scanner)
+        return NULL;
+
+    scanner->nworkers = nworkers;
+    scanner->proc_fd = -1;
+    pthread_mutex_init(&(scanner->lock), NULL);
+    pthread_cond_init(&(scanner->start), NULL);
+    pthread_cond_init(&(scanner->done), NULL);
+
+    scanner->proc_fd = prax_openat(AT_FDCWD, PROC,
+                                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scanner->proc_fd < 0)
+        goto scanner_error;
+
+    for (int i=0; i < nworkers; i++) {
+        struct scan_worker *worker = &(scanner->workers[i]);
+        worker->scanner = scanner;
+        if (!(worker->buf = prax_malloc(STATUS_SIZE)))
+            goto scanner_error;
+    }
+
+    // Worker 0 is the thread calling scan_processes.
+    for (int i=1; i < nworkers; i++) {
+        struct scan_worker *worker = &(scanner->workers[i]);
+        if (pthread_create(&(worker->thread), NULL, scan_worker, worker))
+            goto scanner_error;
+        worker->started = true;
+    }
+
+    return scanner;
+
+scanner_error:
+    free_scanner(scanner);
+
+    return NULL;
+}
+
+int scanner_enable_uring(scanner_t *scanner)
+{
+    if (!scanner)
+        return -1;
+
+    for (int i=0; i < scanner->nworkers; i++) {
+        struct scan_worker *worker = &(scanner->workers[i]);
+        if (worker->uring)
+            continue;
+
+        worker->slots = prax_calloc(SCAN_URING_SLOTS, sizeof *worker->slots);
+        worker->uring_bufs = prax_malloc(SCAN_URING_SLOTS * STATUS_SIZE);
+        if (!worker->slots || !worker->uring_bufs ||
+            init_uring(&(worker->ring), SCAN_URING_SLOTS * 3,
+                       SCAN_URING_SLOTS) < 0)
+            goto uring_error;
+
+        worker->uring = true;
+    }
+
+    return 0;
+
+uring_error:
+    for (int i=0; i < scanner->nworkers; i++)
+        free_worker_uring(&(scanner->workers[i]));
+
+    return -1;
+}
+
+int scan_processes(scanner_t *scanner, int field_mask,
+                   struct proc_record **records)
+{
+    STATS_TIMED(STATS_SCAN_PROCESSES);
+
+    if (!scanner || !records)
+        return -1;
+
+    int npids = list_numeric_dir(scanner->proc_fd, &(scanner->pids),
+                                 &(scanner->pids_cap));
+    if (npids < 0)
+        return -1;
+
+    if (npids > scanner->records_cap) {
+        struct proc_record *new_records =
+            prax_realloc(scanner->records, npids * sizeof *new_records);
+        if (!new_records)
+            return -1;
+        scanner->records = new_records;
+        scanner->records_cap = npids;
+    }
+
+    pthread_mutex_lock(&(scanner->lock));
+    scanner->npids = npids;
+    scanner->field_mask = field_mask;
+    scanner->next = 0;
+    scanner->running = scanner->nworkers - 1;
+    scanner->generation++;
+    pthread_cond_broadcast(&(scanner->start));
+    pthread_mutex_unlock(&(scanner->lock));
+
+    scan_chunks(&(scanner->workers[0]));
+
+    pthread_mutex_lock(&(scanner->lock));
+    while (scanner->running)
+        pthread_cond_wait(&(scanner->done), &(scanner->lock));
+    pthread_mutex_unlock(&(scanner->lock));
+
+    // Drop the processes that exited between the listing and the read.
+    int count = 0;
+    for (int i=0; i < npids; i++) {
+        if (!scanner->records[i].pid)
+            continue;
+        if (count != i)
+            scanner->records[count] = scanner->records[i];
+        count++;
+    }
+
+    *records = scanner->records;
+
+    return count;
+}
+
+void free_scanner(scanner_t *scanner)
+{
+    if (!scanner)
+        return;
+
+    pthread_mutex_lock(&(scanner->lock));
+    scanner->stop = true;
+    pthread_cond_broadcast(&(scanner->start));
+    pthread_mutex_unlock(&(scanner->lock));
+
+    for (int i=0; i < scanner->nworkers; i++) {
+        struct scan_worker *worker = &(scanner->workers[i]);
+        if (worker->started)
+            pthread_join(worker->thread, NULL);
+        free(worker->buf);
+        free_worker_uring(worker);
+    }
+
+    if (scanner->proc_fd > -1)
+        close(scanner->proc_fd);
+
+    pthread_mutex_destroy(&(scanner->lock));
+    pthread_cond_destroy(&(scanner->start));
+    pthread_cond_destroy(&(scanner->done));
+
+    free(scanner->pids);
+    free(scanner->records);
+    free(scanner);
+}
@@ -0,0 +1,138 @@
+#include "prax_internal.h"
+
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+struct stats_slot {
+    struct prax_stats stats;
+    struct stats_slot *next;
+};
+
+static const char *accessor_names[STATS_NACCESSORS] = {
+    [STATS_INIT_PROFILE] = "init_profile",
+    [STATS_REFRESH_STAT] = "profile_refresh_stat",
+    [STATS_REFRESH_STATUS] = "profile_refresh_status",
+    [STATS_REFRESH_IO] = "profile_refresh_io",
+    [STATS_REFRESH_SCHEDSTAT] = "profile_refresh_schedstat",
+    [STATS_REFRESH_TASKSTATS] = "profile_refresh_taskstats",
+    [STATS_TASKSTATS_BATCH] = "taskstats_batch_get",
+    [STATS_PID_NAME] = "pid_name",
+    [STATS_RLIMITS] = "get_rlimits",
+    [STATS_RUNNING_THREADS] = "running_threads",
+    [STATS_THREAD_STATS] = "process_thread_stats",
+    [STATS_FD_STATS] = "process_fd_stats",
+    [STATS_FD_REFRESH] = "process_fd_refresh",
+    [STATS_SCAN_PROCESSES] = "scan_processes",
+    [STATS_REFRESH_STATM] = "profile_refresh_statm",
+    [STATS_REFRESH_MEMORY] = "profile_refresh_memory",
+    [STATS_SMAPS] = "process_smaps",
+    [STATS_REFRESH_LIMITS] = "profile_refresh_limits",
+    [STATS_CONTROL] = "control_set",
+    [STATS_REFRESH_NUMA] = "profile_refresh_numa"
+};
+
+// The lock only guards the slot list, taken on thread start, exit and read.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct stats_slot *slots;
+// Counts of the threads that already exited.
+static struct prax_stats retired;
+
+static __thread struct stats_slot *local;
+
+#define STATS_WORDS (sizeof(struct prax_stats) / sizeof(uint64_t))
+
+static void add_stats(struct prax_stats *dst, struct prax_stats *src)
+{
+    uint64_t *to = (uint64_t *) dst;
+    uint64_t *from = (uint64_t *) src;
+
+    for (size_t i=0; i < STATS_WORDS; i++)
+        to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static void retire_slot(void *arg)
+{
+    struct stats_slot *slot = arg;
+
+    pthread_mutex_lock(&stats_lock);
+
+    add_stats(&retired, &(slot->stats));
+
+    struct stats_slot **link = &slots;
+    for (; *link && *link != slot; link = &((*link)->next))
+        ;
+    if (*link)
+        *link = slot->next;
+
+    pthread_mutex_unlock(&stats_lock);
+
+    local = NULL;
+    free(slot);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&stats_key, retire_slot);
+}
+
+struct prax_stats *stats_local(void)
+{
+    if (local)
+        return &(local->stats);
+
+    pthread_once(&stats_once, create_key);
+
+    struct stats_slot *slot = calloc(1, sizeof *slot);
+    if (!slot)
+        return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, slot);
+    local = slot;
+
+    return &(slot->stats);
+}
+
+uint64_t stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_timer_end(struct stats_timer *timer)
+{
+    uint64_t elapsed = stats_clock() - timer->start;
+
+    STATS_ADD(calls[timer->accessor], 1);
+    STATS_ADD(ns[timer->accessor], elapsed);
+}
+
+void prax_get_stats(struct prax_stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+
+    pthread_mutex_lock(&stats_lock);
+
+    add_stats(stats, &retired);
+    for (struct stats_slot *slot=slots; slot; slot = slot->next)
+        add_stats(stats, &(slot->stats));
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+const char *prax_accessor_name(int accessor)
+{
+    if (accessor < 0 || accessor >= STATS_NACCESSORS)
+        return NULL;
+
+    return accessor_names[accessor];
+}
@@ -0,0 +1,370 @@
+#include "prax_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+
+void *parse_taskmsg(int req, struct taskmsg *msg)
+{
+    int msglength = msg->nl.nlmsg_len;
+
+    msglength -= (NLMSG_HDRLEN + GENL_HDRLEN);
+    struct nlattr *nla = GENLMSG_DATA(msg->gnl);
+    int nla_msg_len = 0;
+
+    while (msglength >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN) {
+        if (nla->nla_type == req)
+            return (void *) ((char *) nla + NLA_HDRLEN);
+        else if (nla->nla_type == TASKSTATS_TYPE_AGGR_PID ||
+                 nla->nla_type == TASKSTATS_TYPE_AGGR_TGID)
+            nla_msg_len = NLA_HDRLEN;
+        else
+            nla_msg_len = NLA_ALIGN(nla->nla_len);
+
+        msglength -= nla_msg_len;
+        nla = (struct nlattr *) ((char *) nla + nla_msg_len);        
+    }
+
+    return NULL;
+}
+
+int create_nl_conn(void)
+{
+    int nl_conn = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+
+    if (nl_conn < 0)
+        return -1;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof addr);
+
+    addr.nl_family = AF_NETLINK;
+
+    if (bind(nl_conn, (struct sockaddr *) &addr, sizeof addr) < 0) {
+        close(nl_conn);
+        return -1;
+    }
+
+    return nl_conn;
+}
+
+int send_nl_req(int conn, void *buf, int msglength)
+{
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+
+    char *msg_buffer = (char *) buf;
+
+    int nmsgs = 0;
+    struct nlmsghdr *nlh = buf;
+    for (int len=msglength; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+        nmsgs++;
+
+    while (msglength > 0) {
+        int bytes_sent = sendto(conn, msg_buffer, msglength, 0,
+                            (struct sockaddr *) &addr, sizeof addr);
+        if (bytes_sent < 0)
+            return -1;
+        msglength -= bytes_sent;
+        msg_buffer += bytes_sent;
+    }
+
+    STATS_ADD(nl_sent, nmsgs);
+
+    return 0;
+}
+ 
+static int recv_nl_req(int conn, struct taskmsg *msg)
+{
+    int bytes_recv = recv(conn, msg, sizeof *msg, 0);
+
+    if (bytes_recv < 0)
+        return -1;
+
+    STATS_ADD(nl_received, 1);
+
+    return 0;
+}
+
+void *make_nl_req(int req, int nl_conn, int family_id, pid_t pid, 
+                  struct taskmsg *msg)
+{
+    int data_len;
+
+    memset(msg, 0, sizeof *msg);
+
+    switch (req) {
+
+        case (CTRL_CMD_GETFAMILY):
+            data_len = strlen(TASKSTATS_GENL_NAME) + 1;
+            build_req(msg, GENL_ID_CTRL, req, CTRL_ATTR_FAMILY_NAME,
+                       data_len, TASKSTATS_GENL_NAME);
+            break;
+        case (TASKSTATS_CMD_GET):
+            build_req(msg, family_id, req,
+                TASKSTATS_CMD_ATTR_PID, sizeof(int), &pid);
+            break;
+    }
+
+    if (send_nl_req(nl_conn, msg, msg->nl.nlmsg_len) < 0)
+        return NULL;
+    
+    if (recv_nl_req(nl_conn, msg) < 0)
+        return NULL;
+
+    if (msg->nl.nlmsg_type == NLMSG_ERROR)
+        return NULL;
+
+    if (req == TASKSTATS_CMD_GET)
+        return parse_taskmsg(TASKSTATS_TYPE_STATS, msg);
+    else if (req == CTRL_CMD_GETFAMILY)
+        return parse_taskmsg(CTRL_ATTR_FAMILY_ID, msg);
+
+    return NULL;
+}
+
+int get_nl_family_id(int nl_conn)
+{
+    struct taskmsg msg;
+    void *family_id = make_nl_req(CTRL_CMD_GETFAMILY, nl_conn, 0, 0, &msg);
+
+    if (family_id)
+        return *(uint16_t *) family_id;
+
+    return -1;
+}
+
+void copy_taskstats(struct taskstats *dst, void *nla_data)
+{
+    struct nlattr *nla = (struct nlattr *) ((char *) nla_data - NLA_HDRLEN);
+    size_t len = nla->nla_len - NLA_HDRLEN;
+
+    if (len > sizeof *dst)
+        len = sizeof *dst;
+
+    memset(dst, 0, sizeof *dst);
+    memcpy(dst, nla_data, len);
+}
+
+#define BATCH_REQ_LEN NLMSG_ALIGN(NLMSG_HDRLEN + GENL_HDRLEN + \
+                                NLA_HDRLEN + sizeof(uint32_t))
+#define BATCH_RECV_VLEN 64
+#define BATCH_RECV_SIZE 2048
+
+enum {
+    BATCH_UNSENT,
+    BATCH_INFLIGHT,
+    BATCH_DONE
+};
+
+struct taskstats_batch {
+    int nl_conn;
+    int nl_family_id;
+    uint32_t seq;
+    size_t window;
+    char *send_buf;
+    char *recv_buf;
+    uint8_t *state;
+    size_t state_len;
+    struct iovec recv_iov[BATCH_RECV_VLEN];
+    struct mmsghdr recv_msgs[BATCH_RECV_VLEN];
+};
+
+taskstats_batch_t *init_taskstats_batch(size_t window)
+{
+    taskstats_batch_t *batch = prax_calloc(1, sizeof *batch);
+    if (!batch)
+        return NULL;
+
+    batch->window = window ? window : TASKSTATS_BATCH_WINDOW;
+    batch->nl_conn = create_nl_conn();
+    if (batch->nl_conn < 0)
+        goto batch_error;
+
+    batch->nl_family_id = get_nl_family_id(batch->nl_conn);
+    if (batch->nl_family_id < 0)
+        goto batch_error;
+
+    // Every in flight reply is queued on the socket until it is drained.
+    int rcvbuf = batch->window * BATCH_RECV_SIZE;
+    if (setsockopt(batch->nl_conn, SOL_SOCKET, SO_RCVBUFFORCE, 
+                   &rcvbuf, sizeof rcvbuf) < 0)
+        setsockopt(batch->nl_conn, SOL_SOCKET, SO_RCVBUF, 
+                   &rcvbuf, sizeof rcvbuf);
+
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(batch->nl_conn, SOL_SOCKET, SO_RCVTIMEO, 
+               &timeout, sizeof timeout);
+
+    batch->send_buf = prax_calloc(batch->window, BATCH_REQ_LEN);
+    batch->recv_buf = prax_malloc(BATCH_RECV_VLEN * BATCH_RECV_SIZE);
+    if (!batch->send_buf || !batch->recv_buf)
+        goto batch_error;
+
+    for (int i=0; i < BATCH_RECV_VLEN; i++) {
+        batch->recv_iov[i].iov_base = batch->recv_buf + i * BATCH_RECV_SIZE;
+        batch->recv_iov[i].iov_len = BATCH_RECV_SIZE;
+        batch->recv_msgs[i].msg_hdr.msg_iov = &(batch->recv_iov[i]);
+        batch->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return batch;
+
+batch_error:
+    free_taskstats_batch(batch);
+
+    return NULL;
+}
+
+void free_taskstats_batch(taskstats_batch_t *batch)
+{
+    if (!batch)
+        return;
+
+    if (batch->nl_conn > -1)
+        close(batch->nl_conn);
+
+    free(batch->send_buf);
+    free(batch->recv_buf);
+    free(batch->state);
+    free(batch);
+}
+
+static int batch_reply(taskstats_batch_t *batch, struct nlmsghdr *nlh,
+                       uint32_t base, size_t npids, 
+                       struct taskstats *stats, int *errs)
+{
+    size_t idx = nlh->nlmsg_seq - base;
+
+    // Replies from a range that was given up on after ENOBUFS land here.
+    if (idx >= npids || batch->state[idx] != BATCH_INFLIGHT)
+        return -1;
+
+    int err = 0;
+
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *nl_err = NLMSG_DATA(nlh);
+        err = nl_err->error ? -nl_err->error : EPROTO;
+    } else {
+        void *data = parse_taskmsg(TASKSTATS_TYPE_STATS, 
+                                   (struct taskmsg *) nlh);
+        if (data)
+            copy_taskstats(&stats[idx], data);
+        else
+            err = EPROTO;
+    }
+
+    if (errs)
+        errs[idx] = err;
+
+    batch->state[idx] = BATCH_DONE;
+
+    return err;
+}
+
+int taskstats_batch_get(taskstats_batch_t *batch, const pid_t *pids, 
+                        size_t npids, struct taskstats *stats, int *errs)
+{
+    STATS_TIMED(STATS_TASKSTATS_BATCH);
+
+    if (!batch || !pids || !stats)
+        return -1;
+
+    if (npids > batch->state_len) {
+        uint8_t *state = prax_realloc(batch->state, npids);
+        if (!state)
+            return -1;
+        batch->state = state;
+        batch->state_len = npids;
+    }
+
+    memset(batch->state, BATCH_UNSENT, npids);
+
+    uint32_t base = batch->seq;
+    batch->seq += npids;
+
+    size_t next = 0, inflight = 0, done = 0, filled = 0;
+    size_t window = batch->window;
+
+    while (done < npids) {
+        // Requests are packed back to back into a single datagram.
+        char *msg_buffer = batch->send_buf;
+        size_t queued = 0;
+
+        for (; next < npids && inflight + queued < window; next++) {
+            if (batch->state[next] != BATCH_UNSENT)
+                continue;
+
+            struct taskmsg *msg = (struct taskmsg *) msg_buffer;
+            build_req(msg, batch->nl_family_id, TASKSTATS_CMD_GET,
+                      TASKSTATS_CMD_ATTR_PID, sizeof(uint32_t), 
+                      (void *) &pids[next]);
+            msg->nl.nlmsg_seq = base + next;
+            batch->state[next] = BATCH_INFLIGHT;
+            msg_buffer += BATCH_REQ_LEN;
+            queued++;
+        }
+
+        if (queued && send_nl_req(batch->nl_conn, batch->send_buf, 
+                                  queued * BATCH_REQ_LEN) < 0)
+            return -1;
+
+        inflight += queued;
+
+        int nrecv = recvmmsg(batch->nl_conn, batch->recv_msgs, 
+                             BATCH_RECV_VLEN, MSG_WAITFORONE, NULL);
+
+        if (nrecv < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == ENOBUFS) {
+                // Replies were dropped, resend what is outstanding under a
+                // fresh sequence range with a smaller window.
+                for (size_t i=0; i < npids; i++) {
+                    if (batch->state[i] == BATCH_INFLIGHT)
+                        batch->state[i] = BATCH_UNSENT;
+                }
+                base = batch->seq;
+                batch->seq += npids;
+                next = inflight = 0;
+                if (window > 1)
+                    window /= 2;
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                for (size_t i=0; errs && i < npids; i++) {
+                    if (batch->state[i] != BATCH_DONE)
+                        errs[i] = ETIMEDOUT;
+                }
+                break;
+            }
+
+            return -1;
+        }
+
+        for (int i=0; i < nrecv; i++) {
+            struct nlmsghdr *nlh = batch->recv_iov[i].iov_base;
+            int len = batch->recv_msgs[i].msg_len;
+
+            for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                STATS_ADD(nl_received, 1);
+                int err = batch_reply(batch, nlh, base, npids, stats, errs);
+                if (err < 0)
+                    continue;
+                if (!err)
+                    filled++;
+                inflight--;
+                done++;
+            }
+        }
+    }
+
+    return filled;
+}
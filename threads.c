@@ -0,0 +1,181 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+#define THREAD_FIELD(key, type, member)                                   \
+    PROCFS_FIELD(struct thread_stat, key, type, member)
+
+static const struct procfs_field thread_status_fields[] = {
+    THREAD_FIELD("voluntary_ctxt_switches", FIELD_DEC, nvcsw),
+    THREAD_FIELD("nonvoluntary_ctxt_switches", FIELD_DEC, nivcsw)
+};
+
+struct thread_worker {
+    profile_t *process;
+    int task_fd;
+    size_t first;
+    size_t last;
+    pthread_t thread;
+};
+
+// Returns -1 when the thread exited before its stat was read.
+static int collect_thread(int task_fd, pid_t tid, struct thread_stat *thread,
+                          char *buf)
+{
+    char path[64];
+    struct proc_stat stat;
+
+    memset(thread, 0, sizeof *thread);
+    thread->tid = tid;
+
+    if (read_procfs_at(task_fd, pid_path(path, tid, STAT), buf,
+                       STATUS_SIZE) < 0)
+        return -1;
+
+    if (parse_proc_stat(buf, &stat) < 0)
+        return -1;
+
+    memcpy(thread->comm, stat.comm, sizeof thread->comm - 1);
+    thread->state = stat.state;
+    thread->utime = stat.utime;
+    thread->stime = stat.stime;
+    thread->last_cpu = stat.processor;
+
+    if (read_procfs_at(task_fd, pid_path(path, tid, STATUS), buf,
+                       STATUS_SIZE) >= 0)
+        parse_procfs_fields(buf, thread_status_fields,
+                            NFIELDS(thread_status_fields), thread);
+
+    // schedstat is "run_time run_delay timeslices", absent without
+    // CONFIG_SCHED_INFO.
+    if (read_procfs_at(task_fd, pid_path(path, tid, SCHEDSTAT), buf,
+                       STATUS_SIZE) >= 0) {
+        char *field = scan_dec(buf, &(thread->run_time));
+        field = scan_dec(field, &(thread->run_delay));
+        scan_dec(field, &(thread->timeslices));
+    }
+
+    return 0;
+}
+
+static void *collect_threads(void *arg)
+{
+    struct thread_worker *worker = arg;
+    struct thread_table *table = &(worker->process->tasks);
+    char buf[STATUS_SIZE];
+
+    for (size_t i=worker->first; i < worker->last; i++) {
+        if (collect_thread(worker->task_fd, table->listing[i],
+                           &(table->threads[i]), buf) < 0)
+            table->threads[i].tid = 0;
+    }
+
+    return NULL;
+}
+
+// Splits the listing into contiguous shares, one per worker thread.
+static void fan_out(profile_t *process, int task_fd, int ntasks, int nworkers)
+{
+    if (ntasks <= THREAD_FANOUT)
+        nworkers = 1;
+    else if (nworkers <= 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > ntasks / (THREAD_FANOUT / 4))
+        nworkers = ntasks / (THREAD_FANOUT / 4);
+    if (nworkers < 1)
+        nworkers = 1;
+
+    struct thread_worker workers[nworkers];
+    size_t per_worker = (ntasks + nworkers - 1) / nworkers;
+
+    for (int i=0; i < nworkers; i++) {
+        workers[i].process = process;
+        workers[i].task_fd = task_fd;
+        workers[i].first = i * per_worker;
+        workers[i].last = (i + 1) * per_worker;
+        if (workers[i].last > ntasks)
+            workers[i].last = ntasks;
+    }
+
+    // The calling thread takes the first share, and the share of any
+    // worker that could not be started.
+    for (int i=1; i < nworkers; i++) {
+        if (pthread_create(&(workers[i].thread), NULL, collect_threads,
+                           &workers[i]))
+            workers[i].task_fd = -1;
+    }
+
+    collect_threads(&workers[0]);
+
+    for (int i=1; i < nworkers; i++) {
+        if (workers[i].task_fd < 0) {
+            workers[i].task_fd = task_fd;
+            collect_threads(&workers[i]);
+        } else
+            pthread_join(workers[i].thread, NULL);
+    }
+}
+
+int process_thread_stats(profile_t *process, int nworkers)
+{
+    STATS_TIMED(STATS_THREAD_STATS);
+
+    PROFILE_LOCKED(process);
+
+    struct thread_table *table = &(process->tasks);
+    int task_fd = prax_openat(process->proc_fd, TASK,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+        return -1;
+
+    int ret = -1;
+
+    int ntasks = list_numeric_dir(task_fd, &(table->listing),
+                                  &(table->listing_cap));
+    if (ntasks < 0)
+        goto close_dir;
+
+    if (ntasks > table->cap) {
+        struct thread_stat *threads =
+            prax_realloc(table->threads, ntasks * sizeof *threads);
+        if (!threads)
+            goto close_dir;
+        table->threads = threads;
+        table->cap = ntasks;
+    }
+
+    fan_out(process, task_fd, ntasks, nworkers);
+
+    // Drop the threads that exited between the listing and the read.
+    size_t count = 0;
+    for (size_t i=0; i < (size_t) ntasks; i++) {
+        if (!table->threads[i].tid)
+            continue;
+        if (count != i)
+            table->threads[count] = table->threads[i];
+        count++;
+    }
+
+    table->count = count;
+    process->thread_count = count;
+    ret = 0;
+
+close_dir:
+    close(task_fd);
+
+    return ret;
+}
+
+void free_profile_threads(profile_t *process)
+{
+    struct thread_table *table = &(process->tasks);
+
+    free(table->threads);
+    free(table->listing);
+
+    memset(table, 0, sizeof *table);
+}
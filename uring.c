@@ -0,0 +1,235 @@
+#include "prax_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+// IORING_OP_LINKAT came in 5.15 along with opening straight into a fixed
+// file slot, which older kernels ignore to return a plain fd.
+static int supports_ops(int fd)
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ,
+                               IORING_OP_FILES_UPDATE, IORING_OP_LINKAT };
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+
+    struct io_uring_probe *probe = prax_calloc(1, len);
+    if (!probe)
+        return 0;
+
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                            probe, 256) == 0;
+
+    for (size_t i=0; supported && i < sizeof ops / sizeof ops[0]; i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+    }
+
+    free(probe);
+
+    return supported;
+}
+
+static int register_files(int fd, unsigned nfiles)
+{
+    int *files = prax_malloc(nfiles * sizeof *files);
+    if (!files)
+        return -1;
+
+    // Every slot starts empty, openat installs into them directly.
+    for (unsigned i=0; i < nfiles; i++)
+        files[i] = -1;
+
+    int ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES,
+                      files, nfiles);
+
+    free(files);
+
+    return ret;
+}
+
+static int clear_file(struct uring *ring, unsigned slot)
+{
+    int fd = -1;
+    struct io_uring_files_update update = {
+        .offset = slot,
+        .fds = (uintptr_t) &fd
+    };
+
+    return syscall(__NR_io_uring_register, ring->fd,
+                   IORING_REGISTER_FILES_UPDATE, &update, 1) < 0 ? -1 : 0;
+}
+
+// Opens / into fixed slot 0, which only counts as done when the kernel
+// answers 0 rather than a descriptor.
+static int probe_fixed_open(struct uring *ring)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) "/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+
+    if (uring_submit(ring, 1) < 0)
+        return -1;
+
+    struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+    if (!cqe)
+        return -1;
+
+    int res = cqe->res;
+    uring_cqe_seen(ring);
+
+    if (res > 0)
+        close(res);
+    if (res != 0)
+        return -1;
+
+    return clear_file(ring, 0);
+}
+
+int init_uring(struct uring *ring, unsigned entries, unsigned nfiles)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&params, 0, sizeof params);
+    ring->ring_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // One mapping holds both rings since 5.4, the only kernels with all
+    // the ops needed.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !supports_ops(ring->fd) || register_files(ring->fd, nfiles) < 0)
+        goto uring_error;
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->ring_map = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED)
+        goto uring_error;
+
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto uring_error;
+
+    char *map = ring->ring_map;
+    ring->sq_head = (unsigned *) (map + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (map + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *) (map + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+
+    if (nfiles && probe_fixed_open(ring) < 0)
+        goto uring_error;
+
+    return 0;
+
+uring_error:
+    free_uring(ring);
+
+    return -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail + ring->pending;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries)
+        return NULL;
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &(ring->sqes[index]);
+
+    ring->sq_array[index] = index;
+    ring->pending++;
+    memset(sqe, 0, sizeof *sqe);
+
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->pending;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+                     __ATOMIC_RELEASE);
+    ring->pending = 0;
+
+    while (to_submit || wait_nr) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        to_submit -= ret;
+        ring->submitted += ret;
+        // Completions already posted count toward wait_nr, the caller
+        // reaps them all so waiting once is enough.
+        wait_nr = 0;
+    }
+
+    return 0;
+}
+
+int uring_quiesce(struct uring *ring)
+{
+    // Only io_uring_enter consumes sqes without SQPOLL, so the ones it has
+    // not taken yet can be dropped from the queue.
+    __atomic_store_n(ring->sq_tail, *ring->sq_head, __ATOMIC_RELEASE);
+    ring->pending = 0;
+
+    while (ring->completed != ring->submitted) {
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)))
+            uring_cqe_seen(ring);
+
+        if (ring->completed == ring->submitted)
+            break;
+
+        int ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+void free_uring(struct uring *ring)
+{
+    if (ring->sqes != MAP_FAILED && ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->ring_map != MAP_FAILED && ring->ring_map)
+        munmap(ring->ring_map, ring->ring_len);
+    if (ring->fd > -1)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
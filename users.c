@@ -0,0 +1,172 @@
+#include "prax_internal.h"
+
+#include <pwd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+#define PASSWD "/etc/passwd"
+
+// Power of two, chains grow past it so it only bounds the lookup cost.
+#define USER_BUCKETS 1024
+
+// /etc/passwd is stat'ed at most this often.
+#define PASSWD_CHECK_NS 1000000000ULL
+
+#define USER_TTL_NS (60 * 1000000000ULL)
+
+struct user_entry {
+    uid_t uid;
+    // NULL for a uid without a passwd entry.
+    const char *name;
+    // Passwd epoch the entry was looked up in.
+    uint64_t epoch;
+    // Monotonic nanoseconds past which the entry is looked up again.
+    uint64_t expires;
+    struct user_entry *next;
+};
+
+/*
+ * Entries are pushed onto their chain under the mutex and never removed, so
+ * readers walk the chains without it.  A refreshed entry gets its new name
+ * swapped in and the old one is kept, a reader may still hold it.
+ */
+static struct {
+    struct user_entry *buckets[USER_BUCKETS];
+    pthread_mutex_t lock;
+    uint64_t ttl;
+    uint64_t epoch;
+    uint64_t checked;
+    struct timespec mtime;
+} users = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ttl = USER_TTL_NS
+};
+
+// Bumps the epoch when /etc/passwd was modified since the last check, only
+// one caller stats it per PASSWD_CHECK_NS.
+static uint64_t passwd_epoch(uint64_t now)
+{
+    uint64_t checked = __atomic_load_n(&(users.checked), __ATOMIC_RELAXED);
+
+    if (checked && now - checked < PASSWD_CHECK_NS)
+        return __atomic_load_n(&(users.epoch), __ATOMIC_ACQUIRE);
+
+    if (!__atomic_compare_exchange_n(&(users.checked), &checked, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return __atomic_load_n(&(users.epoch), __ATOMIC_ACQUIRE);
+
+    struct stat st;
+    if (stat(PASSWD, &st) == 0 &&
+        (st.st_mtim.tv_sec != users.mtime.tv_sec ||
+         st.st_mtim.tv_nsec != users.mtime.tv_nsec)) {
+        users.mtime = st.st_mtim;
+        __atomic_add_fetch(&(users.epoch), 1, __ATOMIC_ACQ_REL);
+    }
+
+    return __atomic_load_n(&(users.epoch), __ATOMIC_ACQUIRE);
+}
+
+static struct user_entry *find_user(uid_t uid)
+{
+    struct user_entry *entry =
+        __atomic_load_n(&(users.buckets[uid & (USER_BUCKETS - 1)]),
+                        __ATOMIC_ACQUIRE);
+
+    for (; entry; entry = entry->next) {
+        if (entry->uid == uid)
+            break;
+    }
+
+    return entry;
+}
+
+// Points *name at a copy of the name of uid, or NULL when NSS has no entry
+// for it.  Returns -1 on an NSS or allocation error.
+static int lookup_user(uid_t uid, char **name)
+{
+    struct passwd pwd, *result;
+    char stack_buf[1024];
+    char *buf = stack_buf;
+    size_t size = sizeof stack_buf;
+    int err;
+
+    *name = NULL;
+
+    while ((err = getpwuid_r(uid, &pwd, buf, size, &result)) == ERANGE) {
+        if (buf != stack_buf)
+            free(buf);
+        size *= 2;
+        if (!(buf = prax_malloc(size)))
+            return -1;
+    }
+
+    if (!err && result) {
+        STATS_ADD(allocs, 1);
+        if (!(*name = strdup(pwd.pw_name)))
+            err = ENOMEM;
+    }
+
+    if (buf != stack_buf)
+        free(buf);
+
+    return err ? -1 : 0;
+}
+
+const char *prax_username(uid_t uid)
+{
+    uint64_t now = stats_clock();
+    uint64_t epoch = passwd_epoch(now);
+
+    struct user_entry *entry = find_user(uid);
+    if (entry &&
+        __atomic_load_n(&(entry->epoch), __ATOMIC_ACQUIRE) == epoch &&
+        now < __atomic_load_n(&(entry->expires), __ATOMIC_RELAXED))
+        return __atomic_load_n(&(entry->name), __ATOMIC_ACQUIRE);
+
+    // NSS is called outside the lock, a slow source only holds up the
+    // callers missing on the same uid.  A failed lookup keeps the last name
+    // known, no entry drops it once /etc/passwd changed.
+    char *name;
+    bool failed = lookup_user(uid, &name) < 0;
+
+    pthread_mutex_lock(&(users.lock));
+
+    if (!(entry = find_user(uid))) {
+        entry = prax_calloc(1, sizeof *entry);
+        if (!entry) {
+            pthread_mutex_unlock(&(users.lock));
+            free(name);
+            return NULL;
+        }
+
+        struct user_entry **bucket =
+            &(users.buckets[uid & (USER_BUCKETS - 1)]);
+        entry->uid = uid;
+        entry->name = name;
+        entry->next = *bucket;
+        __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+    } else if (name && entry->name && !strcmp(name, entry->name)) {
+        free(name);
+    } else if (name || (!failed && entry->epoch != epoch)) {
+        __atomic_store_n(&(entry->name), name, __ATOMIC_RELEASE);
+    }
+
+    uint64_t ttl = __atomic_load_n(&(users.ttl), __ATOMIC_RELAXED);
+    __atomic_store_n(&(entry->expires), now + ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&(entry->epoch), epoch, __ATOMIC_RELEASE);
+
+    const char *cached = entry->name;
+
+    pthread_mutex_unlock(&(users.lock));
+
+    return cached;
+}
+
+void prax_username_ttl(uint64_t ttl_ns)
+{
+    __atomic_store_n(&(users.ttl), ttl_ns ? ttl_ns : USER_TTL_NS,
+                     __ATOMIC_RELAXED);
+}